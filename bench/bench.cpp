@@ -0,0 +1,247 @@
+//
+// Gravity Benchmarks
+//
+// Times each system on its own across rock counts, layouts and thread counts and
+// writes the results as json, one entry per (layout, rocks, threads, system).
+//
+// bench [--rocks 1000,10000,100000,1000000] [--threads 1,2,4] [--layouts box,plummer]
+//       [--systems tree_build,tree_update,...] [--reps N] [--density D] [--weak 0|1]
+//       [--seed S] [--out file]
+//
+// Rocks are spread to keep density constant (N / density area), so bigger runs
+// aren't just more collisions. With --weak 1 the rock counts are per thread.
+// Threads default to powers of two up to what tbb would use.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fmt/core.h>
+#include <oneapi/tbb/global_control.h>
+#include <oneapi/tbb/info.h>
+#include "../src/render.hpp"
+#include "../src/util.h"
+#include "../src/world.hpp"
+
+namespace {
+
+const std::vector<std::string> allSystems {
+    "tree_build", "tree_update", "gravity", "collision_find", "collision_resolve", "position", "render"};
+
+const std::vector<std::pair<std::string, Layout>> allLayouts {
+    {"box", Layout::Box}, {"plummer", Layout::Plummer}, {"disk", Layout::Disk}, {"collision", Layout::Collision}};
+
+struct Options {
+    std::vector<size_t> rocks {1000, 10000, 100000, 1000000};
+    std::vector<int> threads;  // empty = 1, 2, 4 ... default concurrency
+    std::vector<std::string> layouts {"box", "plummer"};
+    std::vector<std::string> systems {allSystems};
+    int reps {5};
+    float density {0.05f};  // rocks per unit area
+    bool weak {false};
+    uint64_t seed {1};
+    float timestep {1.0f / 60.0f};
+    std::string out;  // empty = stdout
+};
+
+/// Milliseconds for one system over the reps
+struct Result {
+    std::string layout;
+    size_t rocks {0};
+    int threads {0};
+    std::string system;
+    std::vector<double> samples;
+};
+
+void printUsage()
+{
+    fmt::print(stderr,
+               "usage: bench [--rocks N,N..] [--threads T,T..] [--layouts box,plummer,disk,collision]\n"
+               "             [--systems tree_build,tree_update,gravity,collision_find,\n"
+               "                        collision_resolve,position,render]\n"
+               "             [--reps N] [--density D] [--weak 0|1] [--seed S] [--out file]\n");
+}
+
+std::vector<std::string> split(std::string_view list)
+{
+    std::vector<std::string> items;
+    while (!list.empty()) {
+        size_t comma = list.find(',');
+        items.emplace_back(list.substr(0, comma));
+        list = (comma == std::string_view::npos) ? std::string_view {} : list.substr(comma + 1);
+    }
+    return items;
+}
+
+bool parseOptions(int argc, char* argv[], Options& options)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--help" || arg == "-h") return false;
+        if (i + 1 >= argc) {
+            fmt::print(stderr, "missing value for {}\n", arg);
+            return false;
+        }
+        const char* value = argv[++i];
+        if (arg == "--rocks") {
+            options.rocks.clear();
+            for (const auto& n : split(value)) options.rocks.push_back(std::strtoul(n.c_str(), nullptr, 10));
+        } else if (arg == "--threads") {
+            options.threads.clear();
+            for (const auto& n : split(value)) options.threads.push_back(std::atoi(n.c_str()));
+        } else if (arg == "--layouts") {
+            options.layouts = split(value);
+        } else if (arg == "--systems") {
+            options.systems = split(value);
+        } else if (arg == "--reps") {
+            options.reps = std::atoi(value);
+        } else if (arg == "--density") {
+            options.density = std::strtof(value, nullptr);
+        } else if (arg == "--weak") {
+            options.weak = (std::atoi(value) != 0);
+        } else if (arg == "--seed") {
+            options.seed = std::strtoull(value, nullptr, 10);
+        } else if (arg == "--out") {
+            options.out = value;
+        } else {
+            fmt::print(stderr, "unknown option {}\n", arg);
+            return false;
+        }
+    }
+    for (const auto& layout : options.layouts) {
+        if (std::none_of(allLayouts.begin(), allLayouts.end(), [&](const auto& l) { return l.first == layout; })) {
+            fmt::print(stderr, "unknown layout {}\n", layout);
+            return false;
+        }
+    }
+    for (const auto& system : options.systems) {
+        if (std::find(allSystems.begin(), allSystems.end(), system) == allSystems.end()) {
+            fmt::print(stderr, "unknown system {}\n", system);
+            return false;
+        }
+    }
+    return options.reps > 0 && options.density > 0.0f && !options.rocks.empty()
+        && std::all_of(options.threads.begin(), options.threads.end(), [](int t) { return t > 0; });
+}
+
+Layout layoutNamed(const std::string& name)
+{
+    return std::find_if(allLayouts.begin(), allLayouts.end(), [&](const auto& l) { return l.first == name; })->second;
+}
+
+/// Runs reps full steps on a fresh world timing each system in options.systems
+/// Systems run in the gui loop's order, ones not asked for still run untimed
+std::vector<Result> benchWorld(const Options& options, const std::string& layout, size_t rocks, int threads)
+{
+    World world(nullptr);
+    float extent = std::sqrt(rocks / options.density) / 2.0f;
+    world.worldExtent = 2.0f * extent;
+    addRandomRocks(world, rocks, RockConfig {.posExtent = extent, .layout = layoutNamed(layout), .seed = options.seed});
+    Renderer renderer;
+    sf::View view({0.0f, 0.0f}, {2.0f * extent, 2.0f * extent});
+    float pixel = 2.0f * extent / 1600.0f;
+
+    std::vector<Result> results;
+    for (const auto& system : options.systems) {
+        results.push_back(Result {.layout = layout, .rocks = rocks, .threads = threads, .system = system});
+    }
+    auto time = [&](const std::string& system, bool record, const std::function<void()>& run) {
+        util::Stopwatch watch;
+        run();
+        double ms = watch.elapsed();
+        auto result = std::find_if(results.begin(), results.end(), [&](const Result& r) { return r.system == system; });
+        if (record && result != results.end()) result->samples.push_back(ms);
+    };
+
+    // first step is warmup, and leaves the rocks moved so the incremental update has work
+    for (int rep = 0; rep <= options.reps; ++rep) {
+        bool record = (rep > 0);
+        world.incrementalTree = true;
+        time("tree_update", record, [&] { updateTreeSystem(world); });
+        world.incrementalTree = false;
+        time("tree_build", record, [&] { updateTreeSystem(world); });
+        time("gravity", record, [&] { updateGravitySystemTree(world, options.timestep); });
+        time("collision_find", record, [&] { findCollisions(world, options.timestep); });
+        time("collision_resolve", record, [&] { resolveCollisions(world); });
+        time("position", record, [&] { updateRockPositionSystem(world, options.timestep); });
+        time("render", record, [&] { renderer.update(world, view, pixel); });
+    }
+    return results;
+}
+
+double median(std::vector<double> samples)
+{
+    std::sort(samples.begin(), samples.end());
+    size_t mid = samples.size() / 2;
+    return (samples.size() % 2) ? samples[mid] : (samples[mid - 1] + samples[mid]) / 2.0;
+}
+
+void writeJson(std::FILE* file, const Options& options, const std::vector<Result>& results)
+{
+    fmt::print(file, "{{\n");
+    fmt::print(file, "  \"hardware_threads\": {},\n", tbb::info::default_concurrency());
+    fmt::print(file, "  \"reps\": {},\n", options.reps);
+    fmt::print(file, "  \"density\": {},\n", options.density);
+    fmt::print(file, "  \"weak\": {},\n", options.weak);
+    fmt::print(file, "  \"seed\": {},\n", options.seed);
+    fmt::print(file, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        double mean = 0.0;
+        for (double ms : r.samples) mean += ms / r.samples.size();
+        fmt::print(file,
+                   "    {{\"layout\": \"{}\", \"rocks\": {}, \"threads\": {}, \"system\": \"{}\", "
+                   "\"median_ms\": {:.4f}, \"min_ms\": {:.4f}, \"mean_ms\": {:.4f}}}{}\n",
+                   r.layout, r.rocks, r.threads, r.system, median(r.samples),
+                   *std::min_element(r.samples.begin(), r.samples.end()), mean,
+                   i + 1 < results.size() ? "," : "");
+    }
+    fmt::print(file, "  ]\n}}\n");
+}
+
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        printUsage();
+        return 1;
+    }
+    if (options.threads.empty()) {
+        for (int t = 1; t < tbb::info::default_concurrency(); t *= 2) options.threads.push_back(t);
+        options.threads.push_back(tbb::info::default_concurrency());
+    }
+
+    std::vector<Result> results;
+    for (const auto& layout : options.layouts) {
+        for (size_t rocks : options.rocks) {
+            for (int threads : options.threads) {
+                tbb::global_control threadLimit(tbb::global_control::max_allowed_parallelism, threads);
+                size_t n = options.weak ? rocks * threads : rocks;
+                for (Result& r : benchWorld(options, layout, n, threads)) {
+                    fmt::print(stderr, "{:>9} {:>8} rocks {:>3} threads {:>17} {:>10.3f} ms\n",
+                               r.layout, r.rocks, r.threads, r.system, median(r.samples));
+                    results.push_back(std::move(r));
+                }
+            }
+        }
+    }
+
+    std::FILE* file = stdout;
+    if (!options.out.empty()) {
+        file = std::fopen(options.out.c_str(), "w");
+        if (!file) {
+            fmt::print(stderr, "could not open {}\n", options.out);
+            return 1;
+        }
+    }
+    writeJson(file, options, results);
+    if (file != stdout) std::fclose(file);
+    return 0;
+}
@@ -0,0 +1,588 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <new>
+#include <fmt/core.h>
+#include <oneapi/tbb/enumerable_thread_specific.h>
+#include <oneapi/tbb/info.h>
+#include <oneapi/tbb/parallel_for.h>
+#include "domain.hpp"
+#include "kernel.hpp"
+#include "order.hpp"
+#include "profile.hpp"
+#include "util.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char** environ;
+
+//
+// Shared segment layout, everything in it is trivially copyable and position independent
+//
+
+/// Barrier between processes, timed waits so a dead party can't hang the rest
+struct SharedBarrier {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint32_t parties {0};
+    uint32_t arrived {0};
+    uint64_t generation {0};
+    bool broken {false}; // a party died, every wait fails from now on
+};
+
+/// Rocks of one domain in one tree node cellDepth under the root
+struct DomainCell {
+    float left {0.0f};
+    float bottom {0.0f};
+    float width {0.0f};
+    float mass {0.0f};
+    sf::Vector2f center {0.0f, 0.0f}; // of mass
+    float reach {0.0f}; // largest radius plus move in the step of its rocks
+    uint32_t begin {0}; // rocks in the shared array
+    uint32_t end {0};
+};
+
+struct DomainRange {
+    uint32_t begin {0}; // rocks in the shared array
+    uint32_t end {0};
+    uint32_t cells {0}; // written by the worker
+    double ms {0.0}; // worker's last step
+};
+
+constexpr int maxDomainWorkers {64};
+
+/// Header of the segment, followed by capacity rocks then cellCapacity cells per worker
+struct DomainShared {
+    SharedBarrier barrier;
+    pid_t driver {0};
+    uint32_t workers {0};
+    uint32_t cellDepth {0};
+    uint64_t capacity {0}; // rocks
+    uint64_t cellCapacity {0}; // per worker
+    bool stopping {false};
+    // step settings, copied from the driver's world
+    float timestep {0.0f};
+    float gravity {0.0f};
+    float theta {0.0f};
+    int leafSize {16};
+    bool ignoreShortDistGrav {true};
+    bool sweptCollisions {true};
+    Expansion expansion {Expansion::Monopole};
+    Broadphase broadphase {Broadphase::Tree};
+    RootSquare root;
+    DomainRange ranges[maxDomainWorkers];
+};
+
+namespace {
+
+constexpr size_t rocksOffset {(sizeof(DomainShared) + 63) / 64 * 64};
+
+Rock* sharedRocks(DomainShared* shared)
+{
+    return reinterpret_cast<Rock*>(reinterpret_cast<char*>(shared) + rocksOffset);
+}
+
+DomainCell* sharedCells(DomainShared* shared, int worker)
+{
+    auto* cells = reinterpret_cast<DomainCell*>(sharedRocks(shared) + shared->capacity);
+    return cells + worker * shared->cellCapacity;
+}
+
+size_t segmentBytes(size_t capacity, int workers, int cellDepth)
+{
+    size_t cells = size_t(1) << (2 * cellDepth);
+    return rocksOffset + capacity * sizeof(Rock) + workers * cells * sizeof(DomainCell);
+}
+
+void initBarrier(SharedBarrier& barrier, uint32_t parties)
+{
+    pthread_mutexattr_t mutexAttr;
+    pthread_mutexattr_init(&mutexAttr);
+    pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&barrier.mutex, &mutexAttr);
+    pthread_mutexattr_destroy(&mutexAttr);
+    pthread_condattr_t condAttr;
+    pthread_condattr_init(&condAttr);
+    pthread_condattr_setpshared(&condAttr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&barrier.cond, &condAttr);
+    pthread_condattr_destroy(&condAttr);
+    barrier.parties = parties;
+}
+
+void destroyBarrier(SharedBarrier& barrier)
+{
+    pthread_cond_destroy(&barrier.cond);
+    pthread_mutex_destroy(&barrier.mutex);
+}
+
+/// Waits for every party, alive() is asked every 100 ms while waiting
+/// False if some party was found dead, by this wait or an earlier one
+template <class Alive>
+bool waitBarrier(SharedBarrier& barrier, Alive&& alive)
+{
+    pthread_mutex_lock(&barrier.mutex);
+    uint64_t generation = barrier.generation;
+    if (++barrier.arrived == barrier.parties) {
+        barrier.arrived = 0;
+        ++barrier.generation;
+        pthread_cond_broadcast(&barrier.cond);
+    }
+    while (generation == barrier.generation && !barrier.broken) {
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100'000'000;
+        if (deadline.tv_nsec >= 1'000'000'000) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1'000'000'000;
+        }
+        pthread_cond_timedwait(&barrier.cond, &barrier.mutex, &deadline);
+        if (generation == barrier.generation && !barrier.broken && !alive()) {
+            barrier.broken = true;
+            pthread_cond_broadcast(&barrier.cond);
+        }
+    }
+    bool ok = !barrier.broken;
+    pthread_mutex_unlock(&barrier.mutex);
+    return ok;
+}
+
+/// Inverse of the bit spreading in mortonKey, even bits to the low half
+uint32_t compactBits(uint32_t x)
+{
+    x &= 0x55555555;
+    x = (x | (x >> 1)) & 0x33333333;
+    x = (x | (x >> 2)) & 0x0f0f0f0f;
+    x = (x | (x >> 4)) & 0x00ff00ff;
+    x = (x | (x >> 8)) & 0x0000ffff;
+    return x;
+}
+
+/// Radius plus how far the rock moves in the step, what collisions are found within
+float collisionReach(const DomainShared& shared, const Rock& rock)
+{
+    float sweep = shared.sweptCollisions ? std::max(shared.timestep, 0.0f) : 0.0f;
+    return rock.radius + std::sqrt(rock.vel.x * rock.vel.x + rock.vel.y * rock.vel.y) * sweep;
+}
+
+/// Splits worker index's rocks (in Morton order) into runs sharing a cell
+void publishCells(DomainShared& shared, int index)
+{
+    DomainRange& range = shared.ranges[index];
+    DomainCell* cells = sharedCells(&shared, index);
+    const Rock* rocks = sharedRocks(&shared);
+    const RootSquare root = shared.root;
+    const int shift = 32 - 2 * shared.cellDepth;
+    const float cellWidth = root.width / (1 << shared.cellDepth);
+    uint32_t count = 0;
+    uint32_t current = 0;
+    for (uint32_t i = range.begin; i < range.end; ++i) {
+        const Rock& rock = rocks[i];
+        uint32_t cell = shift < 32 ? mortonKey(rock.pos, root.min, root.width) >> shift : 0;
+        if (count == 0 || cell != current) {
+            current = cell;
+            cells[count++] = {.left = root.min.x + compactBits(cell) * cellWidth,
+                              .bottom = root.min.y + compactBits(cell >> 1) * cellWidth,
+                              .width = cellWidth, .begin = i, .end = i};
+        }
+        DomainCell& last = cells[count - 1];
+        last.center += rock.pos * rock.mass;
+        last.mass += rock.mass;
+        last.reach = std::max(last.reach, collisionReach(shared, rock));
+        last.end = i + 1;
+    }
+    for (uint32_t c = 0; c < count; ++c) {
+        DomainCell& cell = cells[c];
+        float half = cell.width / 2.0f;
+        cell.center = (cell.mass > 0.0f) ? cell.center / cell.mass
+                                         : sf::Vector2f(cell.left + half, cell.bottom + half);
+    }
+    range.cells = count;
+}
+
+/// Appends the other domains' rocks that could collide with rocks this step, a rock
+/// within its reach plus the farthest local reach of the box around rocks
+void appendHalo(DomainShared& shared, int index, std::vector<Rock>& rocks)
+{
+    if (rocks.empty()) return;
+    sf::Vector2f boxMin = rocks[0].pos;
+    sf::Vector2f boxMax = boxMin;
+    float localReach = 0.0f;
+    for (const Rock& rock : rocks) {
+        boxMin = {std::min(boxMin.x, rock.pos.x), std::min(boxMin.y, rock.pos.y)};
+        boxMax = {std::max(boxMax.x, rock.pos.x), std::max(boxMax.y, rock.pos.y)};
+        localReach = std::max(localReach, collisionReach(shared, rock));
+    }
+    const Rock* remote = sharedRocks(&shared);
+    for (uint32_t d = 0; d < shared.workers; ++d) {
+        if (static_cast<int>(d) == index) continue;
+        const DomainCell* cells = sharedCells(&shared, d);
+        for (uint32_t c = 0; c < shared.ranges[d].cells; ++c) {
+            const DomainCell& cell = cells[c];
+            float r = cell.reach + localReach;
+            if (cell.left - r > boxMax.x || cell.left + cell.width + r < boxMin.x
+                || cell.bottom - r > boxMax.y || cell.bottom + cell.width + r < boxMin.y) {
+                continue;
+            }
+            for (uint32_t i = cell.begin; i < cell.end; ++i) {
+                const Rock& rock = remote[i];
+                float rr = collisionReach(shared, rock) + localReach;
+                if (rock.pos.x >= boxMin.x - rr && rock.pos.x <= boxMax.x + rr
+                    && rock.pos.y >= boxMin.y - rr && rock.pos.y <= boxMax.y + rr) {
+                    rocks.push_back(rock);
+                }
+            }
+        }
+    }
+}
+
+struct RemoteSources {
+    SourceBatch far;
+    SourceBatch near;
+};
+
+/// Kicks each leaf of world's tree with the other domains' cells, whole when far
+/// enough from the leaf's rocks by theta and otherwise rock by rock
+void addRemoteGravity(DomainShared& shared, int index, World& world,
+                      tbb::enumerable_thread_specific<RemoteSources>& remoteSources)
+{
+    const Tree& tree = world.rootTree;
+    const Rock* rocks = sharedRocks(&shared);
+    const float timestep = shared.timestep;
+    tbb::parallel_for(tbb::blocked_range<int32_t>(0, static_cast<int32_t>(tree.nodes.size()), 64),
+                      [&](const auto& range) {
+        RemoteSources& sources = remoteSources.local();
+        for (int32_t leaf = range.begin(); leaf != range.end(); ++leaf) {
+            if (tree.elements(leaf).empty()) continue;
+            sf::Vector2f boxMin = tree.elements(leaf)[0]->pos;
+            sf::Vector2f boxMax = boxMin;
+            for (const Rock* rock : tree.elements(leaf)) {
+                boxMin = {std::min(boxMin.x, rock->pos.x), std::min(boxMin.y, rock->pos.y)};
+                boxMax = {std::max(boxMax.x, rock->pos.x), std::max(boxMax.y, rock->pos.y)};
+            }
+            sources.far.clear();
+            sources.near.clear();
+            for (uint32_t d = 0; d < shared.workers; ++d) {
+                if (static_cast<int>(d) == index) continue;
+                const DomainCell* cells = sharedCells(&shared, d);
+                for (uint32_t c = 0; c < shared.ranges[d].cells; ++c) {
+                    const DomainCell& cell = cells[c];
+                    float dx = std::max({boxMin.x - cell.center.x, 0.0f, cell.center.x - boxMax.x});
+                    float dy = std::max({boxMin.y - cell.center.y, 0.0f, cell.center.y - boxMax.y});
+                    if (cell.width < shared.theta * std::sqrt(dx * dx + dy * dy)) {
+                        sources.far.add(cell.center, cell.mass, 0.0f);
+                        continue;
+                    }
+                    for (uint32_t i = cell.begin; i < cell.end; ++i) {
+                        sources.near.add(rocks[i].pos, rocks[i].mass, rocks[i].radius);
+                    }
+                }
+            }
+            for (Rock* rock : tree.elements(leaf)) {
+                sf::Vector2f accel = batchAccel<2, false>(sources.far, rock->pos, rock->radius)
+                    + batchAccel(sources.near, rock->pos, rock->radius, shared.ignoreShortDistGrav);
+                rock->vel += accel * (shared.gravity * timestep);
+            }
+        }
+    });
+}
+
+void applySettings(const DomainShared& shared, World& world)
+{
+    world.gravity = shared.gravity;
+    world.theta = shared.theta;
+    world.leafSize = shared.leafSize;
+    world.ignoreShortDistGrav = shared.ignoreShortDistGrav;
+    world.sweptCollisions = shared.sweptCollisions;
+    world.expansion = shared.expansion;
+    world.broadphase = shared.broadphase;
+    world.fitRoot = true; // every rock in the tree, the remote pass walks its leaves
+}
+
+std::string workerExecutable()
+{
+    std::error_code error;
+    auto self = std::filesystem::read_symlink("/proc/self/exe", error);
+    if (error) return "./domain_worker";
+    return (self.parent_path() / "domain_worker").string();
+}
+
+}  // namespace
+
+bool runDomainWorker(DomainShared* shared, int index)
+{
+    // a worker thread shares the driver's pid, a worker process is its child
+    auto alive = [shared] { return ::getpid() == shared->driver || ::getppid() == shared->driver; };
+    World world(nullptr);
+    tbb::enumerable_thread_specific<RemoteSources> remoteSources;
+    if (!waitBarrier(shared->barrier, alive)) return false; // attached
+    while (true) {
+        if (!waitBarrier(shared->barrier, alive)) return false; // rocks are in
+        if (shared->stopping) return true;
+        util::Stopwatch watch;
+        DomainRange& range = shared->ranges[index];
+        Rock* rocks = sharedRocks(shared);
+        world.rocks.assign(rocks + range.begin, rocks + range.end);
+        applySettings(*shared, world);
+        publishCells(*shared, index);
+        if (!waitBarrier(shared->barrier, alive)) return false; // every domain's cells are in
+        // collisions first, while every domain's rocks in shared memory are unkicked
+        const size_t owned = world.rocks.size();
+        appendHalo(*shared, index, world.rocks);
+        updateTreeSystem(world);
+        updateCollisionSystemPar(world, shared->timestep);
+        world.rocks.resize(owned); // the halo's owners step it
+        updateTreeSystem(world);
+        updateGravitySystemTree(world, shared->timestep);
+        addRemoteGravity(*shared, index, world, remoteSources);
+        updateRockPositionSystem(world, shared->timestep);
+        if (!waitBarrier(shared->barrier, alive)) return false; // no one reads the rocks now
+        std::copy(world.rocks.begin(), world.rocks.end(), rocks + range.begin);
+        range.ms = watch.elapsed();
+        if (!waitBarrier(shared->barrier, alive)) return false; // results are in
+    }
+}
+
+DomainShared* mapDomainSegment(const std::string& name)
+{
+    int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        fmt::print(stderr, "could not open shared memory {}\n", name);
+        return nullptr;
+    }
+    struct stat info;
+    void* map = MAP_FAILED;
+    if (::fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) >= sizeof(DomainShared)) {
+        map = ::mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        fmt::print(stderr, "could not map shared memory {}\n", name);
+        return nullptr;
+    }
+    return static_cast<DomainShared*>(map);
+}
+
+//
+// Domain Sim
+//
+
+DomainSim::DomainSim(DomainConfig config)
+    : settings {config}
+{
+    settings.workers = std::clamp(settings.workers, 1, maxDomainWorkers);
+    settings.cellDepth = std::clamp(settings.cellDepth, 0, 8);
+    launch(0);
+}
+
+DomainSim::~DomainSim()
+{
+    stop();
+}
+
+bool DomainSim::launch(size_t capacity)
+{
+    capacity = std::max<size_t>(capacity, 4096);
+    mappedBytes = segmentBytes(capacity, settings.workers, settings.cellDepth);
+    void* map = MAP_FAILED;
+    if (settings.launch == DomainLaunch::Processes) {
+        static int segments = 0;
+        segmentName = fmt::format("/gravity-domains-{}-{}", ::getpid(), segments++);
+        int fd = ::shm_open(segmentName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd >= 0 && ::ftruncate(fd, mappedBytes) == 0) {
+            map = ::mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if (fd >= 0) ::close(fd);
+        if (map == MAP_FAILED) ::shm_unlink(segmentName.c_str());
+    } else {
+        segmentName.clear();
+        map = ::mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    }
+    if (map == MAP_FAILED) {
+        fmt::print(stderr, "could not create {} bytes of shared memory\n", mappedBytes);
+        return false;
+    }
+    shared = new (map) DomainShared {};
+    initBarrier(shared->barrier, settings.workers + 1);
+    shared->driver = ::getpid();
+    shared->workers = settings.workers;
+    shared->cellDepth = settings.cellDepth;
+    shared->capacity = capacity;
+    shared->cellCapacity = size_t(1) << (2 * settings.cellDepth);
+
+    if (settings.launch == DomainLaunch::Processes) {
+        std::string path = settings.workerPath.empty() ? workerExecutable() : settings.workerPath;
+        // split this machine's threads between the workers
+        int threads = std::max(1, tbb::info::default_concurrency() / settings.workers);
+        for (int i = 0; i < settings.workers; ++i) {
+            std::string index = std::to_string(i);
+            std::string threadCount = std::to_string(threads);
+            char* argv[] = {path.data(), segmentName.data(), index.data(), threadCount.data(), nullptr};
+            pid_t pid;
+            if (::posix_spawn(&pid, path.c_str(), nullptr, nullptr, argv, environ) != 0) {
+                fmt::print(stderr, "could not start {}\n", path);
+                break;
+            }
+            processes.push_back(pid);
+        }
+    } else {
+        for (int i = 0; i < settings.workers; ++i) {
+            threads.emplace_back([this, i] { runDomainWorker(shared, i); });
+        }
+    }
+    bool started = processes.size() + threads.size() == static_cast<size_t>(settings.workers);
+    if (!started) {
+        // the ones that did start find the barrier broken and exit
+        pthread_mutex_lock(&shared->barrier.mutex);
+        shared->barrier.broken = true;
+        pthread_cond_broadcast(&shared->barrier.cond);
+        pthread_mutex_unlock(&shared->barrier.mutex);
+    }
+    auto alive = [this] {
+        for (pid_t pid : processes) {
+            if (::waitpid(pid, nullptr, WNOHANG) != 0) return false;
+        }
+        return true;
+    };
+    if (!started || !waitBarrier(shared->barrier, alive)) {
+        if (started) fmt::print(stderr, "domain workers did not start\n");
+        stop();
+        return false;
+    }
+    // every worker has it mapped, the name isn't needed any more
+    if (!segmentName.empty()) ::shm_unlink(segmentName.c_str());
+    segmentName.clear();
+    return true;
+}
+
+void DomainSim::stop()
+{
+    if (!shared) return;
+    auto alive = [this] {
+        for (pid_t pid : processes) {
+            if (::waitpid(pid, nullptr, WNOHANG) != 0) return false;
+        }
+        return true;
+    };
+    if (!shared->barrier.broken) {
+        shared->stopping = true;
+        waitBarrier(shared->barrier, alive);
+    }
+    for (pid_t pid : processes) ::waitpid(pid, nullptr, 0);
+    processes.clear();
+    for (std::thread& thread : threads) thread.join();
+    threads.clear();
+    destroyBarrier(shared->barrier);
+    ::munmap(shared, mappedBytes);
+    shared = nullptr;
+    if (!segmentName.empty()) ::shm_unlink(segmentName.c_str());
+    segmentName.clear();
+}
+
+std::optional<StepTimings> DomainSim::step(World& world, float timestep)
+{
+    if (!shared) return std::nullopt;
+    profile::Scope zone {"domains"};
+    StepTimings timings;
+    util::Stopwatch watch;
+    const size_t n = world.rocks.size();
+    if (n > shared->capacity) {
+        stop();
+        if (!launch(2 * n)) return std::nullopt;
+    }
+    if (n > 0) {
+        shared->root = fitRootSquare(world.rocks);
+        reorderRocks(world, shared->root);
+    }
+    shared->timestep = timestep;
+    shared->gravity = world.gravity;
+    shared->theta = world.theta;
+    shared->leafSize = world.leafSize;
+    shared->ignoreShortDistGrav = world.ignoreShortDistGrav;
+    shared->sweptCollisions = world.sweptCollisions;
+    shared->expansion = world.expansion;
+    shared->broadphase = world.broadphase;
+    for (int i = 0; i < settings.workers; ++i) {
+        shared->ranges[i].begin = static_cast<uint32_t>(n * i / settings.workers);
+        shared->ranges[i].end = static_cast<uint32_t>(n * (i + 1) / settings.workers);
+    }
+    Rock* rocks = sharedRocks(shared);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, n, 16384), [&](const auto& range) {
+        std::copy(world.rocks.begin() + range.begin(), world.rocks.begin() + range.end(), rocks + range.begin());
+    });
+    timings.tree = watch.restart();
+
+    auto alive = [this] {
+        for (size_t i = 0; i < processes.size(); ++i) {
+            if (::waitpid(processes[i], nullptr, WNOHANG) != 0) {
+                fmt::print(stderr, "domain worker {} exited\n", i);
+                return false;
+            }
+        }
+        return true;
+    };
+    // rocks in, cells in, rocks read, results in
+    for (int phase = 0; phase < 4; ++phase) {
+        if (!waitBarrier(shared->barrier, alive)) {
+            stop();
+            return std::nullopt;
+        }
+    }
+    timings.gravity = watch.restart();
+    // the workers' phase is what theta trades against, like the gravity systems' own
+    world.thetaControl.lastMs = static_cast<float>(timings.gravity);
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, n, 16384), [&](const auto& range) {
+        std::copy(rocks + range.begin(), rocks + range.end(), world.rocks.begin() + range.begin());
+    });
+    world.blockSteps.accels.clear();
+    world.collisions.pairs.clear();
+    world.collisions.merged = 0;
+    updateTreeSystem(world);
+    timings.tree += watch.restart();
+    return timings;
+}
+
+std::vector<double> DomainSim::workerMs() const
+{
+    std::vector<double> ms;
+    if (!shared) return ms;
+    for (int i = 0; i < settings.workers; ++i) ms.push_back(shared->ranges[i].ms);
+    return ms;
+}
+
+#else
+
+// no shared memory processes on windows yet, the sim never starts
+
+struct DomainShared {};
+
+bool runDomainWorker(DomainShared*, int) { return false; }
+
+DomainShared* mapDomainSegment(const std::string&) { return nullptr; }
+
+DomainSim::DomainSim(DomainConfig config)
+    : settings {config}
+{
+    fmt::print(stderr, "domain decomposition needs posix shared memory\n");
+}
+
+DomainSim::~DomainSim() {}
+
+bool DomainSim::launch(size_t) { return false; }
+
+void DomainSim::stop() {}
+
+std::optional<StepTimings> DomainSim::step(World&, float) { return std::nullopt; }
+
+std::vector<double> DomainSim::workerMs() const { return {}; }
+
+#endif
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "runner.hpp"
+#include "world.hpp"
+
+//
+// Domain Decomposition - one step of the world split across worker processes
+//
+
+/// How DomainSim runs its workers. Threads run the same worker code in this
+/// process, for tests and for checking the decomposition without the worker binary
+enum class DomainLaunch { Processes, Threads };
+
+struct DomainConfig {
+    int workers {2};
+    int cellDepth {5}; // summary cells are the tree nodes this deep under the root
+    DomainLaunch launch {DomainLaunch::Processes};
+    std::string workerPath; // empty means domain_worker next to this executable
+};
+
+struct DomainShared; // layout of the shared segment, see domain.cpp
+
+/// Steps a world with its rocks split into Morton key ranges of equal count, one
+/// per worker, in a segment of shared memory (POSIX shm, workers are spawned, not
+/// forked, since tbb's threads don't survive a fork)
+/// Each step the driver sorts the rocks into Morton order in the fitted root and
+/// copies them in. Each worker publishes summary cells (mass, center and collision
+/// reach of its rocks in each tree node cellDepth down), then collides its rocks
+/// with a halo: copies of the other domains' rocks that could reach them this step.
+/// A pair across a boundary is found on both sides and each keeps its own rock's
+/// result. Then it builds a tree over its range for its own gravity. For other
+/// domains a worker's leaves use a cell whole when it is far enough by theta,
+/// otherwise the cell's rocks straight from shared memory, like a locally essential
+/// tree. So a domain step collides then kicks, like the fused walk. Results are
+/// copied back into world.rocks (left in Morton order) and the tree is rebuilt
+/// Workers don't own rocks between steps: world.rocks stays the copy that is drawn
+/// and edited, so every step is a full sort, scatter and gather (timed as tree)
+/// mergeCollisions and blockTimesteps aren't done by workers, the ui turns them off
+class DomainSim {
+public:
+    /// Starts the workers, check isRunning() afterwards
+    explicit DomainSim(DomainConfig config);
+    /// Stops the workers
+    ~DomainSim();
+
+    DomainSim(const DomainSim&) = delete;
+    DomainSim& operator=(const DomainSim&) = delete;
+
+    bool isRunning() const { return shared != nullptr; }
+    const DomainConfig& config() const { return settings; }
+
+    /// One step of world, timed like stepWorld (workers count as gravity, copying
+    /// rocks in and out as tree). The workers' time is also thetaControl.lastMs, for
+    /// updateThetaSystem after. Nothing if a worker died, the sim is stopped then
+    std::optional<StepTimings> step(World& world, float timestep);
+
+    /// Milliseconds each worker spent on the last step, to see the load balance
+    std::vector<double> workerMs() const;
+
+private:
+    bool launch(size_t capacity);
+    void stop();
+
+    DomainConfig settings;
+    DomainShared* shared {nullptr};
+    size_t mappedBytes {0};
+    std::string segmentName; // empty with Threads
+    std::vector<int> processes; // worker pids
+    std::vector<std::thread> threads;
+};
+
+/// Serves steps from a mapped segment as worker index until the driver stops
+/// Returns false if the driver or another worker went away
+bool runDomainWorker(DomainShared* shared, int index);
+
+/// Maps the named segment for the domain_worker executable, null if it can't
+DomainShared* mapDomainSegment(const std::string& name);
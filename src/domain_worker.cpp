@@ -0,0 +1,26 @@
+//
+// Domain Worker - one process of a DomainSim, started by the driver
+//
+// domain_worker segment index threads
+//
+// Maps the driver's shared memory segment and steps rocks range index of it until
+// the driver stops, using at most threads threads
+//
+
+#include <cstdlib>
+#include <fmt/core.h>
+#include <oneapi/tbb/global_control.h>
+#include "domain.hpp"
+
+int main(int argc, char* argv[])
+{
+    if (argc != 4) {
+        fmt::print(stderr, "usage: domain_worker segment index threads\n");
+        return 1;
+    }
+    DomainShared* shared = mapDomainSegment(argv[1]);
+    if (!shared) return 1;
+    tbb::global_control threadLimit(tbb::global_control::max_allowed_parallelism,
+                                    std::max(1, std::atoi(argv[3])));
+    return runDomainWorker(shared, std::atoi(argv[2])) ? 0 : 1;
+}
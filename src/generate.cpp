@@ -0,0 +1,136 @@
+#include <algorithm>
+#include <cmath>
+#include <oneapi/tbb/parallel_for.h>
+#include "generate.hpp"
+
+namespace {
+
+constexpr float twoPi {6.2831853f};
+
+/// Expected mass of a rock, mass is radius^3 with radius uniform in [min, max]
+float meanMass(const RockConfig& config)
+{
+    float a = config.radiusMin;
+    float b = config.radiusMax;
+    if (b - a < 1e-6f) return a * a * a;
+    return (b * b * b * b - a * a * a * a) / (4.0f * (b - a));
+}
+
+/// Random direction in 3d, in 2d projected onto the plane so length is scaled by sin
+/// of the tilt
+template <int Dim>
+Vec<Dim> randomDirection(util::Random& random)
+{
+    float z = random.uniform(-1.0f, 1.0f);
+    float phi = random.uniform(0.0f, twoPi);
+    float s = std::sqrt(1.0f - z * z);
+    if constexpr (Dim == 2) {
+        return {s * std::cos(phi), s * std::sin(phi)};
+    } else {
+        return {s * std::cos(phi), s * std::sin(phi), z};
+    }
+}
+
+/// Vector in the x-y plane
+template <int Dim>
+Vec<Dim> planar(float x, float y)
+{
+    if constexpr (Dim == 2) {
+        return {x, y};
+    } else {
+        return {x, y, 0.0f};
+    }
+}
+
+/// Position and velocity relative to a Plummer sphere's center (Aarseth, Henon & Wielen 1974)
+/// mass is the sphere's total, scale its radius, sampling stops at cutoff
+template <int Dim>
+void plummerRock(Body<Dim>& rock, util::Random& random, float mass, float scale, float cutoff, float gravity)
+{
+    float r;
+    do {
+        // invert the enclosed mass fraction u = r^3 / (r^2 + a^2)^3/2
+        float u = std::max(random.uniform(), 1e-6f);
+        r = scale / std::sqrt(std::pow(u, -2.0f / 3.0f) - 1.0f);
+    } while (r > cutoff);
+    rock.pos = r * randomDirection<Dim>(random);
+
+    // speed as a fraction q of escape speed, q^2 (1 - q^2)^7/2 by rejection
+    float q, g;
+    do {
+        q = random.uniform();
+        g = random.uniform(0.0f, 0.1f);
+    } while (g > q * q * std::pow(1.0f - q * q, 3.5f));
+    float escape = std::sqrt(2.0f * gravity * mass) * std::pow(r * r + scale * scale, -0.25f);
+    rock.vel = q * escape * randomDirection<Dim>(random);
+}
+
+template <int Dim>
+void diskRock(Body<Dim>& rock, util::Random& random, float mass, float radius, float gravity)
+{
+    float r = radius * std::sqrt(std::max(random.uniform(), 1e-6f));
+    float phi = random.uniform(0.0f, twoPi);
+    float c = std::cos(phi);
+    float s = std::sin(phi);
+    rock.pos = r * planar<Dim>(c, s);
+    // circular speed from the mass inside r, M r^2 / R^2, with a little scatter
+    float speed = std::sqrt(gravity * mass * r) / radius;
+    rock.vel = speed * (1.0f + 0.05f * random.normal()) * planar<Dim>(-s, c);
+}
+
+/// Box rock, in 3d the z axis is drawn after newRandomRock's draws
+template <int Dim>
+Body<Dim> boxRock(const RockConfig& config, util::Random& random)
+{
+    Rock flat = newRandomRock(config, random);
+    if constexpr (Dim == 2) {
+        return flat;
+    } else {
+        float z = random.uniform(-config.posExtent, config.posExtent);
+        float vz = random.uniform(-config.velExtent, config.velExtent);
+        return {.pos = {flat.pos.x, flat.pos.y, z}, .vel = {flat.vel.x, flat.vel.y, vz},
+                .radius = flat.radius, .mass = flat.mass};
+    }
+}
+
+}  // namespace
+
+template <int Dim>
+void generateRocks(std::span<Body<Dim>> rocks, const RockConfig& config, float gravity, uint64_t firstIndex)
+{
+    const size_t n = rocks.size();
+    const float totalMass = meanMass(config) * n;
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, n, 4096), [&](const auto& range) {
+        for (size_t i = range.begin(); i != range.end(); ++i) {
+            util::Random random(config.seed, firstIndex + i);
+            Body<Dim>& rock = rocks[i];
+            if (config.layout == Layout::Box) {
+                rock = boxRock<Dim>(config, random);
+                continue;
+            }
+            rock.radius = random.uniform(config.radiusMin, config.radiusMax);
+            rock.mass = rock.radius * rock.radius * rock.radius;
+            switch (config.layout) {
+            case Layout::Plummer:
+                plummerRock(rock, random, totalMass, config.posExtent / 5.0f, config.posExtent, gravity);
+                break;
+            case Layout::Disk:
+                diskRock(rock, random, totalMass, config.posExtent, gravity);
+                break;
+            case Layout::Collision: {
+                float side = (i < n / 2) ? -1.0f : 1.0f;
+                float half = config.posExtent / 2.0f;
+                plummerRock(rock, random, totalMass / 2.0f, half / 5.0f, half, gravity);
+                rock.pos += side * planar<Dim>(half, half / 10.0f);
+                rock.vel.x -= side * config.velExtent / 2.0f;
+                break;
+            }
+            default:
+                break;
+            }
+        }
+    });
+}
+
+template void generateRocks<2>(std::span<Rock>, const RockConfig&, float, uint64_t);
+template void generateRocks<3>(std::span<Rock3>, const RockConfig&, float, uint64_t);
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include "rock.hpp"
+
+//
+// Initial Conditions - rocks generated in parallel from a seed
+//
+
+/// Fills rocks with config.layout, rock i uses random stream firstIndex + i so the
+/// result only depends on the seed and indices, not on threads. gravity is used to
+/// give each layout the velocities that roughly hold it together, from the mass of
+/// these rocks only, so other than Box adding in parts differs from adding at once
+///  Box: uniform in +/-posExtent, velocities uniform in +/-velExtent
+///  Plummer: Plummer sphere with scale radius posExtent / 5, cut off at posExtent, in
+///   virial equilibrium, in 2d positions and velocities are projected onto the plane
+///  Disk: uniform disk of radius posExtent rotating counterclockwise on circular
+///   orbits, in the x-y plane in 3d
+///  Collision: two Plummer spheres half the size, rocks split between them, closing
+///   along x at velExtent with a small offset in y
+/// Instantiated for Rock and Rock3
+template <int Dim>
+void generateRocks(std::span<Body<Dim>> rocks, const RockConfig& config, float gravity, uint64_t firstIndex = 0);
@@ -0,0 +1,55 @@
+#include <bit>
+#include <functional>
+#include <oneapi/tbb/parallel_reduce.h>
+#include <oneapi/tbb/parallel_sort.h>
+#include "grid.hpp"
+
+void CollisionGrid::build(std::span<Rock> rocks, float sweepTime)
+{
+    sweep = sweepTime;
+    entries.resize(rocks.size());
+    gridCount = 0;
+    if (rocks.empty()) return;
+
+    // size cells to the largest reach that isn't much bigger than average
+    float total_reach = tbb::parallel_reduce(
+        tbb::blocked_range<size_t>(0, rocks.size()), 0.0f,
+        [&](const auto& range, float sum) {
+            for (size_t i = range.begin(); i != range.end(); ++i) sum += reach(rocks[i]);
+            return sum;
+        },
+        std::plus<float>());
+    largeRadius = largeFactor * total_reach / rocks.size();
+    float max_reach = tbb::parallel_reduce(
+        tbb::blocked_range<size_t>(0, rocks.size()), 0.0f,
+        [&](const auto& range, float result) {
+            for (size_t i = range.begin(); i != range.end(); ++i) {
+                if (reach(rocks[i]) <= largeRadius) result = std::max(result, reach(rocks[i]));
+            }
+            return result;
+        },
+        [](float a, float b) { return std::max(a, b); });
+    cellSize = std::max(2.0f * max_reach, 0.001f);
+    hashMask = std::bit_ceil(std::max<size_t>(2 * rocks.size(), 1024)) - 1;
+
+    tbb::parallel_for(size_t(0), rocks.size(), [&](size_t i) {
+        Rock& rock = rocks[i];
+        uint32_t key = (reach(rock) > largeRadius)
+            ? largeKey : hash(cellCoord(rock.pos.x), cellCoord(rock.pos.y));
+        entries[i] = Entry {.key = key, .rock = &rock};
+    });
+    tbb::parallel_sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+        return (a.key < b.key) || (a.key == b.key && a.rock < b.rock);
+    });
+    gridCount = std::partition_point(entries.begin(), entries.end(), [](const Entry& e) {
+        return e.key != largeKey;
+    }) - entries.begin();
+
+    cellStart.assign(hashMask + 1, 0);
+    cellEnd.assign(hashMask + 1, 0);
+    tbb::parallel_for(size_t(0), gridCount, [&](size_t i) {
+        uint32_t key = entries[i].key;
+        if (i == 0 || entries[i - 1].key != key) cellStart[key] = i;
+        if (i + 1 == gridCount || entries[i + 1].key != key) cellEnd[key] = i + 1;
+    });
+}
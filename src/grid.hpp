@@ -0,0 +1,112 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <span>
+#include <vector>
+#include <oneapi/tbb/blocked_range.h>
+#include <oneapi/tbb/enumerable_thread_specific.h>
+#include <oneapi/tbb/parallel_for.h>
+#include "rock.hpp"
+
+/// Uniform grid broadphase for collisions (spatial hash), rebuilt each frame
+/// Cells are as wide as the largest normal rock so touching rocks are always in
+/// neighboring cells. Rocks much larger than average are kept out of the grid and
+/// instead check every cell they overlap, so one big rock doesn't grow the cells.
+/// With a sweep time a rock's reach is its radius plus how far it moves in that
+/// time, and reach is used in place of radius so rocks that meet within it are found
+struct CollisionGrid {
+    struct Entry {
+        uint32_t key; // hashed cell, large rocks use largeKey
+        Rock* rock;
+    };
+
+    float cellSize {1.0f};
+    float largeRadius {0.0f}; // rocks with a larger reach are not put in cells
+    float sweep {0.0f}; // time motion is added to the reach for
+    uint32_t hashMask {0};
+    size_t gridCount {0}; // entries [0, gridCount) are in cells, the rest are large
+    std::vector<Entry> entries; // sorted by key then address
+    std::vector<uint32_t> cellStart; // entries with key h are [cellStart[h], cellEnd[h])
+    std::vector<uint32_t> cellEnd;
+
+    static constexpr float largeFactor {2.0f}; // large if reach > largeFactor * mean reach
+    static constexpr uint32_t largeKey {UINT32_MAX};
+
+    void build(std::span<Rock> rocks, float sweepTime = 0.0f);
+
+    float reach(const Rock& rock) const {
+        if (sweep == 0.0f) return rock.radius;
+        return rock.radius + sweep * std::sqrt(rock.vel.x * rock.vel.x + rock.vel.y * rock.vel.y);
+    }
+
+    /// Calls f(a, b) once for each pair of rocks that may be touching, from many threads
+    template <class F>
+    void forEachCandidate(F&& f) const;
+
+private:
+    /// Clamped well inside int32, so cells of rocks far out (fitRoot keeps them) and
+    /// their neighbors and spans can't overflow, they just share the edge cells
+    int32_t cellCoord(float v) const {
+        constexpr float limit {1 << 30};
+        return static_cast<int32_t>(std::clamp(std::floor(v / cellSize), -limit, limit));
+    }
+
+    uint32_t hash(int32_t cx, int32_t cy) const {
+        return ((static_cast<uint32_t>(cx) * 73856093u) ^ (static_cast<uint32_t>(cy) * 19349663u)) & hashMask;
+    }
+
+    mutable tbb::enumerable_thread_specific<std::vector<uint32_t>> largeCells;
+};
+
+template <class F>
+void CollisionGrid::forEachCandidate(F&& f) const
+{
+    // normal rocks look in their own cell and the 8 around it, pairs are only
+    // passed from the lower address so each is seen once
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, gridCount, 256), [&](const auto& range) {
+        for (size_t i = range.begin(); i != range.end(); ++i) {
+            Rock* a = entries[i].rock;
+            int32_t cx = cellCoord(a->pos.x);
+            int32_t cy = cellCoord(a->pos.y);
+            uint32_t seen[9];
+            int count = 0;
+            for (int32_t dy = -1; dy <= 1; ++dy) {
+                for (int32_t dx = -1; dx <= 1; ++dx) {
+                    uint32_t h = hash(cx + dx, cy + dy);
+                    if (std::find(seen, seen + count, h) != seen + count) continue; // hash clash
+                    seen[count++] = h;
+                    for (uint32_t j = cellStart[h]; j < cellEnd[h]; ++j) {
+                        if (entries[j].rock > a) f(a, entries[j].rock);
+                    }
+                }
+            }
+        }
+    });
+
+    // large rocks look in every cell they can reach, then at the other large rocks
+    tbb::parallel_for(gridCount, entries.size(), [&](size_t i) {
+        Rock* a = entries[i].rock;
+        float reach = this->reach(*a) + largeRadius;
+        int32_t x0 = cellCoord(a->pos.x - reach);
+        int32_t x1 = cellCoord(a->pos.x + reach);
+        int32_t y0 = cellCoord(a->pos.y - reach);
+        int32_t y1 = cellCoord(a->pos.y + reach);
+        if (static_cast<double>(x1 - x0 + 1) * (y1 - y0 + 1) > static_cast<double>(gridCount)) {
+            for (size_t j = 0; j < gridCount; ++j) f(a, entries[j].rock);
+        } else {
+            std::vector<uint32_t>& cells = largeCells.local();
+            cells.clear();
+            for (int32_t cy = y0; cy <= y1; ++cy) {
+                for (int32_t cx = x0; cx <= x1; ++cx) cells.push_back(hash(cx, cy));
+            }
+            std::sort(cells.begin(), cells.end());
+            cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+            for (uint32_t h : cells) {
+                for (uint32_t j = cellStart[h]; j < cellEnd[h]; ++j) f(a, entries[j].rock);
+            }
+        }
+        for (size_t j = i + 1; j < entries.size(); ++j) f(a, entries[j].rock);
+    });
+}
@@ -0,0 +1,420 @@
+//
+// Headless Gravity Simulator
+//
+// Runs the simulation without a window using a fixed timestep and writes
+// the time spent in each system per step as csv or json.
+//
+// headless [--rocks N] [--steps N] [--warmup N] [--dt seconds] [--extent E]
+//          [--theta T] [--quadrupole 0|1] [--grid 0|1] [--incremental 0|1]
+//          [--leaf-size K] [--max-rung R] [--threads N] [--format csv|json] [--out file]
+//          [--load snapshot] [--save snapshot] [--trajectory file] [--every N]
+//          [--layout box|plummer|disk|collision] [--seed S] [--trace file]
+//          [--target-ms ms] [--fit-root 0|1] [--swept 0|1] [--merge 0|1] [--fused 0|1]
+//          [--reorder K] [--domains N] [--3d 0|1]
+//
+// --load starts from a snapshot instead of --rocks random rocks, --save writes the
+// final state, and --trajectory streams every Nth step (warmup included) to a file
+// --trace writes the profiler zones of the last steps as Chrome trace json
+// --target-ms turns on the theta controller with that gravity budget per step
+// --swept 0 only collides rocks already touching instead of ones meeting in the step
+// --merge 1 merges colliding rocks instead of bouncing them, active_rocks is what's left
+// --fused 1 finds collisions in the gravity walk, timed as gravity
+// --reorder K sorts the rocks into Morton order every K steps, timed as tree
+// --domains N splits each step across N domain_worker processes (next to this
+// executable), the workers' time is gravity (not with --merge or --max-rung)
+// --3d 1 generates and steps the rocks in space with an octree (grid, fused, block
+// step, reorder and domain options don't apply)
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#include <fmt/core.h>
+#include <fmt/ranges.h>
+#include <oneapi/tbb/global_control.h>
+#include <oneapi/tbb/info.h>
+#include "domain.hpp"
+#include "profile.hpp"
+#include "rock.hpp"
+#include "runner.hpp"
+#include "snapshot.hpp"
+#include "world.hpp"
+
+namespace {
+
+struct Options {
+    size_t rocks {10000};
+    int steps {100};
+    int warmup {0};
+    float timestep {1.0f / 60.0f};
+    float theta {0.5f};
+    bool quadrupole {false};
+    bool grid {false};
+    bool incremental {true};
+    bool fitRoot {true};
+    bool swept {true};
+    bool merge {false};
+    bool fused {false};
+    int reorderEvery {0};
+    int domains {0};
+    bool threeD {false};
+    int leafSize {16};
+    int maxRung {-1};  // -1 = single step, otherwise block timesteps
+    int threads {0};  // 0 = let tbb decide
+    bool json {false};
+    std::string out;  // empty = stdout
+    std::string load;  // empty = random rocks
+    std::string save;
+    std::string trajectory;
+    int every {1};
+    std::string trace;
+    float targetMs {0.0f};  // 0 = fixed theta
+    RockConfig rockConfig;
+};
+
+void printUsage()
+{
+    fmt::print(stderr,
+               "usage: headless [--rocks N] [--steps N] [--warmup N] [--dt seconds]\n"
+               "                [--extent E] [--theta T] [--quadrupole 0|1] [--grid 0|1]\n"
+               "                [--incremental 0|1] [--leaf-size K] [--max-rung R]\n"
+               "                [--threads N] [--format csv|json] [--out file]\n"
+               "                [--load snapshot] [--save snapshot] [--trajectory file] [--every N]\n"
+               "                [--layout box|plummer|disk|collision] [--seed S] [--trace file]\n"
+               "                [--target-ms ms] [--fit-root 0|1] [--swept 0|1] [--merge 0|1]\n"
+               "                [--fused 0|1] [--reorder K] [--domains N] [--3d 0|1]\n");
+}
+
+/// Reads value whole as a number into out, or says which option it was for
+/// Integers must fit out, unsigned ones can't be negative
+template <class T>
+bool parseNumber(std::string_view arg, const char* value, T& out)
+{
+    char* end = nullptr;
+    errno = 0;
+    bool fits = true;
+    if constexpr (std::is_floating_point_v<T>) {
+        out = std::strtof(value, &end);
+    } else if constexpr (std::is_unsigned_v<T>) {
+        unsigned long long parsed = std::strtoull(value, &end, 10);
+        fits = (std::string_view(value).find('-') == std::string_view::npos)
+            && parsed <= std::numeric_limits<T>::max();
+        out = static_cast<T>(parsed);
+    } else {
+        long long parsed = std::strtoll(value, &end, 10);
+        fits = parsed >= std::numeric_limits<T>::min() && parsed <= std::numeric_limits<T>::max();
+        out = static_cast<T>(parsed);
+    }
+    if (end == value || *end != '\0' || errno == ERANGE || !fits) {
+        fmt::print(stderr, "{} can't be {}, it takes a {}\n", arg, value,
+                   std::is_floating_point_v<T> ? "number" : "whole number");
+        return false;
+    }
+    return true;
+}
+
+/// 0 or 1 options, any other whole number counts as 1
+bool parseFlag(std::string_view arg, const char* value, bool& out)
+{
+    int parsed = 0;
+    if (!parseNumber(arg, value, parsed)) return false;
+    out = (parsed != 0);
+    return true;
+}
+
+bool parseOptions(int argc, char* argv[], Options& options)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--help" || arg == "-h") return false;
+        if (i + 1 >= argc) {
+            fmt::print(stderr, "missing value for {}\n", arg);
+            return false;
+        }
+        const char* value = argv[++i];
+        if (arg == "--rocks") {
+            if (!parseNumber(arg, value, options.rocks)) return false;
+        } else if (arg == "--steps") {
+            if (!parseNumber(arg, value, options.steps)) return false;
+        } else if (arg == "--warmup") {
+            if (!parseNumber(arg, value, options.warmup)) return false;
+        } else if (arg == "--dt") {
+            if (!parseNumber(arg, value, options.timestep)) return false;
+        } else if (arg == "--extent") {
+            if (!parseNumber(arg, value, options.rockConfig.posExtent)) return false;
+        } else if (arg == "--theta") {
+            if (!parseNumber(arg, value, options.theta)) return false;
+        } else if (arg == "--quadrupole") {
+            if (!parseFlag(arg, value, options.quadrupole)) return false;
+        } else if (arg == "--grid") {
+            if (!parseFlag(arg, value, options.grid)) return false;
+        } else if (arg == "--swept") {
+            if (!parseFlag(arg, value, options.swept)) return false;
+        } else if (arg == "--merge") {
+            if (!parseFlag(arg, value, options.merge)) return false;
+        } else if (arg == "--fused") {
+            if (!parseFlag(arg, value, options.fused)) return false;
+        } else if (arg == "--reorder") {
+            if (!parseNumber(arg, value, options.reorderEvery)) return false;
+        } else if (arg == "--domains") {
+            if (!parseNumber(arg, value, options.domains)) return false;
+        } else if (arg == "--3d") {
+            if (!parseFlag(arg, value, options.threeD)) return false;
+        } else if (arg == "--fit-root") {
+            if (!parseFlag(arg, value, options.fitRoot)) return false;
+        } else if (arg == "--incremental") {
+            if (!parseFlag(arg, value, options.incremental)) return false;
+        } else if (arg == "--leaf-size") {
+            if (!parseNumber(arg, value, options.leafSize)) return false;
+        } else if (arg == "--max-rung") {
+            if (!parseNumber(arg, value, options.maxRung)) return false;
+        } else if (arg == "--threads") {
+            if (!parseNumber(arg, value, options.threads)) return false;
+        } else if (arg == "--format") {
+            std::string_view format = value;
+            if (format != "csv" && format != "json") {
+                fmt::print(stderr, "unknown format {}\n", format);
+                return false;
+            }
+            options.json = (format == "json");
+        } else if (arg == "--out") {
+            options.out = value;
+        } else if (arg == "--load") {
+            options.load = value;
+        } else if (arg == "--save") {
+            options.save = value;
+        } else if (arg == "--trajectory") {
+            options.trajectory = value;
+        } else if (arg == "--every") {
+            if (!parseNumber(arg, value, options.every)) return false;
+        } else if (arg == "--layout") {
+            std::string_view layout = value;
+            if (layout == "box") {
+                options.rockConfig.layout = Layout::Box;
+            } else if (layout == "plummer") {
+                options.rockConfig.layout = Layout::Plummer;
+            } else if (layout == "disk") {
+                options.rockConfig.layout = Layout::Disk;
+            } else if (layout == "collision") {
+                options.rockConfig.layout = Layout::Collision;
+            } else {
+                fmt::print(stderr, "unknown layout {}\n", layout);
+                return false;
+            }
+        } else if (arg == "--target-ms") {
+            if (!parseNumber(arg, value, options.targetMs)) return false;
+        } else if (arg == "--trace") {
+            options.trace = value;
+        } else if (arg == "--seed") {
+            if (!parseNumber(arg, value, options.rockConfig.seed)) return false;
+        } else {
+            fmt::print(stderr, "unknown option {}\n", arg);
+            return false;
+        }
+    }
+    if (options.steps <= 0 || options.timestep <= 0.0f || options.leafSize <= 0 || options.every <= 0) {
+        fmt::print(stderr, "--steps, --dt, --leaf-size and --every must be above 0\n");
+        return false;
+    }
+    return true;
+}
+
+void writeCsv(std::FILE* file, const std::vector<StepTimings>& steps)
+{
+    fmt::print(file, "step,tree_ms,gravity_ms,collision_ms,position_ms,total_ms\n");
+    for (size_t i = 0; i < steps.size(); ++i) {
+        const StepTimings& t = steps[i];
+        fmt::print(file, "{},{:.4f},{:.4f},{:.4f},{:.4f},{:.4f}\n",
+                   i, t.tree, t.gravity, t.collision, t.position, t.total());
+    }
+}
+
+void writeJson(std::FILE* file,
+               const Options& options,
+               const World& world,
+               const std::vector<StepTimings>& steps,
+               const StepTimings& mean,
+               size_t trajectoryFrames,
+               size_t collisionPairs)
+{
+    auto timingJson = [](const StepTimings& t) {
+        return fmt::format(
+            "{{\"tree_ms\": {:.4f}, \"gravity_ms\": {:.4f}, \"collision_ms\": {:.4f}, "
+            "\"position_ms\": {:.4f}, \"total_ms\": {:.4f}}}",
+            t.tree, t.gravity, t.collision, t.position, t.total());
+    };
+    fmt::print(file, "{{\n");
+    fmt::print(file, "  \"rocks\": {},\n", options.rocks);
+    fmt::print(file, "  \"active_rocks\": {},\n", world.rocks.size());
+    fmt::print(file, "  \"seed\": {},\n", options.rockConfig.seed);
+    fmt::print(file, "  \"steps\": {},\n", options.steps);
+    fmt::print(file, "  \"dt\": {},\n", options.timestep);
+    fmt::print(file, "  \"threads\": {},\n", options.threads);
+    fmt::print(file, "  \"theta\": {},\n", options.theta);
+    if (world.thetaControl.enabled) {
+        fmt::print(file, "  \"target_ms\": {},\n", options.targetMs);
+        fmt::print(file, "  \"final_theta\": {:.3f},\n", world.theta);
+        fmt::print(file, "  \"force_error\": {:.3e},\n", world.thetaControl.error);
+    }
+    fmt::print(file, "  \"expansion\": \"{}\",\n", options.quadrupole ? "quadrupole" : "monopole");
+    fmt::print(file, "  \"broadphase\": \"{}\",\n", options.grid ? "grid" : "tree");
+    fmt::print(file, "  \"incremental_tree\": {},\n", options.incremental);
+    fmt::print(file, "  \"fit_root\": {},\n", options.fitRoot);
+    fmt::print(file, "  \"swept_collisions\": {},\n", options.swept);
+    fmt::print(file, "  \"merge_collisions\": {},\n", options.merge);
+    fmt::print(file, "  \"fused_traversal\": {},\n", options.fused);
+    fmt::print(file, "  \"reorder_every\": {},\n", options.reorderEvery);
+    fmt::print(file, "  \"domains\": {},\n", options.domains);
+    fmt::print(file, "  \"dimensions\": {},\n", options.threeD ? 3 : 2);
+    if (options.threeD) fmt::print(file, "  \"octree_depth\": {},\n", world.volume.tree.depth());
+    fmt::print(file, "  \"collision_pairs\": {},\n", collisionPairs);
+    fmt::print(file, "  \"tree_depth\": {},\n", world.rootTree.depth());
+    fmt::print(file, "  \"tree_builds\": {},\n", world.rootTree.builds);
+    fmt::print(file, "  \"leaf_size\": {},\n", options.leafSize);
+    if (!options.trajectory.empty()) {
+        fmt::print(file, "  \"trajectory_frames\": {},\n", trajectoryFrames);
+    }
+    if (world.blockTimesteps) {
+        fmt::print(file, "  \"max_rung\": {},\n", world.maxRung);
+        fmt::print(file, "  \"rung_counts\": [{}],\n", fmt::join(world.blockSteps.rungCounts, ", "));
+        fmt::print(file, "  \"gravity_evaluations\": {},\n", world.blockSteps.evaluations);
+    }
+    const GravityStats& stats = world.gravityStats;
+    double rocks = std::max<double>(1.0, world.rocks.size());
+    fmt::print(file, "  \"node_visits_per_rock\": {:.1f},\n", stats.nodeVisits / rocks);
+    fmt::print(file, "  \"interactions_per_rock\": {:.1f},\n",
+               (stats.farInteractions + stats.nearInteractions) / rocks);
+    fmt::print(file, "  \"mean\": {},\n", timingJson(mean));
+    fmt::print(file, "  \"frames\": [\n");
+    for (size_t i = 0; i < steps.size(); ++i) {
+        fmt::print(file, "    {}{}\n", timingJson(steps[i]), i + 1 < steps.size() ? "," : "");
+    }
+    fmt::print(file, "  ]\n}}\n");
+}
+
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        printUsage();
+        return 1;
+    }
+    if (options.threads <= 0) options.threads = tbb::info::default_concurrency();
+    tbb::global_control threadLimit(tbb::global_control::max_allowed_parallelism,
+                                    options.threads);
+
+    World world(nullptr);
+    world.theta = options.theta;
+    world.thetaControl.enabled = (options.targetMs > 0.0f);
+    world.thetaControl.targetMs = options.targetMs;
+    world.expansion = options.quadrupole ? Expansion::Quadrupole : Expansion::Monopole;
+    world.broadphase = options.grid ? Broadphase::Grid : Broadphase::Tree;
+    world.incrementalTree = options.incremental;
+    world.fitRoot = options.fitRoot;
+    world.sweptCollisions = options.swept;
+    world.mergeCollisions = options.merge;
+    world.fusedTraversal = options.fused;
+    world.reorderEvery = options.reorderEvery;
+    world.leafSize = options.leafSize;
+    world.blockTimesteps = (options.maxRung >= 0);
+    world.maxRung = std::max(options.maxRung, 0);
+    if (options.threeD && options.domains > 0) {
+        fmt::print(stderr, "--domains only steps rocks in the plane, not with --3d\n");
+        return 1;
+    }
+    if (options.domains > 0 && (options.merge || options.maxRung >= 0)) {
+        fmt::print(stderr, "--domains doesn't merge or use block steps, drop --merge and --max-rung\n");
+        return 1;
+    }
+    setThreeD(world, options.threeD);
+    if (options.load.empty()) {
+        addRandomRocks(world, options.rocks, options.rockConfig);
+    } else {
+        if (!loadSnapshot(world, options.load)) return 1;
+        options.rocks = world.rocks.size();
+    }
+    std::optional<TrajectoryWriter> trajectory;
+    if (!options.trajectory.empty()) {
+        trajectory.emplace(options.trajectory, options.every);
+        if (!trajectory->isOpen()) return 1;
+    }
+    uint64_t frame = 0;
+    auto record = [&] {
+        if (trajectory) trajectory->record(world, frame, frame * static_cast<double>(options.timestep));
+        ++frame;
+    };
+
+    std::optional<DomainSim> domains;
+    if (options.domains > 0) {
+        domains.emplace(DomainConfig {.workers = options.domains});
+        if (!domains->isRunning()) return 1;
+    }
+    auto step = [&]() -> std::optional<StepTimings> {
+        if (domains) {
+            std::optional<StepTimings> timings = domains->step(world, options.timestep);
+            if (timings && world.thetaControl.enabled) updateThetaSystem(world);
+            return timings;
+        }
+        return stepWorld(world, options.timestep);
+    };
+
+    record();
+    for (int i = 0; i < options.warmup; ++i) {
+        if (!step()) return 1;
+        record();
+    }
+    std::vector<StepTimings> steps;
+    steps.reserve(options.steps);
+    StepTimings mean;
+    size_t collisionPairs = 0;
+    for (int i = 0; i < options.steps; ++i) {
+        std::optional<StepTimings> stepped = step();
+        if (!stepped) return 1;
+        StepTimings t = *stepped;
+        record();
+        collisionPairs += world.threeD ? world.volume.collisions.pairs.size() : world.collisions.pairs.size();
+        mean.tree += t.tree / options.steps;
+        mean.gravity += t.gravity / options.steps;
+        mean.collision += t.collision / options.steps;
+        mean.position += t.position / options.steps;
+        steps.push_back(t);
+    }
+    size_t trajectoryFrames = 0;
+    if (trajectory) {
+        trajectory->flush();
+        trajectoryFrames = trajectory->written();
+    }
+    if (!options.trace.empty() && !profile::exportChromeTrace(options.trace)) return 1;
+    if (!options.save.empty()
+        && !saveSnapshot(world, options.save, frame - 1, (frame - 1) * static_cast<double>(options.timestep))) {
+        return 1;
+    }
+
+    std::FILE* file = stdout;
+    if (!options.out.empty()) {
+        file = std::fopen(options.out.c_str(), "w");
+        if (!file) {
+            fmt::print(stderr, "could not open {}\n", options.out);
+            return 1;
+        }
+    }
+    if (options.json) {
+        writeJson(file, options, world, steps, mean, trajectoryFrames, collisionPairs);
+    } else {
+        writeCsv(file, steps);
+    }
+    if (file != stdout) std::fclose(file);
+
+    fmt::print(stderr, "{} rocks, {} steps: {:.3f} ms/step ({:.1f} steps/s)\n",
+               options.rocks, options.steps, mean.total(), 1000.0 / mean.total());
+    return 0;
+}
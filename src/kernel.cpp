@@ -0,0 +1,246 @@
+#include <cmath>
+#if (defined(__AVX2__) && defined(__FMA__)) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "kernel.hpp"
+
+namespace {
+
+constexpr float minDist2 {0.00001f}; // closer than this counts as on top of pos
+
+/// Scalar version, used for the tail of a batch and when no simd is available
+template <int Dim, bool CheckRadius>
+inline void accumulate(const BasicSourceBatch<Dim>& batch, size_t i, Vec<Dim> pos, float radius, Vec<Dim>& acc)
+{
+    float d[Dim];
+    float dist2 = 0.0f;
+    for (int k = 0; k < Dim; ++k) {
+        d[k] = batch.coord[k][i] - axis(pos, k);
+        dist2 += d[k] * d[k];
+    }
+    if (dist2 < minDist2) return;
+    if constexpr (CheckRadius) {
+        float reach = radius + batch.radius[i];
+        if (dist2 < reach * reach) return;
+    }
+    float inv_dist = 1.0f / std::sqrt(dist2);
+    float s = batch.mass[i] * inv_dist * inv_dist * inv_dist;
+    for (int k = 0; k < Dim; ++k) axis(acc, k) += d[k] * s;
+}
+
+/// Scalar quadrupole term, d is from pos to the source:
+/// m d / r^3 - Q d / r^5 + 5/2 (d.Q.d) d / r^7
+template <int Dim>
+inline void accumulate(const BasicQuadrupoleBatch<Dim>& batch, size_t i, Vec<Dim> pos, Vec<Dim>& acc)
+{
+    float d[Dim];
+    float dist2 = 0.0f;
+    for (int k = 0; k < Dim; ++k) {
+        d[k] = batch.coord[k][i] - axis(pos, k);
+        dist2 += d[k] * d[k];
+    }
+    if (dist2 < minDist2) return;
+    float inv2 = 1.0f / dist2;
+    float inv3 = std::sqrt(inv2) * inv2;
+    float inv5 = inv3 * inv2;
+    float q[Dim];
+    float dqd = 0.0f;
+    for (int k = 0; k < Dim; ++k) {
+        q[k] = 0.0f;
+        for (int j = 0; j < Dim; ++j) q[k] += batch.quad[symmetricIndex<Dim>(k, j)][i] * d[j];
+        dqd += d[k] * q[k];
+    }
+    float radial = batch.mass[i] * inv3 + 2.5f * dqd * inv5 * inv2;
+    for (int k = 0; k < Dim; ++k) axis(acc, k) += d[k] * radial - q[k] * inv5;
+}
+
+/// Scalar sum of lane totals into a vector, per axis in lane order
+template <int Dim, int Lanes>
+Vec<Dim> sumLanes(const float (&lanes)[Dim][Lanes])
+{
+    Vec<Dim> acc {};
+    for (int k = 0; k < Dim; ++k) {
+        for (int j = 0; j < Lanes; ++j) axis(acc, k) += lanes[k][j];
+    }
+    return acc;
+}
+
+}  // namespace
+
+#if defined(__AVX2__) && defined(__FMA__)
+
+namespace {
+
+/// Sum of a[k] * b[k] over the axes, last axis first as one multiply then fmas
+template <int Dim>
+inline __m256 dot(const __m256 (&a)[Dim], const __m256 (&b)[Dim])
+{
+    __m256 sum = _mm256_mul_ps(a[Dim - 1], b[Dim - 1]);
+    for (int k = Dim - 2; k >= 0; --k) sum = _mm256_fmadd_ps(a[k], b[k], sum);
+    return sum;
+}
+
+}  // namespace
+
+template <int Dim, bool CheckRadius>
+Vec<Dim> batchAccel(const BasicSourceBatch<Dim>& batch, Vec<Dim> pos, float radius)
+{
+    const size_t n = batch.size();
+    __m256 p[Dim];
+    __m256 a[Dim];
+    for (int k = 0; k < Dim; ++k) {
+        p[k] = _mm256_set1_ps(axis(pos, k));
+        a[k] = _mm256_setzero_ps();
+    }
+    const __m256 pr = _mm256_set1_ps(radius);
+    const __m256 min_d2 = _mm256_set1_ps(minDist2);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 three_halves = _mm256_set1_ps(1.5f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 d[Dim];
+        for (int k = 0; k < Dim; ++k) d[k] = _mm256_sub_ps(_mm256_loadu_ps(&batch.coord[k][i]), p[k]);
+        __m256 d2 = dot<Dim>(d, d);
+        __m256 keep = _mm256_cmp_ps(d2, min_d2, _CMP_GE_OQ);
+        if constexpr (CheckRadius) {
+            __m256 reach = _mm256_add_ps(pr, _mm256_loadu_ps(&batch.radius[i]));
+            keep = _mm256_and_ps(keep, _mm256_cmp_ps(d2, _mm256_mul_ps(reach, reach), _CMP_GE_OQ));
+        }
+        // rsqrt is good to ~12 bits, one newton step brings it to ~23
+        __m256 inv = _mm256_rsqrt_ps(d2);
+        inv = _mm256_mul_ps(inv, _mm256_fnmadd_ps(_mm256_mul_ps(half, d2), _mm256_mul_ps(inv, inv), three_halves));
+        __m256 s = _mm256_mul_ps(_mm256_loadu_ps(&batch.mass[i]), _mm256_mul_ps(inv, _mm256_mul_ps(inv, inv)));
+        s = _mm256_and_ps(keep, s); // also drops the inf/nan from d2 == 0
+        for (int k = 0; k < Dim; ++k) a[k] = _mm256_fmadd_ps(d[k], s, a[k]);
+    }
+    alignas(32) float lanes[Dim][8];
+    for (int k = 0; k < Dim; ++k) _mm256_store_ps(lanes[k], a[k]);
+    Vec<Dim> acc = sumLanes<Dim, 8>(lanes);
+    for (; i < n; ++i) accumulate<Dim, CheckRadius>(batch, i, pos, radius, acc);
+    return acc;
+}
+
+#elif defined(__SSE2__)
+
+template <int Dim, bool CheckRadius>
+Vec<Dim> batchAccel(const BasicSourceBatch<Dim>& batch, Vec<Dim> pos, float radius)
+{
+    const size_t n = batch.size();
+    __m128 p[Dim];
+    __m128 a[Dim];
+    for (int k = 0; k < Dim; ++k) {
+        p[k] = _mm_set1_ps(axis(pos, k));
+        a[k] = _mm_setzero_ps();
+    }
+    const __m128 pr = _mm_set1_ps(radius);
+    const __m128 min_d2 = _mm_set1_ps(minDist2);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 three_halves = _mm_set1_ps(1.5f);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 d[Dim];
+        __m128 d2 = _mm_setzero_ps();
+        for (int k = 0; k < Dim; ++k) {
+            d[k] = _mm_sub_ps(_mm_loadu_ps(&batch.coord[k][i]), p[k]);
+            d2 = _mm_add_ps(d2, _mm_mul_ps(d[k], d[k]));
+        }
+        __m128 keep = _mm_cmpge_ps(d2, min_d2);
+        if constexpr (CheckRadius) {
+            __m128 reach = _mm_add_ps(pr, _mm_loadu_ps(&batch.radius[i]));
+            keep = _mm_and_ps(keep, _mm_cmpge_ps(d2, _mm_mul_ps(reach, reach)));
+        }
+        // rsqrt is good to ~12 bits, one newton step brings it to ~23
+        __m128 inv = _mm_rsqrt_ps(d2);
+        inv = _mm_mul_ps(inv, _mm_sub_ps(three_halves, _mm_mul_ps(_mm_mul_ps(half, d2), _mm_mul_ps(inv, inv))));
+        __m128 s = _mm_mul_ps(_mm_loadu_ps(&batch.mass[i]), _mm_mul_ps(inv, _mm_mul_ps(inv, inv)));
+        s = _mm_and_ps(keep, s); // also drops the inf/nan from d2 == 0
+        for (int k = 0; k < Dim; ++k) a[k] = _mm_add_ps(a[k], _mm_mul_ps(d[k], s));
+    }
+    alignas(16) float lanes[Dim][4];
+    for (int k = 0; k < Dim; ++k) _mm_store_ps(lanes[k], a[k]);
+    Vec<Dim> acc = sumLanes<Dim, 4>(lanes);
+    for (; i < n; ++i) accumulate<Dim, CheckRadius>(batch, i, pos, radius, acc);
+    return acc;
+}
+
+#else
+
+template <int Dim, bool CheckRadius>
+Vec<Dim> batchAccel(const BasicSourceBatch<Dim>& batch, Vec<Dim> pos, float radius)
+{
+    Vec<Dim> acc {};
+    for (size_t i = 0; i < batch.size(); ++i) accumulate<Dim, CheckRadius>(batch, i, pos, radius, acc);
+    return acc;
+}
+
+#endif
+
+#if defined(__AVX2__) && defined(__FMA__)
+
+template <int Dim>
+Vec<Dim> quadrupoleAccel(const BasicQuadrupoleBatch<Dim>& batch, Vec<Dim> pos)
+{
+    constexpr int quadSize = BasicQuadrupoleBatch<Dim>::quadSize;
+    const size_t n = batch.size();
+    __m256 p[Dim];
+    __m256 a[Dim];
+    for (int k = 0; k < Dim; ++k) {
+        p[k] = _mm256_set1_ps(axis(pos, k));
+        a[k] = _mm256_setzero_ps();
+    }
+    const __m256 min_d2 = _mm256_set1_ps(minDist2);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 three_halves = _mm256_set1_ps(1.5f);
+    const __m256 five_halves = _mm256_set1_ps(2.5f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 d[Dim];
+        for (int k = 0; k < Dim; ++k) d[k] = _mm256_sub_ps(_mm256_loadu_ps(&batch.coord[k][i]), p[k]);
+        __m256 d2 = dot<Dim>(d, d);
+        __m256 keep = _mm256_cmp_ps(d2, min_d2, _CMP_GE_OQ);
+        __m256 inv = _mm256_rsqrt_ps(d2);
+        inv = _mm256_mul_ps(inv, _mm256_fnmadd_ps(_mm256_mul_ps(half, d2), _mm256_mul_ps(inv, inv), three_halves));
+        inv = _mm256_and_ps(keep, inv);
+        __m256 inv2 = _mm256_mul_ps(inv, inv);
+        __m256 inv3 = _mm256_mul_ps(inv, inv2);
+        __m256 inv5 = _mm256_mul_ps(inv3, inv2);
+        __m256 quad[quadSize];
+        for (int k = 0; k < quadSize; ++k) quad[k] = _mm256_loadu_ps(&batch.quad[k][i]);
+        __m256 q[Dim]; // Q d
+        for (int k = 0; k < Dim; ++k) {
+            __m256 row[Dim];
+            for (int j = 0; j < Dim; ++j) row[j] = quad[symmetricIndex<Dim>(k, j)];
+            q[k] = dot<Dim>(row, d);
+        }
+        __m256 dqd = dot<Dim>(d, q);
+        __m256 radial = _mm256_fmadd_ps(_mm256_mul_ps(five_halves, dqd), _mm256_mul_ps(inv5, inv2),
+                                        _mm256_mul_ps(_mm256_loadu_ps(&batch.mass[i]), inv3));
+        for (int k = 0; k < Dim; ++k) {
+            a[k] = _mm256_add_ps(a[k], _mm256_fmsub_ps(d[k], radial, _mm256_mul_ps(q[k], inv5)));
+        }
+    }
+    alignas(32) float lanes[Dim][8];
+    for (int k = 0; k < Dim; ++k) _mm256_store_ps(lanes[k], a[k]);
+    Vec<Dim> acc = sumLanes<Dim, 8>(lanes);
+    for (; i < n; ++i) accumulate<Dim>(batch, i, pos, acc);
+    return acc;
+}
+
+#else
+
+template <int Dim>
+Vec<Dim> quadrupoleAccel(const BasicQuadrupoleBatch<Dim>& batch, Vec<Dim> pos)
+{
+    Vec<Dim> acc {};
+    for (size_t i = 0; i < batch.size(); ++i) accumulate<Dim>(batch, i, pos, acc);
+    return acc;
+}
+
+#endif
+
+template sf::Vector2f batchAccel<2, false>(const SourceBatch&, sf::Vector2f, float);
+template sf::Vector2f batchAccel<2, true>(const SourceBatch&, sf::Vector2f, float);
+template sf::Vector3f batchAccel<3, false>(const BasicSourceBatch<3>&, sf::Vector3f, float);
+template sf::Vector3f batchAccel<3, true>(const BasicSourceBatch<3>&, sf::Vector3f, float);
+template sf::Vector2f quadrupoleAccel<2>(const QuadrupoleBatch&, sf::Vector2f);
+template sf::Vector3f quadrupoleAccel<3>(const BasicQuadrupoleBatch<3>&, sf::Vector3f);
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <vector>
+#include "vec.hpp"
+
+//
+// Gravity Kernel - batched point mass interactions
+//
+
+/// Gravity sources collected from a tree walk, stored as columns (SoA)
+/// so the kernel can load several sources per instruction
+template <int Dim>
+struct BasicSourceBatch {
+    std::array<std::vector<float>, Dim> coord; // coord[k] is the k axis of each source
+    std::vector<float> mass;
+    std::vector<float> radius;
+
+    size_t size() const { return mass.size(); }
+
+    void clear() {
+        for (auto& column : coord) column.clear();
+        mass.clear();
+        radius.clear();
+    }
+
+    void add(Vec<Dim> pos, float m, float r) {
+        for (int k = 0; k < Dim; ++k) coord[k].push_back(axis(pos, k));
+        mass.push_back(m);
+        radius.push_back(r);
+    }
+};
+
+/// Far field sources with a quadrupole moment about their center of mass, quad is
+/// ordered like BasicTreeNode::quad
+template <int Dim>
+struct BasicQuadrupoleBatch {
+    static constexpr int quadSize {Dim * (Dim + 1) / 2};
+
+    std::array<std::vector<float>, Dim> coord;
+    std::vector<float> mass;
+    std::array<std::vector<float>, quadSize> quad;
+
+    size_t size() const { return mass.size(); }
+
+    void clear() {
+        for (auto& column : coord) column.clear();
+        mass.clear();
+        for (auto& column : quad) column.clear();
+    }
+
+    void add(Vec<Dim> pos, float m, const std::array<float, quadSize>& q) {
+        for (int k = 0; k < Dim; ++k) coord[k].push_back(axis(pos, k));
+        mass.push_back(m);
+        for (int k = 0; k < quadSize; ++k) quad[k].push_back(q[k]);
+    }
+};
+
+using SourceBatch = BasicSourceBatch<2>;
+using QuadrupoleBatch = BasicQuadrupoleBatch<2>;
+
+/// Sum of mass * direction / dist^2 over the batch for a rock at pos (multiply by G for accel)
+/// Sources on top of pos are skipped, and with CheckRadius so are sources closer
+/// than radius + their radius (ignoreShortDistGrav). The check is compiled in or
+/// out, so far field batches pay nothing for it
+/// Uses AVX2 or SSE with a refined reciprocal sqrt when available
+/// Instantiated in kernel.cpp for 2 and 3 dimensions
+template <int Dim, bool CheckRadius>
+Vec<Dim> batchAccel(const BasicSourceBatch<Dim>& batch, Vec<Dim> pos, float radius);
+
+/// batchAccel with the radius check picked at runtime
+inline sf::Vector2f batchAccel(const SourceBatch& batch, sf::Vector2f pos, float radius, bool checkRadius)
+{
+    return checkRadius ? batchAccel<2, true>(batch, pos, radius) : batchAccel<2, false>(batch, pos, radius);
+}
+
+/// Same as batchAccel (without radius checks) plus the quadrupole term of each source
+template <int Dim>
+Vec<Dim> quadrupoleAccel(const BasicQuadrupoleBatch<Dim>& batch, Vec<Dim> pos);
@@ -4,6 +4,7 @@
 // [ ] = Zoom In and Out,  Arrows = Move viewport, = = recenter
 //
 
+#include <cfloat>
 #include <fmt/core.h>
 #include <SFML/Graphics.hpp>
 #include <SFML/System.hpp>
@@ -11,7 +12,11 @@
 #include <imgui.h>
 #include <imgui-SFML.h>
 #include "util.h"
+#include "pipeline.hpp"
+#include "profile.hpp"
+#include "render.hpp"
 #include "rock.hpp"
+#include "snapshot.hpp"
 #include "world.hpp"
 #include "tree.hpp"
 
@@ -31,7 +36,10 @@ void loadFonts()
     bool success = ImGui::SFML::UpdateFontTexture();
 }
 
-void drawUI(World& world, sf::Time delta)
+/// Lays out the ui, call while the pipeline is between steps. Rock edits are queued
+/// on it, settings are changed in place. Drawn later by ImGui::SFML::Render
+void buildUI(World& world, Renderer& renderer, SimPipeline& pipeline,
+             std::optional<TrajectoryWriter>& trajectory, sf::Time delta)
 {
     static int addRocks {100};
     static RockConfig rockConfig;
@@ -41,26 +49,145 @@ void drawUI(World& world, sf::Time delta)
     ImGui::Text("FPS: %d", static_cast<int>(1.0/delta.asSeconds()));
     ImGui::InputFloat("Gravity", &world.gravity);
     ImGui::Checkbox("Ignore Short Distance Grav", &world.ignoreShortDistGrav);
+    ImGui::SliderFloat("Theta", &world.theta, 0.1f, 1.5f);
+    ThetaControl& thetaControl = world.thetaControl;
+    ImGui::Checkbox("Adaptive Theta", &thetaControl.enabled);
+    if (thetaControl.enabled) {
+        ImGui::DragFloat("Gravity Budget ms", &thetaControl.targetMs, 0.1f, 0.5f, 100.0f);
+        ImGui::SliderFloat("Theta Min", &thetaControl.thetaMin, 0.1f, 1.5f);
+        ImGui::SliderFloat("Theta Max", &thetaControl.thetaMax, thetaControl.thetaMin, 1.5f);
+        ImGui::Text("Gravity: %.2f ms", thetaControl.gravityMs);
+    }
+    ImGui::Text("Theta: %.2f  Est. Force Error: %.2e", world.theta, thetaControl.error);
+    static const char* expansions[] = {"Monopole", "Quadrupole"};
+    int expansion = static_cast<int>(world.expansion);
+    if (ImGui::Combo("Expansion", &expansion, expansions, 2)) {
+        world.expansion = static_cast<Expansion>(expansion);
+    }
+    // moves the rocks, so it waits for the step like the rock edits
+    bool threeD = world.threeD;
+    if (ImGui::Checkbox("3D Octree (Drawn Projected)", &threeD)) {
+        pipeline.push([threeD](World& w) { setThreeD(w, threeD); });
+    }
+    // the plane only options are greyed out in 3d, where the octree finds collisions
+    static const char* broadphases[] = {"Tree", "Grid"};
+    int broadphase = static_cast<int>(world.broadphase);
+    ImGui::BeginDisabled(world.threeD);
+    if (ImGui::Combo("Collisions", &broadphase, broadphases, 2)) {
+        world.broadphase = static_cast<Broadphase>(broadphase);
+    }
+    ImGui::EndDisabled();
+    ImGui::Checkbox("Swept Collisions", &world.sweptCollisions);
+    // domain workers only bounce and step every rock the same, so these exclude them
+    ImGui::BeginDisabled(world.domainWorkers > 0);
+    ImGui::Checkbox("Merge On Collision", &world.mergeCollisions);
+    ImGui::EndDisabled();
+    ImGui::BeginDisabled(world.threeD);
+    ImGui::Checkbox("Fused Gravity + Collisions", &world.fusedTraversal);
+    ImGui::EndDisabled();
+    ImGui::SliderInt("Leaf Size", &world.leafSize, 1, 32);
+    ImGui::Checkbox("Incremental Tree", &world.incrementalTree);
+    if (world.incrementalTree) {
+        ImGui::Text("Tree Builds: %zu  Moved: %zu", world.rootTree.builds, world.rootTree.moved);
+    }
+    ImGui::BeginDisabled(world.threeD);
+    ImGui::SliderInt("Reorder Every", &world.reorderEvery, 0, 240);
+    if (world.reorderEvery > 0) ImGui::Text("Reorders: %zu", world.reorder.count);
+    ImGui::EndDisabled();
+    ImGui::BeginDisabled(world.threeD || world.mergeCollisions || world.blockTimesteps);
+    ImGui::SliderInt("Domain Workers", &world.domainWorkers, 0, 8);
+    ImGui::EndDisabled();
+    ImGui::BeginDisabled(world.threeD || world.domainWorkers > 0);
+    ImGui::Checkbox("Block Timesteps", &world.blockTimesteps);
+    ImGui::EndDisabled();
+    if (world.blockTimesteps) {
+        ImGui::SliderInt("Max Rung", &world.maxRung, 0, 10);
+        ImGui::DragFloat("Step Accuracy", &world.timestepAccuracy, 0.005f, 0.01f, 1.0f);
+        const BlockSteps& steps = world.blockSteps;
+        for (size_t r = 0; r < steps.rungCounts.size(); ++r) {
+            if (steps.rungCounts[r] > 0) ImGui::Text("Rung %zu: %zu rocks", r, steps.rungCounts[r]);
+        }
+        ImGui::Text("Gravity Evaluations: %zu", steps.evaluations);
+    }
+    if (!world.rocks.empty()) {
+        const GravityStats& stats = world.gravityStats;
+        ImGui::Text("Node Visits/Rock: %.0f  Interactions/Rock: %.0f",
+                    static_cast<double>(stats.nodeVisits) / world.rocks.size(),
+                    static_cast<double>(stats.farInteractions + stats.nearInteractions) / world.rocks.size());
+    }
     ImGui::DragFloat("VelColorMax", &world.velColorExtent, 0.1f, 1.0f, 30.0f);
+    ImGui::Checkbox("Splat Tiny Nodes", &renderer.levelOfDetail);
+    if (renderer.levelOfDetail) {
+        ImGui::SliderFloat("Splat Pixels", &renderer.splatPixels, 0.5f, 8.0f);
+        ImGui::DragFloat("Splat Mass", &renderer.splatMass, 10.0f, 1.0f, 1e6f);
+    }
+    ImGui::Text("Drawn Rocks: %zu  Splats: %zu", renderer.rockCount, renderer.splatCount);
     ImGui::InputFloat("RadiusMin", &rockConfig.radiusMin);
     ImGui::InputFloat("RadiusMax", &rockConfig.radiusMax);
     ImGui::InputFloat("PositionMax", &rockConfig.posExtent);
     ImGui::InputFloat("VelocityMax", &rockConfig.velExtent);
+    static const char* layouts[] = {"Box", "Plummer", "Disk", "Collision"};
+    int layout = static_cast<int>(rockConfig.layout);
+    if (ImGui::Combo("Layout", &layout, layouts, 4)) {
+        rockConfig.layout = static_cast<Layout>(layout);
+    }
+    static int seed {1};
+    if (ImGui::InputInt("Seed", &seed)) {
+        rockConfig.seed = static_cast<uint64_t>(seed);
+    }
     ImGui::InputInt("RocksToAdd", &addRocks);
     if (ImGui::Button("Add Rocks")) {
-        addRandomRocks(world, addRocks, rockConfig);
+        pipeline.push([n = addRocks, config = rockConfig](World& w) { addRandomRocks(w, n, config); });
     }
     ImGui::SameLine();
     if (ImGui::Button("Add 1000")) {
-        addRandomRocks(world, 1000, rockConfig);
+        pipeline.push([config = rockConfig](World& w) { addRandomRocks(w, 1000, config); });
     }
     ImGui::SameLine();
     if (ImGui::Button("Restart")) {
-        deleteAllRocks(world);
-        addRandomRocks(world, addRocks, rockConfig);
+        pipeline.push([n = addRocks, config = rockConfig](World& w) {
+            deleteAllRocks(w);
+            addRandomRocks(w, n, config);
+        });
+    }
+    if (ImGui::Button("Save Snapshot")) {
+        saveSnapshot(world, "snapshot.grav");
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Load Snapshot")) {
+        pipeline.push([](World& w) { loadSnapshot(w, "snapshot.grav"); });
+    }
+    bool recording = trajectory.has_value();
+    static int recordEvery {10};
+    ImGui::InputInt("Record Every", &recordEvery);
+    if (ImGui::Checkbox("Record Trajectory", &recording)) {
+        if (recording) {
+            trajectory.emplace("trajectory.grav", recordEvery);
+            if (!trajectory->isOpen()) trajectory.reset();
+        } else {
+            trajectory.reset();  // finishes writing
+        }
+    }
+    if (trajectory) {
+        ImGui::SameLine();
+        ImGui::Text("%zu frames", trajectory->written());
+    }
+    if (ImGui::CollapsingHeader("Profiler")) {
+        bool profiling = profile::enabled;
+        if (ImGui::Checkbox("Profile", &profiling)) profile::enabled = profiling;
+        for (const profile::Series& series : profile::systems()) {
+            std::string overlay = fmt::format("{:.2f} ms", series.last);
+            ImGui::PlotLines(series.name.c_str(), series.values.data(), profile::historyFrames,
+                             profile::frameOffset(), overlay.c_str(), 0.0f, FLT_MAX, ImVec2(0, 40));
+        }
+        for (const profile::Series& series : profile::counters()) {
+            ImGui::Text("%s: %.1f", series.name.c_str(), series.last);
+        }
+        if (ImGui::Button("Export Trace")) {
+            profile::exportChromeTrace("trace.json");
+        }
     }
     ImGui::End();  // end window
-    ImGui::SFML::Render(*world.window);
 }
 
 //
@@ -98,7 +225,8 @@ void handleResize(World& world, unsigned int width, unsigned int height)
     world.window->setView(view);
 }
 
-void handleEvents(World& world)
+/// Runs while a step is in flight, so rocks are only added through the pipeline
+void handleEvents(World& world, SimPipeline& pipeline)
 {
     sf::Event event;
     while (world.window->pollEvent(event)) {
@@ -109,11 +237,8 @@ void handleEvents(World& world)
         if (event.type == sf::Event::MouseButtonPressed) {
             sf::Vector2i pix = sf::Mouse::getPosition(*world.window);
             sf::Vector2f cor = world.window->mapPixelToCoords(pix);
-            addRock(world,
-                    Rock{.pos = {cor.x, -cor.y},
-                         .vel = {0, 0},
-                         .radius = 10.0f,
-                         .mass = 100000});
+            Rock rock {.pos = {cor.x, -cor.y}, .vel = {0, 0}, .radius = 10.0f, .mass = 100000};
+            pipeline.push([rock](World& w) { addRock(w, rock); });
         }
         if (event.type == sf::Event::KeyPressed) {
             switch (event.key.code) {
@@ -163,26 +288,6 @@ void handleMouse(World& world)
 // Run Loop
 //
 
-void testTree()
-{
-    World world(nullptr);
-    addRandomRocks(world, 10000, RockConfig{});
-    {
-        util::Timer timer;
-        for (auto i = 0; i < 100; ++i) {
-            TreeNode t(100.0f);
-            for (auto& rock : world.rocks) {
-                t.insert(&rock);
-            }
-        }
-    }
-
-    // 165ms on linux after adding reservce back in for children
-    // 470-500 ms on mac for 10k rocks 100x
-    // 382ms after removing mass calc on mac
-    // 330ms after removing inline returns in tree insert
-}
-
 void run()
 {
     sf::RenderWindow window(sf::VideoMode(1600, 1000), "Gravity");
@@ -193,28 +298,42 @@ void run()
     loadFonts();
 
     World world(&window);
+    Renderer renderer;
+    std::optional<TrajectoryWriter> trajectory;
+    uint64_t frame {0};
+    double time {0.0};
     addRandomRocks(world, 100, RockConfig {});
     // addSatRocks(world);
+    SimPipeline pipeline(world, renderer);
 
+    // the step for the next frame runs while this one is drawn and waits for vsync
     sf::Clock clock;
+    float stepped {0.0f}; // delta of the step in flight
     while (window.isOpen()) {
-        handleEvents(world);
+        handleEvents(world, pipeline);
         handleMouse(world);
+        pipeline.wait();
+        if (pipeline.steps() > 0) {
+            time += stepped;
+            if (trajectory) trajectory->record(world, frame, time);
+            ++frame;
+        }
         sf::Time delta = clock.restart();
-        updateTreeSystem(world);
-        updateGravitySystemTree(world, delta.asSeconds());
-        updateCollisionSystemPar(world);
-        updateRockPositionSystem(world, delta.asSeconds());
-        updateShapeSystem(world);
-        window.clear();
-        draw(world);
-        drawUI(world, delta);
+        buildUI(world, renderer, pipeline, trajectory, delta);
+        stepped = delta.asSeconds();
+        const sf::View& view = window.getView();
+        pipeline.start(stepped, view, view.getSize().x / window.getSize().x);
+        {
+            profile::Scope zone {"draw"};
+            window.clear();
+            renderer.draw(window);
+            ImGui::SFML::Render(window);
+        }
         window.display();
     }
 }
 
 int main()
 {
-    // testTree();
     run();
 }
@@ -0,0 +1,73 @@
+#include <algorithm>
+#include <array>
+#include <oneapi/tbb/parallel_for.h>
+#include "order.hpp"
+
+namespace {
+
+constexpr int digitBits {8};
+constexpr size_t digits {size_t(1) << digitBits};
+constexpr size_t blockSize {size_t(1) << 16}; // values per histogram
+
+/// Spreads the low 16 bits of x to the even bits
+uint32_t spreadBits(uint32_t x)
+{
+    x &= 0x0000ffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+uint32_t quantize(float offset, float scale)
+{
+    return static_cast<uint32_t>(std::clamp(offset * scale, 0.0f, 65535.0f));
+}
+
+}  // namespace
+
+uint32_t mortonKey(sf::Vector2f pos, sf::Vector2f min, float width)
+{
+    float scale = (width > 0.0f) ? 65536.0f / width : 0.0f;
+    return spreadBits(quantize(pos.x - min.x, scale)) | (spreadBits(quantize(pos.y - min.y, scale)) << 1);
+}
+
+void radixSort(std::vector<uint64_t>& values, std::vector<uint64_t>& scratch, int firstBit, int lastBit)
+{
+    const size_t n = values.size();
+    const size_t blocks = (n + blockSize - 1) / blockSize;
+    scratch.resize(n);
+    // counts[block][digit], turned into where the block's values with that digit go
+    std::vector<std::array<size_t, digits>> counts(blocks);
+    for (int shift = firstBit; shift < lastBit; shift += digitBits) {
+        const uint64_t mask = (uint64_t(1) << std::min(digitBits, lastBit - shift)) - 1;
+        tbb::parallel_for(size_t(0), blocks, [&](size_t b) {
+            auto& count = counts[b];
+            count.fill(0);
+            for (size_t i = b * blockSize, end = std::min(n, i + blockSize); i != end; ++i) {
+                ++count[(values[i] >> shift) & mask];
+            }
+        });
+        // digit major, block minor, so equal digits stay in the order they were
+        size_t next = 0;
+        bool sorted = false;
+        for (size_t d = 0; d < digits; ++d) {
+            size_t start = next;
+            for (auto& count : counts) {
+                size_t c = count[d];
+                count[d] = next;
+                next += c;
+            }
+            if (next - start == n) sorted = true; // one digit holds everything
+        }
+        if (sorted) continue;
+        tbb::parallel_for(size_t(0), blocks, [&](size_t b) {
+            auto& offset = counts[b];
+            for (size_t i = b * blockSize, end = std::min(n, i + blockSize); i != end; ++i) {
+                scratch[offset[(values[i] >> shift) & mask]++] = values[i];
+            }
+        });
+        values.swap(scratch);
+    }
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <SFML/System/Vector2.hpp>
+
+//
+// Spatial Order - Morton keys and a parallel radix sort to put rocks in tree order
+//
+
+/// Z-order key of pos in the square at min that is width across, 16 bits per axis
+/// Positions outside the square are clamped to its edges
+uint32_t mortonKey(sf::Vector2f pos, sf::Vector2f min, float width);
+
+/// Stable parallel LSD radix sort of values by their bits [firstBit, lastBit),
+/// 8 bits per pass. scratch is resized to fit and left holding garbage
+/// Passes where every value has the same digit are skipped
+void radixSort(std::vector<uint64_t>& values, std::vector<uint64_t>& scratch, int firstBit, int lastBit);
@@ -0,0 +1,125 @@
+#include "pipeline.hpp"
+#include "profile.hpp"
+#include "runner.hpp"
+
+namespace {
+
+/// Per frame counters for the profiler
+void recordCounters(const World& world)
+{
+    if (!profile::enabled) return;
+    const Tree& tree = world.rootTree;
+    profile::counter("tree depth", tree.depth());
+    profile::counter("tree nodes", tree.nodes.size());
+    if (!world.rocks.empty()) {
+        profile::counter("node visits/rock", static_cast<double>(world.gravityStats.nodeVisits) / world.rocks.size());
+    }
+    if (world.threeD) {
+        profile::counter("collision pairs", world.volume.collisions.pairs.size());
+        profile::counter("merged rocks", world.volume.collisions.merged);
+    } else {
+        profile::counter("collision pairs", world.collisions.pairs.size());
+        profile::counter("merged rocks", world.collisions.merged);
+    }
+}
+
+}  // namespace
+
+SimPipeline::SimPipeline(World& world, Renderer& renderer)
+    : world {world}, renderer {renderer}, worker {[this] { loop(); }}
+{
+}
+
+SimPipeline::~SimPipeline()
+{
+    {
+        std::unique_lock lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    worker.join();
+}
+
+void SimPipeline::push(WorldCommand command)
+{
+    std::lock_guard lock(mutex);
+    commands.push_back(std::move(command));
+}
+
+void SimPipeline::start(float stepDelta, const sf::View& stepView, float stepPixelSize)
+{
+    {
+        std::lock_guard lock(mutex);
+        delta = stepDelta;
+        view = stepView;
+        pixelSize = stepPixelSize;
+        running = true;
+        done = false;
+    }
+    changed.notify_all();
+}
+
+void SimPipeline::wait()
+{
+    {
+        profile::Scope zone {"wait for step"};
+        std::unique_lock lock(mutex);
+        if (!running) return;
+        changed.wait(lock, [this] { return done; });
+        running = false;
+    }
+    renderer.swapBuffers();
+    // the worker is idle until start(), so its step's zones can join this thread's
+    profile::endFrame();
+}
+
+void SimPipeline::loop()
+{
+    profile::addFrameThread();
+    std::unique_lock lock(mutex);
+    while (true) {
+        changed.wait(lock, [this] { return stopping || (running && !done); });
+        // a started step is finished before stopping so wait() can't hang
+        if (running && !done) {
+            std::swap(commands, taken);
+            lock.unlock();
+            step();
+            lock.lock();
+            done = true;
+            ++finished;
+            changed.notify_all();
+            continue;
+        }
+        if (stopping) return;
+    }
+}
+
+void SimPipeline::step()
+{
+    for (WorldCommand& command : taken) command(world);
+    taken.clear();
+    bool domainStep = !world.threeD && stepDomains();
+    if (!domainStep) stepWorld(world, delta);
+    // stepWorld only runs theta while its controller is enabled, the error estimate is
+    // shown either way. Domain steps run it here, on the workers' gravity time
+    if (domainStep || !world.thetaControl.enabled) updateThetaSystem(world);
+    recordCounters(world);
+    renderer.update(world, view, pixelSize);
+}
+
+bool SimPipeline::stepDomains()
+{
+    if (world.domainWorkers <= 0) {
+        domains.reset();
+        return false;
+    }
+    if (!domains || domains->config().workers != world.domainWorkers) {
+        domains.reset();  // stop the old workers first
+        domains = std::make_unique<DomainSim>(DomainConfig {.workers = world.domainWorkers});
+    }
+    if (domains->isRunning() && domains->step(world, delta)) return true;
+    // workers failed, step here from now on
+    domains.reset();
+    world.domainWorkers = 0;
+    return false;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <SFML/Graphics.hpp>
+#include "domain.hpp"
+#include "render.hpp"
+#include "world.hpp"
+
+//
+// Pipeline - the simulation steps on its own thread while the last step is drawn
+//
+
+/// A change to the world's rocks from the ui or mouse, run before the next step
+using WorldCommand = std::function<void(World&)>;
+
+/// Steps world and fills renderer's vertices on a worker thread, one frame ahead of
+/// the main thread which draws the vertices it swapped in
+/// Each frame the main thread calls wait(), then may read and change settings in
+/// world and renderer until it calls start(), and only draws after that. Rock edits
+/// go through push() so they're made on the worker before the tree is built
+/// The worker steps with stepWorld, then fills the vertices. Its profiler zones and
+/// counters join the frame wait() records (endFrame) on the main thread
+/// With world.domainWorkers set steps go to a DomainSim, which is restarted when
+/// the count changes and dropped (back to stepping here) if its workers fail
+class SimPipeline {
+public:
+    SimPipeline(World& world, Renderer& renderer);
+    ~SimPipeline();  // finishes the step in flight
+
+    SimPipeline(const SimPipeline&) = delete;
+    SimPipeline& operator=(const SimPipeline&) = delete;
+
+    /// Queues command for the start of the next step, from any thread
+    void push(WorldCommand command);
+
+    /// Starts a step of delta seconds, culling the vertices with view
+    void start(float delta, const sf::View& view, float pixelSize);
+
+    /// Waits for the step in flight, if any, then swaps its vertices in for drawing
+    void wait();
+
+    /// Steps finished so far
+    uint64_t steps() const { return finished; }
+
+private:
+    void loop();
+    void step();
+    bool stepDomains();
+
+    World& world;
+    Renderer& renderer;
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool running {false}; // a step was started and hasn't been waited for
+    bool done {false}; // the started step finished
+    bool stopping {false};
+    float delta {0.0f};
+    sf::View view;
+    float pixelSize {1.0f};
+    std::atomic<uint64_t> finished {0};
+    std::vector<WorldCommand> commands; // pushed, not yet run
+    std::vector<WorldCommand> taken; // worker's, being run
+    std::unique_ptr<DomainSim> domains; // only touched by the worker
+    std::thread worker; // last, starts once the rest is set up
+};
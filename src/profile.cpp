@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <fmt/core.h>
+#include "profile.hpp"
+
+namespace profile {
+
+std::atomic<bool> enabled {true};
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+const Clock::time_point start = Clock::now();
+
+int64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+/// Written only by its own thread, read by exportChromeTrace between frames
+struct ThreadBuffer {
+    std::vector<Event> events = std::vector<Event>(bufferEvents);
+    std::atomic<uint64_t> written {0};
+    uint32_t id {0};
+    int32_t depth {0};
+    bool frameThread {false}; // set under registryMutex
+    // this frame's system ms and counters, taken by endFrame for the frame threads
+    std::vector<std::pair<const char*, double>> frameSystems;
+    std::vector<std::pair<const char*, double>> frameCounters;
+};
+
+std::mutex registryMutex;
+std::vector<std::unique_ptr<ThreadBuffer>> buffers; // kept after threads exit
+
+ThreadBuffer& localBuffer()
+{
+    thread_local ThreadBuffer* buffer = [] {
+        std::lock_guard lock(registryMutex);
+        buffers.push_back(std::make_unique<ThreadBuffer>());
+        buffers.back()->id = static_cast<uint32_t>(buffers.size() - 1);
+        return buffers.back().get();
+    }();
+    return *buffer;
+}
+
+void add(std::vector<std::pair<const char*, double>>& frame, const char* name, double value, bool sum)
+{
+    for (auto& [n, v] : frame) {
+        if (n == name || std::strcmp(n, name) == 0) {
+            v = sum ? v + value : value;
+            return;
+        }
+    }
+    frame.emplace_back(name, value);
+}
+
+/// Pushes this frame's values into history, series missing this frame get 0
+void record(std::vector<Series>& history, std::vector<std::pair<const char*, double>>& frame, int slot)
+{
+    for (Series& series : history) {
+        series.values[slot] = 0.0f;
+        series.last = 0.0f;
+    }
+    for (const auto& [name, value] : frame) {
+        auto found = std::find_if(history.begin(), history.end(), [&](const Series& s) { return s.name == name; });
+        if (found == history.end()) {
+            history.push_back(Series {.name = name});
+            found = history.end() - 1;
+        }
+        found->values[slot] = static_cast<float>(value);
+        found->last = static_cast<float>(value);
+    }
+    frame.clear();
+}
+
+std::vector<Series> systemHistory;
+std::vector<Series> counterHistory;
+int frames {0};
+
+}  // namespace
+
+Scope::Scope(const char* name) : name {name}
+{
+    if (!enabled.load(std::memory_order_relaxed)) return;
+    ++localBuffer().depth;
+    begin = now();
+}
+
+Scope::~Scope()
+{
+    if (begin < 0) return;
+    int64_t end = now();
+    ThreadBuffer& buffer = localBuffer();
+    int32_t depth = --buffer.depth;
+    uint64_t n = buffer.written.load(std::memory_order_relaxed);
+    buffer.events[n % bufferEvents] = Event {.name = name, .begin = begin, .end = end, .depth = depth};
+    buffer.written.store(n + 1, std::memory_order_release);
+    if (depth == 0) add(buffer.frameSystems, name, (end - begin) * 1e-6, true);
+}
+
+void counter(const char* name, double value)
+{
+    add(localBuffer().frameCounters, name, value, false);
+}
+
+void addFrameThread()
+{
+    ThreadBuffer& buffer = localBuffer();
+    std::lock_guard lock(registryMutex);
+    buffer.frameThread = true;
+}
+
+void endFrame()
+{
+    ThreadBuffer& buffer = localBuffer();
+    {
+        std::lock_guard lock(registryMutex);
+        for (const auto& other : buffers) {
+            if (other.get() == &buffer || !other->frameThread) continue;
+            for (const auto& [name, ms] : other->frameSystems) add(buffer.frameSystems, name, ms, true);
+            for (const auto& [name, value] : other->frameCounters) add(buffer.frameCounters, name, value, false);
+            other->frameSystems.clear();
+            other->frameCounters.clear();
+        }
+    }
+    int slot = frames % historyFrames;
+    record(systemHistory, buffer.frameSystems, slot);
+    record(counterHistory, buffer.frameCounters, slot);
+    ++frames;
+}
+
+const std::vector<Series>& systems() { return systemHistory; }
+
+const std::vector<Series>& counters() { return counterHistory; }
+
+int frameOffset() { return frames % historyFrames; }
+
+bool exportChromeTrace(const std::string& path)
+{
+    std::FILE* file = std::fopen(path.c_str(), "w");
+    if (!file) {
+        fmt::print(stderr, "could not open {}\n", path);
+        return false;
+    }
+    fmt::print(file, "{{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    std::lock_guard lock(registryMutex);
+    for (const auto& buffer : buffers) {
+        uint64_t written = buffer->written.load(std::memory_order_acquire);
+        uint64_t oldest = (written > bufferEvents) ? written - bufferEvents : 0;
+        for (uint64_t i = oldest; i < written; ++i) {
+            const Event& event = buffer->events[i % bufferEvents];
+            fmt::print(file, "{}{{\"name\": \"{}\", \"ph\": \"X\", \"pid\": 0, \"tid\": {}, \"ts\": {:.3f}, \"dur\": {:.3f}}}",
+                       first ? "" : ",\n", event.name, buffer->id, event.begin * 1e-3, (event.end - event.begin) * 1e-3);
+            first = false;
+        }
+    }
+    fmt::print(file, "\n]}}\n");
+    return std::fclose(file) == 0;
+}
+
+}  // namespace profile
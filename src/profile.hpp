@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//
+// Profiler - scoped zones recorded into per thread ring buffers
+//
+
+namespace profile {
+
+constexpr size_t bufferEvents {1 << 15}; // per thread, oldest are overwritten
+constexpr int historyFrames {240}; // frames kept for the ui charts
+
+/// A finished zone, times are ns since the profiler started
+struct Event {
+    const char* name {nullptr}; // string literal
+    int64_t begin {0};
+    int64_t end {0};
+    int32_t depth {0}; // zones already open on the thread when it began
+};
+
+/// Per frame values of one system or counter, a ring indexed from frameOffset()
+struct Series {
+    std::string name;
+    std::vector<float> values = std::vector<float>(historyFrames, 0.0f);
+    float last {0.0f};
+};
+
+/// Zones are skipped (one relaxed load) while false
+extern std::atomic<bool> enabled;
+
+/// Times its own lifetime as a zone. Outermost zones on the thread that calls
+/// endFrame or a frame thread are the systems, their ms are summed per frame for
+/// the history
+class Scope {
+public:
+    explicit Scope(const char* name);
+    ~Scope();
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+private:
+    const char* name;
+    int64_t begin {-1}; // -1 when disabled
+};
+
+/// Sets a counter for this frame, call from the endFrame thread or a frame thread
+void counter(const char* name, double value);
+
+/// Adds the calling thread's outermost zones and counters to the frames endFrame
+/// records, for a thread doing part of each frame's work (like the pipeline's worker)
+void addFrameThread();
+
+/// Moves this frame's system ms and counters, from this thread and the frame
+/// threads, into the history. The frame threads must be between frames meanwhile
+void endFrame();
+
+const std::vector<Series>& systems();
+const std::vector<Series>& counters();
+
+/// Index of the oldest frame in every Series, for ImGui::PlotLines values_offset
+int frameOffset();
+
+/// Writes the zones still in the ring buffers as Chrome trace json, for
+/// chrome://tracing or Perfetto. Call between frames, zones ending while it
+/// runs may come out garbled. False if path can't be written
+bool exportChromeTrace(const std::string& path);
+
+}  // namespace profile
@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <cmath>
+#include <oneapi/tbb/parallel_for.h>
+#include "profile.hpp"
+#include "render.hpp"
+
+namespace {
+
+sf::Color colorFromVelocity(const sf::Vector2f& vel, const float velExtent)
+{
+    float vel_percent = ((vel.x * vel.x + vel.y * vel.y)
+                         / (velExtent * velExtent));
+    int red_level = std::clamp((int)(vel_percent * 255), 0, 255);
+    return sf::Color(red_level, 0, 255 - red_level);
+}
+
+/// Two triangles covering the square around pos, texture y follows screen y
+void setQuad(sf::Vertex* quad, sf::Vector2f pos, float radius, sf::Color color)
+{
+    const float size = static_cast<float>(Renderer::discSize);
+    float left = pos.x - radius;
+    float right = pos.x + radius;
+    float top = -pos.y - radius;
+    float bottom = -pos.y + radius;
+    quad[0] = sf::Vertex({left, top}, color, {0.0f, 0.0f});
+    quad[1] = sf::Vertex({right, top}, color, {size, 0.0f});
+    quad[2] = sf::Vertex({right, bottom}, color, {size, size});
+    quad[3] = quad[0];
+    quad[4] = quad[2];
+    quad[5] = sf::Vertex({left, bottom}, color, {0.0f, size});
+}
+
+}  // namespace
+
+void Renderer::update(const World& world, const sf::View& view, float pixelSize)
+{
+    profile::Scope zone {"render"};
+    sf::Vector2f center = view.getCenter();
+    sf::Vector2f half = view.getSize() / 2.0f;
+    viewLeft = center.x - half.x;
+    viewRight = center.x + half.x;
+    viewBottom = -center.y - half.y;
+    viewTop = -center.y + half.y;
+    pixel = pixelSize;
+
+    const Tree& tree = world.rootTree;
+    visible.clear();
+    splats.clear();
+    splatRadius.clear();
+    gather(tree, 0);
+    if (tree.size() != world.rocks.size()) {
+        // rocks outside the root are in no leaf
+        for (const Rock& rock : world.rocks) {
+            if (!tree.contains(0, rock.pos) && inView(rock.pos, rock.radius)) visible.push_back(&rock);
+        }
+    }
+    rockCount = visible.size();
+    splatCount = splats.size();
+
+    vertices.resize((rockCount + splatCount) * 6);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, rockCount, 1024), [&](const auto& range) {
+        for (size_t i = range.begin(); i != range.end(); ++i) {
+            const Rock& rock = *visible[i];
+            setQuad(&vertices[i * 6], rock.pos, rock.radius, colorFromVelocity(rock.vel, world.velColorExtent));
+        }
+    });
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, splatCount, 1024), [&](const auto& range) {
+        for (size_t i = range.begin(); i != range.end(); ++i) {
+            const TreeNode& node = tree.nodes[splats[i]];
+            auto alpha = static_cast<sf::Uint8>(std::min(node.total_mass / splatMass, 1.0f) * 255.0f);
+            setQuad(&vertices[(rockCount + i) * 6], node.center_mass, splatRadius[i], sf::Color(255, 255, 255, alpha));
+        }
+    });
+}
+
+void Renderer::gather(const Tree& tree, int32_t index)
+{
+    const TreeNode& node = tree.nodes[index];
+    if (!node.hasChildren() && node.count == 0) return;
+    // rocks stick out of their node by up to max_radius, and may have moved a bit
+    float margin = node.max_radius + pixel;
+    if (tree.right(index) + margin < viewLeft || tree.left(index) - margin > viewRight
+        || tree.top(index) + margin < viewBottom || tree.bottom(index) - margin > viewTop) {
+        return;
+    }
+    float extent = node.width + 2.0f * node.max_radius;
+    if (levelOfDetail && extent < splatPixels * pixel) {
+        splats.push_back(index);
+        splatRadius.push_back(std::max(extent, pixel) / 2.0f);
+    } else if (node.hasChildren()) {
+        for (int32_t child = node.children; child < node.children + tree.fanout; ++child) {
+            gather(tree, child);
+        }
+    } else {
+        for (const Rock* rock : tree.elements(index)) {
+            if (inView(rock->pos, rock->radius)) visible.push_back(rock);
+        }
+    }
+}
+
+void Renderer::draw(sf::RenderWindow& window)
+{
+    if (!hasDisc) createDisc();
+    window.draw(drawn, sf::RenderStates(&disc));
+}
+
+void Renderer::createDisc()
+{
+    // white disc with a one pixel soft edge, vertex colors tint it
+    sf::Image image;
+    image.create(discSize, discSize, sf::Color::Transparent);
+    const float center = discSize / 2.0f;
+    for (unsigned y = 0; y < discSize; ++y) {
+        for (unsigned x = 0; x < discSize; ++x) {
+            float dx = x + 0.5f - center;
+            float dy = y + 0.5f - center;
+            float edge = center - std::sqrt(dx * dx + dy * dy);
+            auto alpha = static_cast<sf::Uint8>(std::clamp(edge + 0.5f, 0.0f, 1.0f) * 255.0f);
+            image.setPixel(x, y, sf::Color(255, 255, 255, alpha));
+        }
+    }
+    disc.loadFromImage(image);
+    disc.setSmooth(true);
+    disc.generateMipmap(); // stays smooth when zoomed far out
+    hasDisc = true;
+}
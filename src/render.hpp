@@ -0,0 +1,59 @@
+#pragma once
+
+#include <utility>
+#include <SFML/Graphics.hpp>
+#include "world.hpp"
+
+//
+// Renderer - all rocks as textured quads in one vertex array
+//
+
+/// Draws rocks with a single draw call. Each rock is two triangles showing a disc
+/// texture tinted by its velocity color, filled in parallel straight from the rocks
+/// Only rocks in view are drawn, found by walking the world's tree, and nodes whose
+/// rocks all fit in a couple of pixels are drawn as one splat as bright as their mass
+struct Renderer {
+    sf::VertexArray vertices {sf::Triangles}; // filled by update
+    sf::VertexArray drawn {sf::Triangles}; // what draw shows, see swapBuffers
+    sf::Texture disc;
+    bool levelOfDetail {true}; // draw tiny nodes as splats
+    float splatPixels {2.0f}; // nodes spanning fewer pixels than this are splats
+    float splatMass {1000.0f}; // a splat with this much mass is fully opaque
+    size_t rockCount {0}; // rocks in the last update
+    size_t splatCount {0}; // splats in the last update
+
+    static constexpr unsigned discSize {64}; // texture pixels across
+
+    /// Rebuilds the vertices for what's inside view, pixelSize is in world units
+    /// Screen y is flipped from world y. Uses world.rootTree as last built, rocks
+    /// that have moved a little since then are still found
+    void update(const World& world, const sf::View& view, float pixelSize);
+
+    /// Hands the last update's vertices to draw, so the next update can be filled
+    /// on another thread while they are drawn
+    void swapBuffers() { std::swap(vertices, drawn); }
+
+    /// Draws the vertices last swapped in, creates the disc texture the first time
+    void draw(sf::RenderWindow& window);
+
+private:
+    bool inView(sf::Vector2f pos, float radius) const {
+        return pos.x + radius >= viewLeft && pos.x - radius <= viewRight
+            && pos.y + radius >= viewBottom && pos.y - radius <= viewTop;
+    }
+
+    /// Collects visible rocks and splat nodes below node
+    void gather(const Tree& tree, int32_t node);
+
+    void createDisc();
+
+    bool hasDisc {false};
+    float viewLeft {0.0f}; // view in world coordinates
+    float viewRight {0.0f};
+    float viewBottom {0.0f};
+    float viewTop {0.0f};
+    float pixel {1.0f};
+    std::vector<const Rock*> visible;
+    std::vector<int32_t> splats;
+    std::vector<float> splatRadius; // same index as splats
+};
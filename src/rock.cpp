@@ -1,50 +1,90 @@
+#include <cmath>
 #include "util.h"
 #include "rock.hpp"
 
-namespace {
-
-inline float dist2(const sf::Vector2f& a, const sf::Vector2f& b)
-{
-    // note: hypot function was slower
-    return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y);
-}
-
-}  // namespace
-
-Rock newRandomRock(const RockConfig& config)
+Rock newRandomRock(const RockConfig& config, util::Random& random)
 {
     Rock rock;
-    rock.pos.x = util::f_rand(-config.posExtent, config.posExtent);
-    rock.pos.y = util::f_rand(-config.posExtent, config.posExtent);
-    rock.vel.x = util::f_rand(-config.velExtent, config.velExtent);
-    rock.vel.y = util::f_rand(-config.velExtent, config.velExtent);
-    rock.radius = util::f_rand(config.radiusMin, config.radiusMax);
+    rock.pos.x = random.uniform(-config.posExtent, config.posExtent);
+    rock.pos.y = random.uniform(-config.posExtent, config.posExtent);
+    rock.vel.x = random.uniform(-config.velExtent, config.velExtent);
+    rock.vel.y = random.uniform(-config.velExtent, config.velExtent);
+    rock.radius = random.uniform(config.radiusMin, config.radiusMax);
     rock.mass = rock.radius * rock.radius * rock.radius;
     return rock;
 }
 
 /// Returns true if in contact and still moving towards one another
-bool isColliding(const Rock& a, const Rock& b)
+template <int Dim>
+bool isColliding(const Body<Dim>& a, const Body<Dim>& b)
 {
-    float currentDistance2 = dist2(a.pos, b.pos);
+    // note: hypot function was slower
+    float currentDistance2 = lengthSquared(a.pos - b.pos);
     if (currentDistance2 > ((a.radius + b.radius) * (a.radius + b.radius))) return false;
     // Now check if still moving closer to one another
     // by using a very small time increment
-    sf::Vector2f future_a_pos = a.pos + (a.vel * 0.001f);
-    sf::Vector2f future_b_pos = b.pos + (b.vel * 0.001f);
-    float futureDistance2 = dist2(future_a_pos, future_b_pos);
+    Vec<Dim> future_a_pos = a.pos + (a.vel * 0.001f);
+    Vec<Dim> future_b_pos = b.pos + (b.vel * 0.001f);
+    float futureDistance2 = lengthSquared(future_a_pos - future_b_pos);
     return (futureDistance2 < currentDistance2);
 }
 
+template <int Dim>
+std::optional<float> timeOfImpact(const Body<Dim>& a, const Body<Dim>& b, float timestep)
+{
+    // |d + v t| = r with d, v relative position and velocity, a quadratic in t
+    Vec<Dim> d = b.pos - a.pos;
+    Vec<Dim> v = b.vel - a.vel;
+    float r = a.radius + b.radius;
+    float half_b = dot(d, v);
+    if (half_b >= 0.0f) return std::nullopt; // not moving closer
+    float c = lengthSquared(d) - r * r;
+    if (c <= 0.0f) return 0.0f;
+    float vv = lengthSquared(v);
+    float disc = half_b * half_b - vv * c;
+    if (disc < 0.0f) return std::nullopt; // closest approach misses
+    // smaller root as c / (-b + sqrt(disc)), stays accurate when vv * c is tiny
+    float t = c / (-half_b + std::sqrt(disc));
+    if (t > timestep) return std::nullopt;
+    return t;
+}
+
 /// Update velocity vectors from a collision to bounce away
-void updateForCollision(Rock& a, Rock& b)
+template <int Dim>
+void updateForCollision(Body<Dim>& a, Body<Dim>& b, float time)
 {
-    sf::Vector2f a_new_vel = (a.vel * (a.mass - b.mass) + (2.0f * b.mass * b.vel)) / (a.mass + b.mass);
-    sf::Vector2f b_new_vel = (b.vel * (b.mass - a.mass) + (2.0f * a.mass * a.vel)) / (a.mass + b.mass);
+    a.pos += a.vel * time;
+    b.pos += b.vel * time;
+    Vec<Dim> a_new_vel = (a.vel * (a.mass - b.mass) + (2.0f * b.mass * b.vel)) / (a.mass + b.mass);
+    Vec<Dim> b_new_vel = (b.vel * (b.mass - a.mass) + (2.0f * a.mass * a.vel)) / (a.mass + b.mass);
     a.vel = a_new_vel;
     b.vel = b_new_vel;
+    a.pos -= a.vel * time;
+    b.pos -= b.vel * time;
 }
 
+template <int Dim>
+void mergeRocks(Body<Dim>& a, const Body<Dim>& b)
+{
+    // massless rocks (like addSatRocks) meet halfway
+    float mass = a.mass + b.mass;
+    float b_share = (mass > 0.0f) ? b.mass / mass : 0.5f;
+    // the center of mass moves at the merged velocity, so this holds at any impact time
+    a.pos += (b.pos - a.pos) * b_share;
+    a.vel += (b.vel - a.vel) * b_share;
+    a.radius = std::cbrt(a.radius * a.radius * a.radius + b.radius * b.radius * b.radius);
+    a.mass = mass;
+}
+
+template bool isColliding(const Body<2>&, const Body<2>&);
+template bool isColliding(const Body<3>&, const Body<3>&);
+template std::optional<float> timeOfImpact(const Body<2>&, const Body<2>&, float);
+template std::optional<float> timeOfImpact(const Body<3>&, const Body<3>&, float);
+template void updateForCollision(Body<2>&, Body<2>&, float);
+template void updateForCollision(Body<3>&, Body<3>&, float);
+template void mergeRocks(Body<2>&, const Body<2>&);
+template void mergeRocks(Body<3>&, const Body<3>&);
+
 std::ostream& operator<<(std::ostream& out, const Rock& r)
 {
     return out << "Rock: pos: " << r.pos.x << "," << r.pos.y
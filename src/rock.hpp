@@ -1,30 +1,63 @@
 #pragma once
 
+#include <cstdint>
 #include <iostream>
-#include "SFML/System/Vector2.hpp"
+#include <optional>
+#include "util.h"
+#include "vec.hpp"
 
 //
 // Rock - Abstract Entity in Simulation
 //
 
-struct Rock {
-    sf::Vector2f pos {0,0};
-    sf::Vector2f vel {0,0};
+/// A rock in Dim dimensions, the engine's tree and gravity walk work on either
+template <int Dim>
+struct Body {
+    Vec<Dim> pos {};
+    Vec<Dim> vel {};
     float radius {0.0f};
     float mass {0.0f};
+    uint32_t id {0}; // stays with the rock when rocks are reordered, see World::nextRockId
 };
 
+using Rock = Body<2>;
+using Rock3 = Body<3>; // World::threeD
+
+/// How new rocks are laid out (see generateRocks)
+enum class Layout { Box, Plummer, Disk, Collision };
+
 struct RockConfig {
     float posExtent {45.0f};
     float velExtent {10.0f};
     float radiusMin {1.0f};
     float radiusMax {6.0f};
+    Layout layout {Layout::Box};
+    uint64_t seed {1}; // same seed and rock indices give the same rocks
 };
 
-Rock newRandomRock(const RockConfig& config);
+/// Uniform in the box +/-posExtent with velocities uniform in +/-velExtent
+Rock newRandomRock(const RockConfig& config, util::Random& random);
+
+//
+// Collisions - in either dimension, instantiated in rock.cpp for 2 and 3
+//
+
+template <int Dim>
+bool isColliding(const Body<Dim>& a, const Body<Dim>& b);
+
+/// Time in [0, timestep] when a and b first touch moving at their velocities, 0 if
+/// already touching and moving closer, none if they don't meet within the step
+template <int Dim>
+std::optional<float> timeOfImpact(const Body<Dim>& a, const Body<Dim>& b, float timestep);
 
-bool isColliding(const Rock& a, const Rock& b);
+/// Bounces a and b as if they met time into the step: positions are moved so a
+/// drift of the whole step with the new velocities ends where the bounce would
+template <int Dim>
+void updateForCollision(Body<Dim>& a, Body<Dim>& b, float time = 0.0f);
 
-void updateForCollision(Rock& a, Rock& b);
+/// Merges b into a keeping total mass and momentum, a moves to the center of mass and
+/// gets the radius holding both their volumes. b is left for the caller to remove
+template <int Dim>
+void mergeRocks(Body<Dim>& a, const Body<Dim>& b);
 
 std::ostream& operator<<(std::ostream& out, const Rock& r);
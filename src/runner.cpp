@@ -0,0 +1,48 @@
+#include "runner.hpp"
+#include "util.h"
+
+StepTimings stepWorld(World& world, float timestep)
+{
+    StepTimings timings;
+    util::Stopwatch watch;
+    if (world.threeD) {
+        updateVolumeTreeSystem(world);
+        timings.tree = watch.restart();
+        updateVolumeGravitySystem(world, timestep);
+        if (world.thetaControl.enabled) updateThetaSystem(world);
+        timings.gravity = watch.restart();
+        updateVolumeCollisionSystem(world, timestep);
+        timings.collision = watch.restart();
+        updateVolumePositionSystem(world, timestep);
+        timings.position = watch.restart();
+        return timings;
+    }
+    updateTreeSystem(world);
+    timings.tree = watch.restart();
+    if (world.blockTimesteps) {
+        // block steps do gravity and positions together, all counted as gravity
+        updateCollisionSystemPar(world, timestep);
+        timings.collision = watch.restart();
+        updateBlockStepSystem(world, timestep);
+        if (world.thetaControl.enabled) updateThetaSystem(world);
+        timings.gravity = watch.restart();
+        return timings;
+    }
+    if (world.fusedTraversal) {
+        // the fused walk counts as gravity, collisions are only resolved after it
+        updateGravityCollisionSystem(world, timestep);
+        if (world.thetaControl.enabled) updateThetaSystem(world);
+        timings.gravity = watch.restart();
+        resolveCollisions(world);
+        timings.collision = watch.restart();
+    } else {
+        updateGravitySystemTree(world, timestep);
+        if (world.thetaControl.enabled) updateThetaSystem(world);
+        timings.gravity = watch.restart();
+        updateCollisionSystemPar(world, timestep);
+        timings.collision = watch.restart();
+    }
+    updateRockPositionSystem(world, timestep);
+    timings.position = watch.restart();
+    return timings;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "world.hpp"
+
+//
+// Fixed step simulation runs without a window (headless and benchmarks)
+//
+
+/// Milliseconds spent in each system during one step
+struct StepTimings {
+    double tree {0.0};
+    double gravity {0.0};
+    double collision {0.0};
+    double position {0.0};
+
+    double total() const { return tree + gravity + collision + position; }
+};
+
+/// Advance world one step using the same systems (and order) as the gui loop
+/// The theta controller only runs when enabled, and counts as gravity
+StepTimings stepWorld(World& world, float timestep);
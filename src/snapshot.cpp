@@ -0,0 +1,272 @@
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <fmt/core.h>
+#include <oneapi/tbb/parallel_for.h>
+#include <oneapi/tbb/parallel_reduce.h>
+#include "snapshot.hpp"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#endif
+
+namespace {
+
+constexpr size_t columnCount {7};
+constexpr size_t version1Columns {6}; // no ids
+
+size_t recordBytes(uint64_t count, size_t columns)
+{
+    return sizeof(SnapshotHeader) + count * columns * sizeof(float);
+}
+
+/// Rocks to columns, columns is resized to fit
+void packColumns(const std::vector<Rock>& rocks, std::vector<float>& columns)
+{
+    const size_t n = rocks.size();
+    columns.resize(n * columnCount);
+    float* col = columns.data();
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, n, 4096), [&](const auto& range) {
+        for (size_t i = range.begin(); i != range.end(); ++i) {
+            const Rock& rock = rocks[i];
+            col[i] = rock.pos.x;
+            col[n + i] = rock.pos.y;
+            col[2 * n + i] = rock.vel.x;
+            col[3 * n + i] = rock.vel.y;
+            col[4 * n + i] = rock.radius;
+            col[5 * n + i] = rock.mass;
+            col[6 * n + i] = std::bit_cast<float>(rock.id);
+        }
+    });
+}
+
+/// Columns to rocks, without an id column rocks are numbered in order
+void unpackColumns(const float* col, size_t n, size_t columns, std::vector<Rock>& rocks)
+{
+    rocks.resize(n);
+    const bool with_ids = (columns > version1Columns);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, n, 4096), [&](const auto& range) {
+        for (size_t i = range.begin(); i != range.end(); ++i) {
+            Rock& rock = rocks[i];
+            rock.pos = {col[i], col[n + i]};
+            rock.vel = {col[2 * n + i], col[3 * n + i]};
+            rock.radius = col[4 * n + i];
+            rock.mass = col[5 * n + i];
+            rock.id = with_ids ? std::bit_cast<uint32_t>(col[6 * n + i]) : static_cast<uint32_t>(i);
+        }
+    });
+}
+
+bool writeRecord(std::FILE* file, const SnapshotHeader& header, const std::vector<float>& columns)
+{
+    return std::fwrite(&header, sizeof(header), 1, file) == 1
+        && std::fwrite(columns.data(), sizeof(float), columns.size(), file) == columns.size();
+}
+
+bool validHeader(const SnapshotHeader& header)
+{
+    SnapshotHeader expected;
+    return std::memcmp(header.magic, expected.magic, sizeof(header.magic)) == 0
+        && ((header.version == expected.version && header.columns == columnCount)
+            || (header.version == 1 && header.columns == version1Columns));
+}
+
+/// Read only view of a whole file, memory mapped where we can
+struct MappedFile {
+    const char* data {nullptr};
+    size_t size {0};
+
+    explicit MappedFile(const std::string& path)
+    {
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat info;
+        if (::fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* map = ::mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                data = static_cast<const char*>(map);
+                size = info.st_size;
+                ::madvise(map, size, MADV_SEQUENTIAL);
+            }
+        }
+        ::close(fd);
+#else
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in) return;
+        buffer.resize(in.tellg());
+        in.seekg(0);
+        in.read(buffer.data(), buffer.size());
+        if (!in) return;
+        data = buffer.data();
+        size = buffer.size();
+#endif
+    }
+
+    ~MappedFile()
+    {
+#ifndef _WIN32
+        if (data) ::munmap(const_cast<char*>(data), size);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+#ifdef _WIN32
+    std::vector<char> buffer;
+#endif
+};
+
+}  // namespace
+
+bool saveSnapshot(const World& world, const std::string& path, uint64_t frame, double time)
+{
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file) {
+        fmt::print(stderr, "could not open {}\n", path);
+        return false;
+    }
+    SnapshotHeader header {.count = world.rocks.size(), .frame = frame, .time = time};
+    std::vector<float> columns;
+    packColumns(world.rocks, columns);
+    bool ok = writeRecord(file, header, columns);
+    ok = (std::fclose(file) == 0) && ok;
+    if (!ok) fmt::print(stderr, "could not write {}\n", path);
+    return ok;
+}
+
+std::optional<SnapshotHeader> loadSnapshot(World& world, const std::string& path, size_t index)
+{
+    MappedFile map(path);
+    if (!map.data) {
+        fmt::print(stderr, "could not read {}\n", path);
+        return std::nullopt;
+    }
+    // headers say how long their record is, skip to the one we want
+    size_t offset = 0;
+    SnapshotHeader header;
+    for (size_t record = 0;; ++record) {
+        if (map.size - offset < sizeof(header)) {
+            fmt::print(stderr, "{} has no record {}\n", path, index);
+            return std::nullopt;
+        }
+        std::memcpy(&header, map.data + offset, sizeof(header));
+        if (!validHeader(header)) {
+            fmt::print(stderr, "{} is not a version 1 or {} snapshot\n", path, SnapshotHeader {}.version);
+            return std::nullopt;
+        }
+        if (header.count > (map.size - offset) / (header.columns * sizeof(float))
+            || recordBytes(header.count, header.columns) > map.size - offset) {
+            fmt::print(stderr, "{} is truncated\n", path);
+            return std::nullopt;
+        }
+        if (record == index) break;
+        offset += recordBytes(header.count, header.columns);
+    }
+    // records are 40 + 4 * columns * count bytes, multiples of 4, so the columns are
+    // float aligned (headers are copied out, they needn't be 8 byte aligned)
+    const float* columns = reinterpret_cast<const float*>(map.data + offset + sizeof(header));
+    deleteAllRocks(world);
+    unpackColumns(columns, header.count, header.columns, world.rocks);
+    world.nextRockId = tbb::parallel_reduce(
+        tbb::blocked_range<size_t>(0, world.rocks.size(), 4096), uint32_t(0),
+        [&world](const auto& range, uint32_t next) {
+            for (size_t i = range.begin(); i != range.end(); ++i) next = std::max(next, world.rocks[i].id + 1);
+            return next;
+        },
+        [](uint32_t a, uint32_t b) { return std::max(a, b); });
+    if (world.threeD) liftRocks(world);
+    return header;
+}
+
+//
+// Trajectory Writer
+//
+
+TrajectoryWriter::TrajectoryWriter(const std::string& path, int every)
+    : file {std::fopen(path.c_str(), "wb")}, every {std::max(every, 1)}
+{
+    if (!file) {
+        fmt::print(stderr, "could not open {}\n", path);
+        return;
+    }
+    thread = std::thread(&TrajectoryWriter::writeLoop, this);
+}
+
+TrajectoryWriter::~TrajectoryWriter()
+{
+    if (!file) return;
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    thread.join();
+    std::fclose(file);
+}
+
+void TrajectoryWriter::record(const World& world, uint64_t frame, double time)
+{
+    if (!file || frame % every != 0) return;
+    Frame next {.header = {.count = world.rocks.size(), .frame = frame, .time = time}};
+    {
+        std::unique_lock lock(mutex);
+        if (failed) return;
+        changed.wait(lock, [&] { return queue.size() < maxQueued; });
+        if (!spare.empty()) {
+            next.columns = std::move(spare.back());
+            spare.pop_back();
+        }
+    }
+    packColumns(world.rocks, next.columns);
+    {
+        std::lock_guard lock(mutex);
+        queue.push_back(std::move(next));
+    }
+    changed.notify_all();
+}
+
+void TrajectoryWriter::flush()
+{
+    if (!file) return;
+    std::unique_lock lock(mutex);
+    changed.wait(lock, [&] { return queue.empty() && !writing; });
+    std::fflush(file);
+}
+
+size_t TrajectoryWriter::written()
+{
+    std::lock_guard lock(mutex);
+    return writtenFrames;
+}
+
+void TrajectoryWriter::writeLoop()
+{
+    std::unique_lock lock(mutex);
+    while (true) {
+        changed.wait(lock, [&] { return !queue.empty() || stopping; });
+        if (queue.empty()) return; // stopping with nothing left
+        Frame frame = std::move(queue.front());
+        queue.pop_front();
+        writing = true;
+        lock.unlock();
+        changed.notify_all(); // room in the queue
+        bool ok = writeRecord(file, frame.header, frame.columns);
+        lock.lock();
+        writing = false;
+        if (ok) {
+            ++writtenFrames;
+        } else if (!failed) {
+            failed = true;
+            fmt::print(stderr, "trajectory write failed after {} frames\n", writtenFrames);
+        }
+        spare.push_back(std::move(frame.columns));
+        changed.notify_all();
+    }
+}
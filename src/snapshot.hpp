@@ -0,0 +1,89 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "world.hpp"
+
+//
+// Snapshots - rocks saved to a binary file and read back
+//
+
+/// A snapshot record is this header followed by count 4 byte values for each column,
+/// in order pos.x, pos.y, vel.x, vel.y, radius, mass as floats then id as uint32.
+/// Host byte order (little endian on everything we build for). Version 1 records have
+/// no id column, their rocks get ids in file order when loaded
+/// A trajectory file is just records one after another
+struct SnapshotHeader {
+    char magic[8] {'G', 'R', 'A', 'V', 'S', 'N', 'A', 'P'};
+    uint32_t version {2};
+    uint32_t columns {7};
+    uint64_t count {0}; // rocks
+    uint64_t frame {0};
+    double time {0.0}; // seconds of sim time
+};
+static_assert(sizeof(SnapshotHeader) == 40, "header size is part of the file format");
+
+/// Writes world's rocks as a single record to path, replacing it. False on failure
+/// Snapshots are 2d, in threeD they hold the projection
+bool saveSnapshot(const World& world, const std::string& path, uint64_t frame = 0, double time = 0.0);
+
+/// Replaces world's rocks with record number index of path (0 for a plain snapshot)
+/// The file is memory mapped and its columns copied into rocks in parallel
+/// world.nextRockId continues after the highest loaded id, in threeD the rocks are
+/// lifted into space at z = 0
+/// Returns the record's header, nothing if the file can't be read or has no such record
+std::optional<SnapshotHeader> loadSnapshot(World& world, const std::string& path, size_t index = 0);
+
+/// Streams every Nth frame to a trajectory file. record() copies the rocks into
+/// columns on the calling thread and a background thread does the writing, so the
+/// sim only waits on the disk when maxQueued frames are already waiting
+class TrajectoryWriter {
+public:
+    /// Opens path, replacing it. Check isOpen() afterwards
+    TrajectoryWriter(const std::string& path, int every);
+    /// Writes everything still queued then closes the file
+    ~TrajectoryWriter();
+
+    TrajectoryWriter(const TrajectoryWriter&) = delete;
+    TrajectoryWriter& operator=(const TrajectoryWriter&) = delete;
+
+    bool isOpen() const { return file != nullptr; }
+
+    /// Queues world's rocks if frame is a multiple of every
+    void record(const World& world, uint64_t frame, double time);
+
+    /// Waits until every queued frame is written
+    void flush();
+
+    /// Frames written so far, stops counting if a write fails
+    size_t written();
+
+    static constexpr size_t maxQueued {4};
+
+private:
+    struct Frame {
+        SnapshotHeader header;
+        std::vector<float> columns;
+    };
+
+    void writeLoop();
+
+    std::FILE* file {nullptr};
+    int every {1};
+    std::mutex mutex; // guards everything below
+    std::condition_variable changed;
+    std::deque<Frame> queue;
+    std::vector<std::vector<float>> spare; // written buffers for reuse
+    bool writing {false}; // writer thread holds a frame outside the queue
+    bool stopping {false};
+    bool failed {false};
+    size_t writtenFrames {0};
+    std::thread thread;
+};
@@ -0,0 +1,502 @@
+#include <algorithm>
+#include <functional>
+#include <oneapi/tbb/parallel_for.h>
+#include <oneapi/tbb/parallel_reduce.h>
+#include <oneapi/tbb/task_group.h>
+#include "profile.hpp"
+#include "tree.hpp"
+
+namespace {
+
+/// Adds m(3 d d^T - |d|^2 I) to quad
+template <int Dim>
+void addQuadrupole(std::array<float, Dim * (Dim + 1) / 2>& quad, float m, Vec<Dim> d)
+{
+    float d2 = lengthSquared(d);
+    for (int i = 0; i < Dim; ++i) {
+        for (int j = i; j < Dim; ++j) {
+            quad[symmetricIndex<Dim>(i, j)] += m * (3.0f * axis(d, i) * axis(d, j) - (i == j ? d2 : 0.0f));
+        }
+    }
+}
+
+}  // namespace
+
+template <int Dim>
+void BasicTree<Dim>::reset(Point corner, float width)
+{
+    nodes.clear();
+    bounds.clear();
+    items.clear();
+    nodes.push_back(Node {.width = width});
+    bounds.push_back(NodeBounds<Dim> {.corner = corner});
+    minWidth = width * 0x1.0p-20f; // about 20 levels
+    builtRocks = nullptr;
+    builtRockCount = 0;
+    elementCount = 0;
+}
+
+template <int Dim>
+void BasicTree<Dim>::createChildren(int32_t node)
+{
+    float half = nodes[node].width / 2.0f;
+    Point corner = bounds[node].corner;
+    nodes[node].children = static_cast<int32_t>(nodes.size());
+    for (int i = 0; i < fanout; ++i) {
+        nodes.push_back(Node {.width = half});
+        // bit k of the child index is the upper half along axis k, as in orthant
+        Point child = corner;
+        for (int k = 0; k < Dim; ++k) {
+            if (i & (1 << k)) axis(child, k) += half;
+        }
+        bounds.push_back(NodeBounds<Dim> {.corner = child});
+    }
+}
+
+template <int Dim>
+void BasicTree<Dim>::addToLeaf(int32_t index, Element* rock)
+{
+    Node& node = nodes[index];
+    if (node.first < 0) {
+        node.first = static_cast<int32_t>(items.size());
+        items.resize(items.size() + leafSize);
+    } else if (node.count == capacity(node.count)) {
+        // the old slots are left unused, like a split leaf's
+        int32_t first = static_cast<int32_t>(items.size());
+        items.resize(items.size() + 2 * node.count);
+        std::copy_n(items.begin() + node.first, node.count, items.begin() + first);
+        node.first = first;
+    }
+    items[node.first + node.count++] = rock;
+    node.total_mass += rock->mass;
+    node.center_mass += (rock->mass / node.total_mass) * (rock->pos - node.center_mass);
+    if (rock->radius > node.max_radius) node.max_radius = rock->radius;
+}
+
+template <int Dim>
+void BasicTree<Dim>::split(int32_t index)
+{
+    createChildren(index);
+    // by index, adding to the children can reallocate items
+    Node& node = nodes[index];
+    for (int32_t k = 0; k < node.count; ++k) {
+        Element* rock = items[node.first + k];
+        addToLeaf(node.children + orthant(index, rock->pos), rock);
+    }
+    node.first = -1; // the old slots are left unused
+    node.count = 0;
+}
+
+template <int Dim>
+void BasicTree<Dim>::insert(Element* rock)
+{
+    if (!contains(0, rock->pos)) return;
+    int32_t i = 0;
+    while (true) {
+        // note: split can reallocate nodes so no references are held across it
+        if (nodes[i].hasChildren()) {
+            Node& node = nodes[i];
+            node.total_mass += rock->mass;
+            node.center_mass += (rock->mass / node.total_mass) * (rock->pos - node.center_mass);
+            if (rock->radius > node.max_radius) node.max_radius = rock->radius;
+            i = node.children + orthant(i, rock->pos);
+        } else if (nodes[i].count < leafSize) {
+            addToLeaf(i, rock);
+            ++elementCount;
+            return;
+        } else {
+            // a full leaf of rocks all at one point would split forever, it grows instead
+            auto leaf = elements(i);
+            if (nodes[i].width <= minWidth
+                || std::all_of(leaf.begin(), leaf.end(), [rock](Element* e) { return e->pos == rock->pos; })) {
+                addToLeaf(i, rock);
+                ++elementCount;
+                return;
+            }
+            // split keeps the totals, then keep descending with rock
+            split(i);
+        }
+    }
+}
+
+template <int Dim>
+void BasicTree<Dim>::sumQuadrupole(int32_t index)
+{
+    Node& node = nodes[index];
+    node.quad = {};
+    for (int32_t child = node.children; child < node.children + fanout; ++child) {
+        const Node& c = nodes[child];
+        if (c.total_mass == 0.0f) continue;
+        // parallel axis: shift the child's moment from its center of mass to ours
+        for (int q = 0; q < Node::quadSize; ++q) node.quad[q] += c.quad[q];
+        addQuadrupole<Dim>(node.quad, c.total_mass, c.center_mass - node.center_mass);
+    }
+}
+
+template <int Dim>
+void BasicTree<Dim>::sumChildren(int32_t index)
+{
+    Node& node = nodes[index];
+    Point weighted {};
+    node.total_mass = 0.0f;
+    node.max_radius = 0.0f;
+    for (int32_t child = node.children; child < node.children + fanout; ++child) {
+        node.total_mass += nodes[child].total_mass;
+        weighted += nodes[child].total_mass * nodes[child].center_mass;
+        if (nodes[child].max_radius > node.max_radius) node.max_radius = nodes[child].max_radius;
+    }
+    if (node.total_mass > 0.0f) node.center_mass = weighted / node.total_mass;
+    sumQuadrupole(index);
+}
+
+template <int Dim>
+void BasicTree<Dim>::sumLeaf(int32_t index)
+{
+    Node& node = nodes[index];
+    node.center_mass = {};
+    node.total_mass = 0.0f;
+    node.max_radius = 0.0f;
+    // same running sum as insert so a single rock sits exactly at its position
+    for (Element* rock : elements(index)) {
+        node.total_mass += rock->mass;
+        node.center_mass += (rock->mass / node.total_mass) * (rock->pos - node.center_mass);
+        if (rock->radius > node.max_radius) node.max_radius = rock->radius;
+    }
+    node.quad = {};
+    if (node.count < 2) return;
+    for (Element* rock : elements(index)) {
+        addQuadrupole<Dim>(node.quad, rock->mass, rock->pos - node.center_mass);
+    }
+}
+
+template <int Dim>
+void BasicTree<Dim>::computeQuadrupoles()
+{
+    // children always come after their parent in nodes
+    for (int32_t i = static_cast<int32_t>(nodes.size()) - 1; i >= 0; --i) {
+        if (nodes[i].hasChildren()) {
+            sumQuadrupole(i);
+        } else if (nodes[i].count > 1) {
+            sumLeaf(i);
+        }
+    }
+}
+
+template <int Dim>
+void BasicTree<Dim>::refitNode(int32_t index, int depth)
+{
+    Node& node = nodes[index];
+    if (depth < 6 / Dim) {
+        // top few levels fan out to tasks, 64 subtrees in all
+        tbb::task_group group;
+        for (int32_t child = node.children; child < node.children + fanout; ++child) {
+            if (nodes[child].hasChildren()) {
+                group.run([this, child, depth] { refitNode(child, depth + 1); });
+            } else {
+                sumLeaf(child);
+            }
+        }
+        group.wait();
+    } else {
+        for (int32_t child = node.children; child < node.children + fanout; ++child) {
+            if (nodes[child].hasChildren()) {
+                refitNode(child, depth + 1);
+            } else {
+                sumLeaf(child);
+            }
+        }
+    }
+
+    // once rocks have moved out there may be leafSize or fewer left below, make this
+    // a leaf again so the tree stays the same as a fresh build (the children become unused)
+    bool leaves = true;
+    int32_t count = 0;
+    int32_t first = -1;
+    for (int32_t child = node.children; child < node.children + fanout; ++child) {
+        leaves = leaves && !nodes[child].hasChildren();
+        count += nodes[child].count;
+        if (first < 0) first = nodes[child].first;
+    }
+    if (!leaves || count > leafSize) {
+        sumChildren(index);
+        return;
+    }
+    // gather the rocks in the slots of the first child that had any
+    int32_t size = 0;
+    for (int32_t child = node.children; child < node.children + fanout; ++child) {
+        Node& c = nodes[child];
+        for (int32_t k = 0; k < c.count; ++k) items[first + size++] = items[c.first + k];
+        c.first = -1;
+        c.count = 0;
+    }
+    node.children = -1;
+    node.first = first;
+    node.count = count;
+    sumLeaf(index);
+}
+
+template <int Dim>
+int BasicTree<Dim>::depth(int32_t node) const
+{
+    if (!nodes[node].hasChildren()) return 0;
+    int deepest = 0;
+    for (int32_t child = nodes[node].children; child < nodes[node].children + fanout; ++child) {
+        deepest = std::max(deepest, depth(child));
+    }
+    return deepest + 1;
+}
+
+template <int Dim>
+void BasicTree<Dim>::refit()
+{
+    if (nodes[0].hasChildren()) {
+        refitNode(0, 0);
+    } else {
+        sumLeaf(0);
+    }
+}
+
+template <int Dim>
+bool BasicTree<Dim>::update(std::span<Element> rocks)
+{
+    if (rocks.data() != builtRocks || rocks.size() != builtRockCount) return false;
+    if (nodes.size() > rebuildGrowth * builtNodes) return false;
+
+    // find the leaves holding a rock that is no longer inside them
+    for (auto& leaves : movedLeaves) leaves.clear();
+    tbb::parallel_for(tbb::blocked_range<int32_t>(0, static_cast<int32_t>(nodes.size()), 4096),
+                      [this](const auto& range) {
+        std::vector<int32_t>& leaves = movedLeaves.local();
+        for (int32_t i = range.begin(); i != range.end(); ++i) {
+            for (Element* rock : elements(i)) {
+                if (!contains(i, rock->pos)) {
+                    leaves.push_back(i);
+                    break;
+                }
+            }
+        }
+    });
+    moveList.clear();
+    for (auto& leaves : movedLeaves) moveList.insert(moveList.end(), leaves.begin(), leaves.end());
+    size_t moving = 0;
+    size_t left_root = 0;
+    for (int32_t leaf : moveList) {
+        for (Element* rock : elements(leaf)) {
+            if (contains(leaf, rock->pos)) continue;
+            ++moving;
+            left_root += !contains(0, rock->pos);
+        }
+    }
+    if (moving > rebuildMoved * elementCount) return false;
+
+    // rocks outside the root are not in the tree, if one came back in start over
+    size_t inside = tbb::parallel_reduce(
+        tbb::blocked_range<size_t>(0, rocks.size()), size_t(0),
+        [&](const auto& range, size_t count) {
+            for (size_t i = range.begin(); i != range.end(); ++i) count += contains(0, rocks[i].pos);
+            return count;
+        },
+        std::plus<size_t>());
+    if (inside != elementCount - left_root) return false;
+
+    // take every moved rock out before inserting any, inserts can move other rocks,
+    // sorted so the same rocks move in the same order every run
+    std::sort(moveList.begin(), moveList.end());
+    moveRocks.clear();
+    for (int32_t leaf : moveList) {
+        Node& node = nodes[leaf];
+        int32_t kept = 0;
+        for (int32_t k = 0; k < node.count; ++k) {
+            Element* rock = items[node.first + k];
+            if (contains(leaf, rock->pos)) {
+                items[node.first + kept++] = rock;
+            } else {
+                moveRocks.push_back(rock);
+            }
+        }
+        node.count = kept;
+    }
+    elementCount -= moveRocks.size();
+    for (Element* rock : moveRocks) insert(rock);
+    moved = moveRocks.size();
+    refit();
+    return true;
+}
+
+template <int Dim>
+void BasicTree<Dim>::buildPar(std::span<Element> rocks)
+{
+    builtRocks = rocks.data();
+    builtRockCount = rocks.size();
+    moved = 0;
+    ++builds;
+    if (rocks.size() <= parallelBuildGrain) {
+        for (auto& rock : rocks) insert(&rock);
+        computeQuadrupoles();
+        builtNodes = nodes.size();
+        return;
+    }
+
+    // split the top of the tree until every region holds few enough rocks,
+    // partitions keep rock order so each region sees rocks in insert order
+    // A level moves its rocks from src into the same range of dst, each split region
+    // into its children's ranges, like radixSort: orthant counts per block, a prefix
+    // sum over blocks, then every block scatters at once. So each level (and the cut
+    // to the root before them) uses every core however few regions it has
+    struct Region {
+        int32_t node;
+        std::span<Element*> items;
+    };
+    struct Block {
+        size_t split;
+        size_t begin; // in the split region's items
+        size_t end;
+        std::array<uint32_t, fanout> count; // turned into where each orthant goes in dst
+    };
+    struct Split {
+        size_t region; // in level
+        size_t next; // first child in next
+        size_t block; // first block
+    };
+    splitBuffers[0].resize(rocks.size());
+    splitBuffers[1].resize(rocks.size());
+    Element** src = splitBuffers[0].data();
+    Element** dst = splitBuffers[1].data();
+
+    std::vector<uint32_t> inside((rocks.size() + splitBlock - 1) / splitBlock);
+    tbb::parallel_for(size_t(0), inside.size(), [&](size_t b) {
+        uint32_t count = 0;
+        for (size_t i = b * splitBlock, end = std::min(rocks.size(), i + splitBlock); i != end; ++i) {
+            count += contains(0, rocks[i].pos);
+        }
+        inside[b] = count;
+    });
+    elementCount = 0;
+    for (uint32_t& count : inside) {
+        uint32_t c = count;
+        count = static_cast<uint32_t>(elementCount);
+        elementCount += c;
+    }
+    tbb::parallel_for(size_t(0), inside.size(), [&](size_t b) {
+        uint32_t next = inside[b];
+        for (size_t i = b * splitBlock, end = std::min(rocks.size(), i + splitBlock); i != end; ++i) {
+            if (contains(0, rocks[i].pos)) src[next++] = &rocks[i];
+        }
+    });
+
+    std::vector<Region> level(1, Region {.node = 0, .items = {src, elementCount}});
+    std::vector<Region> regions;
+    std::vector<int32_t> splitNodes;
+    std::vector<Split> splits;
+    std::vector<Block> blocks;
+    while (!level.empty()) {
+        std::vector<Region> next;
+        splits.clear();
+        blocks.clear();
+        for (size_t i = 0; i < level.size(); ++i) {
+            if (level[i].items.size() <= parallelBuildGrain || nodes[level[i].node].width <= minWidth) {
+                regions.push_back(level[i]);
+                continue;
+            }
+            createChildren(level[i].node);
+            splitNodes.push_back(level[i].node);
+            splits.push_back(Split {.region = i, .next = next.size(), .block = blocks.size()});
+            for (int32_t q = 0; q < fanout; ++q) {
+                next.push_back(Region {.node = nodes[level[i].node].children + q});
+            }
+            for (size_t b = 0; b < level[i].items.size(); b += splitBlock) {
+                blocks.push_back(Block {.split = splits.size() - 1, .begin = b,
+                                        .end = std::min(level[i].items.size(), b + splitBlock)});
+            }
+        }
+        tbb::parallel_for(size_t(0), blocks.size(), [&](size_t b) {
+            Block& block = blocks[b];
+            const Region& region = level[splits[block.split].region];
+            block.count.fill(0);
+            for (size_t k = block.begin; k != block.end; ++k) {
+                ++block.count[orthant(region.node, region.items[k]->pos)];
+            }
+        });
+        // orthant major, block minor, so rocks keep their order within each child
+        for (size_t s = 0; s < splits.size(); ++s) {
+            const Region& region = level[splits[s].region];
+            size_t lastBlock = (s + 1 < splits.size()) ? splits[s + 1].block : blocks.size();
+            Element** out = dst + (region.items.data() - src);
+            uint32_t offset = 0;
+            for (int32_t q = 0; q < fanout; ++q) {
+                uint32_t start = offset;
+                for (size_t b = splits[s].block; b != lastBlock; ++b) {
+                    uint32_t c = blocks[b].count[q];
+                    blocks[b].count[q] = offset;
+                    offset += c;
+                }
+                next[splits[s].next + q].items = {out + start, offset - start};
+            }
+        }
+        tbb::parallel_for(size_t(0), blocks.size(), [&](size_t b) {
+            Block& block = blocks[b];
+            const Region& region = level[splits[block.split].region];
+            Element** out = dst + (region.items.data() - src);
+            for (size_t k = block.begin; k != block.end; ++k) {
+                Element* rock = region.items[k];
+                out[block.count[orthant(region.node, rock->pos)]++] = rock;
+            }
+        });
+        // regions already done keep pointing into src, their range isn't written again
+        level = std::move(next);
+        std::swap(src, dst);
+    }
+
+    // build each region on its own
+    regionTrees.resize(regions.size());
+    tbb::parallel_for(size_t(0), regions.size(), [&](size_t r) {
+        profile::Scope zone {"tree region"};
+        int32_t node = regions[r].node;
+        BasicTree& region = regionTrees[r];
+        region.leafSize = leafSize;
+        region.reset(bounds[node].corner, nodes[node].width);
+        region.minWidth = minWidth;
+        for (Element* rock : regions[r].items) region.insert(rock);
+        region.computeQuadrupoles();
+    });
+
+    // splice regions in, the region root takes the place of the split node's child
+    std::vector<int32_t> offsets(regions.size());
+    std::vector<int32_t> itemOffsets(regions.size());
+    size_t size = nodes.size();
+    size_t itemSize = items.size();
+    for (size_t r = 0; r < regions.size(); ++r) {
+        offsets[r] = static_cast<int32_t>(size) - 1;
+        itemOffsets[r] = static_cast<int32_t>(itemSize);
+        size += regionTrees[r].nodes.size() - 1;
+        itemSize += regionTrees[r].items.size();
+    }
+    nodes.resize(size);
+    bounds.resize(size);
+    items.resize(itemSize);
+    tbb::parallel_for(size_t(0), regions.size(), [&](size_t r) {
+        const BasicTree& region = regionTrees[r];
+        int32_t offset = offsets[r];
+        int32_t itemOffset = itemOffsets[r];
+        auto remap = [offset, itemOffset](Node node) {
+            if (node.hasChildren()) node.children += offset;
+            if (node.first >= 0) node.first += itemOffset;
+            return node;
+        };
+        nodes[regions[r].node] = remap(region.nodes[0]);
+        for (size_t i = 1; i < region.nodes.size(); ++i) {
+            nodes[offset + i] = remap(region.nodes[i]);
+            bounds[offset + i] = region.bounds[i];
+        }
+        std::copy(region.items.begin(), region.items.end(), items.begin() + itemOffset);
+    });
+
+    // children were split after their parents, so go in reverse to sum bottom up
+    for (auto it = splitNodes.rbegin(); it != splitNodes.rend(); ++it) {
+        sumChildren(*it);
+    }
+    builtNodes = nodes.size();
+}
+
+template struct BasicTree<2>;
+template struct BasicTree<3>;
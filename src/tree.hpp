@@ -1,80 +1,199 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <span>
 #include <vector>
 #include <SFML/Graphics.hpp>
+#include <oneapi/tbb/enumerable_thread_specific.h>
 #include "rock.hpp"
 
-/// Tree to hold rocks
-/// Can be empty, have 1 rock element, or have children
-struct TreeNode {
-    float left {0.0f}; // inclusive
-    float right {0.0f}; // exclusive
-    float bottom {0.0f}; // inclusive
-    float top {0.0f}; // exclusive
-    sf::Vector2f center {0.0f, 0.0f};
-    sf::Vector2f center_mass;
+/// Node of a BasicTree, holds only what traversals read so nodes pack tightly
+/// Either a leaf with up to leafSize rocks or has 2^Dim children
+template <int Dim>
+struct BasicTreeNode {
+    static constexpr int quadSize {Dim * (Dim + 1) / 2};
+
+    Vec<Dim> center_mass {};
     float total_mass {0.0f};
-    float max_radius {0.0f}; // largest radius of element / children
-    Rock* element {nullptr};
-    std::vector<TreeNode> children;
+    float width {0.0f};
+    float max_radius {0.0f}; // largest radius of elements / children
+    // quadrupole moment about center_mass, sum m(3 x x^T - |x|^2 I), upper triangle
+    // by rows: xx, xy, yy in 2d and xx, xy, xz, yy, yz, zz in 3d
+    std::array<float, quadSize> quad {};
+    int32_t children {-1}; // index of first of 2^Dim consecutive children, -1 if none
+    int32_t first {-1}; // leaf's slots in items, -1 until it gets a rock
+    int32_t count {0}; // rocks in the leaf
+
+    bool hasChildren() const { return children >= 0; }
+};
+
+/// Lower corner of a node (left, bottom and in 3d near), only needed for inserts
+/// and bounds tests. Inclusive, the upper corner at corner + width is exclusive
+template <int Dim>
+struct NodeBounds {
+    Vec<Dim> corner {};
+};
+
+/// Quadtree (Dim 2) or octree (Dim 3) to hold rocks, stored flat in one array that
+/// is reused between builds. nodes[0] is the root, children are found by index.
+/// A leaf splits once it would hold more than leafSize rocks, so a node has children
+/// only if more are below it
+/// Rocks at one point can't be split apart, their leaf grows past leafSize instead
+/// Instantiated in tree.cpp for 2 and 3 dimensions only
+template <int Dim>
+struct BasicTree {
+    using Node = BasicTreeNode<Dim>;
+    using Element = Body<Dim>;
+    using Point = Vec<Dim>;
+
+    static constexpr int fanout {1 << Dim}; // children of a node
+
+    std::vector<Node> nodes;
+    std::vector<NodeBounds<Dim>> bounds; // cold data, same index as nodes
+    std::vector<Element*> items; // leaf contents, leafSize slots per leaf (more if it grew)
+    int32_t leafSize {16}; // only change right before a reset
+
+    BasicTree() { reset(0.0f); }
+
+    explicit BasicTree(float extent) { reset(extent); }
 
-    explicit TreeNode(float extent) : TreeNode(-extent, extent, -extent, extent) {}
+    explicit BasicTree(float left, float bottom, float width) requires (Dim == 2) { reset({left, bottom}, width); }
 
-    explicit TreeNode(float left, float right, float bottom, float top)
-        : left {left}, right {right}, bottom {bottom}, top {top}, 
-        center {left + (right - left) / 2.0f, bottom + (right - left) / 2.0f} {}
+    /// Empties the tree but keeps its storage for the next build
+    void reset(float extent) { reset(splat<Dim>(-extent), 2.0f * extent); }
 
-    inline float nodeWidth() const { return right - left;}
+    void reset(float left, float bottom, float width) requires (Dim == 2) { reset({left, bottom}, width); }
 
-    inline bool contains(sf::Vector2f pos) const {
-        return (pos.x >= left && pos.x < right && pos.y >= bottom && pos.y < top);
+    void reset(Point corner, float width);
+
+    const Node& root() const { return nodes[0]; }
+
+    /// Rocks in the tree, ones outside the root when inserted are left out
+    size_t size() const { return elementCount; }
+
+    /// Levels below node, 0 for a leaf
+    int depth(int32_t node = 0) const;
+
+    /// Lower and upper bound of node along axis k
+    float lower(int32_t node, int k) const { return axis(bounds[node].corner, k); }
+    float upper(int32_t node, int k) const { return axis(bounds[node].corner, k) + nodes[node].width; }
+
+    float left(int32_t node) const { return lower(node, 0); }
+    float right(int32_t node) const { return upper(node, 0); }
+    float bottom(int32_t node) const { return lower(node, 1); }
+    float top(int32_t node) const { return upper(node, 1); }
+
+    bool contains(int32_t node, Point pos) const {
+        bool inside = true;
+        for (int k = 0; k < Dim; ++k) {
+            inside = inside && axis(pos, k) >= lower(node, k) && axis(pos, k) < upper(node, k);
+        }
+        return inside;
     }
 
-    bool hasChildren() const { return children.size() > 0; }
+    /// Rocks in a leaf, empty for nodes with children
+    std::span<Element* const> elements(int32_t node) const {
+        if (nodes[node].count == 0) return {};
+        return {items.data() + nodes[node].first, static_cast<size_t>(nodes[node].count)};
+    }
 
-    void createChildren() {
-        float x_mid = left + (right-left) / 2.0f;
-        float y_mid = bottom + (top-bottom) / 2.0f;
-        children.reserve(4);
-        children.push_back(TreeNode(x_mid, right, y_mid, top)); // upper right = 0
-        children.push_back(TreeNode(x_mid, right, bottom, y_mid)); // lower right = 1
-        children.push_back(TreeNode(left, x_mid, bottom, y_mid)); // lower left = 2
-        children.push_back(TreeNode(left, x_mid, y_mid, top)); // upper left = 3
+    /// Index of child of node that pos falls in, -1 if no children or not in node
+    int32_t getChild(int32_t node, Point pos) const {
+        if (!nodes[node].hasChildren() || !contains(node, pos)) return -1;
+        return nodes[node].children + orthant(node, pos);
     }
 
-    TreeNode* getChild(sf::Vector2f pos) {
-        for (auto& child : children) {
-            if (child.contains(pos)) return &child;
-        }
-        return nullptr;
+    /// Adds rock, rocks outside of the root are ignored
+    /// Quadrupoles are not kept up to date, call computeQuadrupoles after inserting
+    void insert(Element* rock);
+
+    /// Sums leaf quadrupoles from their rocks, then child quadrupoles (shifted to
+    /// the parent center of mass) bottom up
+    void computeQuadrupoles();
+
+    /// Recomputes all aggregates from the current element positions without moving
+    /// rocks between nodes, cheaper than a rebuild when rocks only moved a little
+    /// Rocks may end up outside their node's bounds until the next build
+    /// Nodes left holding leafSize rocks or fewer are collapsed back into a leaf
+    void refit();
+
+    /// Reinserts only the rocks that left their leaf, then refits, instead of a full build
+    /// rocks must be the same ones given to the last buildPar. Returns false and leaves
+    /// the tree alone when a full build is needed instead: the rocks changed, one came
+    /// into the root, too many moved, or nodes has grown too much since the last build
+    bool update(std::span<Element> rocks);
+
+    /// Adds all rocks using every core, same tree as inserting them in order
+    /// The top of the tree is split until regions are small enough for one thread,
+    /// regions are built concurrently, then spliced in and the top levels summed up
+    /// Also computes quadrupoles
+    void buildPar(std::span<Element> rocks);
+
+    static constexpr size_t parallelBuildGrain {2048}; // max rocks in a region built by one thread
+    static constexpr size_t splitBlock {16384}; // rocks counted and scattered by one task in buildPar
+    static constexpr float rebuildMoved {0.2f}; // rebuild if more than this fraction of rocks moved
+    static constexpr float rebuildGrowth {1.5f}; // rebuild if nodes grew past this times the built size
+
+    size_t builds {0}; // full builds so far
+    size_t moved {0}; // rocks reinserted by the last update
+
+private:
+    /// Slots a leaf holding count rocks has, leafSize doubled until count fits
+    int32_t capacity(int32_t count) const {
+        int32_t slots = leafSize;
+        while (slots < count) slots *= 2;
+        return slots;
     }
 
-    void insert(Rock* rock) {
-        if (hasChildren()) {
-            if (TreeNode* target = getChild(rock->pos); target) {
-                target->insert(rock);
-                total_mass += rock->mass;
-                center_mass += (rock->mass / total_mass) * (rock->pos - center_mass);
-                if (rock->radius > max_radius) max_radius = rock->radius;
-            } 
-        } else if (!element) {
-            element = rock;
-            center_mass = rock->pos;
-            total_mass = rock->mass;
-            max_radius = rock->radius;
-        } else {
-            if (rock->pos == element->pos) {
-                std::cout<< "Warning: trying to add rock to tree at same point\n" <<
-                    "Pos: " << rock->pos.x << "," << rock->pos.y << "\n";
-                abort();
-            }
-            createChildren();
-            center_mass = {0.0f, 0.0f};
-            total_mass = 0.0f;
-            max_radius = 0.0f;
-            insert(element);
-            element = nullptr;
-            insert(rock);
+    /// Bit k is set for the upper half along axis k, so in 2d lower left = 0,
+    /// lower right = 1, upper left = 2, upper right = 3 (children in Morton order)
+    int32_t orthant(int32_t node, Point pos) const {
+        float half = nodes[node].width / 2.0f;
+        int32_t child = 0;
+        for (int k = 0; k < Dim; ++k) {
+            child |= int32_t(axis(pos, k) >= lower(node, k) + half) << k;
         }
+        return child;
     }
+
+    void createChildren(int32_t node);
+
+    /// Adds rock to a leaf, updating its totals. A full leaf moves to a block twice
+    /// the size, which only happens when insert won't split it
+    void addToLeaf(int32_t node, Element* rock);
+
+    /// Gives a full leaf children and moves its rocks down to them
+    void split(int32_t node);
+
+    void sumQuadrupole(int32_t node);
+
+    /// Mass, center of mass, max_radius and quadrupole from the children
+    void sumChildren(int32_t node);
+
+    /// Mass, center of mass, max_radius and quadrupole from the leaf's rocks
+    void sumLeaf(int32_t node);
+
+    /// Refits the children of node then node, collapsing it if needed
+    void refitNode(int32_t node, int depth);
+
+    std::vector<BasicTree> regionTrees; // buildPar scratch, kept to reuse storage
+    std::array<std::vector<Element*>, 2> splitBuffers; // buildPar scratch, levels alternate
+    float minWidth {0.0f}; // nodes this small aren't split, the leaf grows instead
+
+    // what the last buildPar was given, update only works on the same rocks
+    const Element* builtRocks {nullptr};
+    size_t builtRockCount {0};
+    size_t builtNodes {0};
+    size_t elementCount {0}; // rocks in the tree
+    tbb::enumerable_thread_specific<std::vector<int32_t>> movedLeaves; // update scratch
+    std::vector<int32_t> moveList;
+    std::vector<Element*> moveRocks;
 };
+
+extern template struct BasicTree<2>;
+extern template struct BasicTree<3>;
+
+using TreeNode = BasicTreeNode<2>;
+using Tree = BasicTree<2>;
+using Octree = BasicTree<3>;
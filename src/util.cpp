@@ -5,20 +5,27 @@
 
 namespace util {
 
+namespace {
+
+std::default_random_engine& engine()
+{
+    // seeding is the slow part, so only once per thread
+    thread_local std::default_random_engine gen(std::random_device {}());
+    return gen;
+}
+
+}  // namespace
+
 float f_rand(float min, float max)
 {
-    std::random_device r;
-    std::default_random_engine gen(r());
     std::uniform_real_distribution<> dis(min, max);
-    return dis(gen);
+    return dis(engine());
 }
 
 int i_rand(int min, int max)
 {
-    std::random_device r;
-    std::default_random_engine gen(r());
     std::uniform_int_distribution<> dis(min, max);
-    return dis(gen);
+    return dis(engine());
 }
 
 Timer::Timer() { m_StartTimepoint = std::chrono::high_resolution_clock::now(); }
@@ -40,4 +47,21 @@ void Timer::Stop()
     std::cout << duration.count() << " ns (" << us << " us) (" << ms << " ms)\n";
 }
 
+Stopwatch::Stopwatch() { m_StartTimepoint = std::chrono::high_resolution_clock::now(); }
+
+double Stopwatch::elapsed() const
+{
+    std::chrono::duration<double, std::milli> duration =
+        std::chrono::high_resolution_clock::now() - m_StartTimepoint;
+    return duration.count();
+}
+
+double Stopwatch::restart()
+{
+    auto now = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> duration = now - m_StartTimepoint;
+    m_StartTimepoint = now;
+    return duration.count();
+}
+
 }  // namespace util
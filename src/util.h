@@ -1,14 +1,53 @@
+#pragma once
+
 #include <random>
 #include <chrono>
+#include <cmath>
+#include <cstdint>
 #include <iostream>
 // #include <oneapi/tbb/parallel_for_each.h>
 
 namespace util {
 
+// Unseeded, uses one engine per thread
 float f_rand(float min, float max);
 
 int i_rand(int min, int max);
 
+// Counter based random numbers, each value is a hash of (seed, stream, counter)
+// so stream i gives the same numbers no matter which thread draws them or when.
+// Use one stream per item (ex: rock index) to generate in parallel reproducibly
+class Random {
+public:
+    Random(uint64_t seed, uint64_t stream) : m_Key {mix(seed ^ mix(stream + 0x632be59bd9b4e019ull))} {}
+
+    uint64_t next() { return mix(m_Key + 0x9e3779b97f4a7c15ull * ++m_Counter); }
+
+    // [0, 1)
+    float uniform() { return (next() >> 40) * 0x1.0p-24f; }
+
+    float uniform(float min, float max) { return min + (max - min) * uniform(); }
+
+    // Standard normal (Box-Muller)
+    float normal()
+    {
+        float u = 1.0f - uniform(); // (0, 1]
+        return std::sqrt(-2.0f * std::log(u)) * std::cos(6.2831853f * uniform());
+    }
+
+private:
+    // splitmix64 finalizer
+    static uint64_t mix(uint64_t z)
+    {
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    uint64_t m_Key;
+    uint64_t m_Counter {0};
+};
+
 // Performance timer that measures from object creation to destruction
 // and outputs duration in ns and us to stdout
 class Timer {
@@ -20,6 +59,16 @@ private:
     std::chrono::time_point<std::chrono::high_resolution_clock> m_StartTimepoint;
 };
 
+// Silent timer for collecting measurements, returns elapsed time in ms
+class Stopwatch {
+public:
+    Stopwatch();
+    double elapsed() const;
+    double restart();
+private:
+    std::chrono::time_point<std::chrono::high_resolution_clock> m_StartTimepoint;
+};
+
 /// calls f for all distinct pairs from collection
 /// ex: [1,2,3] => (1,2) (1,3) (2,3)
 template <class Iterable, class BinaryOp>
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <type_traits>
+#include "SFML/System/Vector2.hpp"
+#include "SFML/System/Vector3.hpp"
+
+//
+// Vectors - positions in 2 or 3 dimensions, picked at compile time
+//
+
+/// sf::Vector2f for the plane, sf::Vector3f for space
+template <int Dim>
+using Vec = std::conditional_t<Dim == 2, sf::Vector2f, sf::Vector3f>;
+
+/// Component k of v, k is a constant in the unrolled axis loops so this folds away
+inline float& axis(sf::Vector2f& v, int k) { return k == 0 ? v.x : v.y; }
+inline float axis(const sf::Vector2f& v, int k) { return k == 0 ? v.x : v.y; }
+inline float& axis(sf::Vector3f& v, int k) { return k == 0 ? v.x : (k == 1 ? v.y : v.z); }
+inline float axis(const sf::Vector3f& v, int k) { return k == 0 ? v.x : (k == 1 ? v.y : v.z); }
+
+inline float lengthSquared(sf::Vector2f v) { return v.x * v.x + v.y * v.y; }
+inline float lengthSquared(sf::Vector3f v) { return v.x * v.x + v.y * v.y + v.z * v.z; }
+
+inline float dot(sf::Vector2f a, sf::Vector2f b) { return a.x * b.x + a.y * b.y; }
+inline float dot(sf::Vector3f a, sf::Vector3f b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+
+/// Vector with every component set to s
+template <int Dim>
+Vec<Dim> splat(float s)
+{
+    if constexpr (Dim == 2) {
+        return {s, s};
+    } else {
+        return {s, s, s};
+    }
+}
+
+/// Index of entry (i, j) of a symmetric Dim x Dim matrix stored as its upper
+/// triangle by rows, e.g. xx, xy, yy in 2d
+template <int Dim>
+constexpr int symmetricIndex(int i, int j)
+{
+    if (i > j) return symmetricIndex<Dim>(j, i);
+    return i * Dim - i * (i - 1) / 2 + (j - i);
+}
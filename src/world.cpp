@@ -1,20 +1,26 @@
 #include <SFML/Graphics.hpp>
 #include <SFML/System.hpp>
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cassert>
+#include <cmath>
+#include <limits>
+#include <oneapi/tbb/enumerable_thread_specific.h>
+#include <oneapi/tbb/parallel_for.h>
 #include <oneapi/tbb/parallel_for_each.h>
+#include <oneapi/tbb/parallel_reduce.h>
+#include <oneapi/tbb/parallel_scan.h>
+#include <oneapi/tbb/parallel_sort.h>
+#include "generate.hpp"
+#include "kernel.hpp"
+#include "order.hpp"
+#include "profile.hpp"
 #include "util.h"
 #include "world.hpp"
 
 namespace {
  
-sf::Color colorFromVelocity(const sf::Vector2f& vel, const float velExtent)
-{
-    float vel_percent = ((vel.x * vel.x + vel.y * vel.y)
-                         / (velExtent * velExtent));
-    int red_level = std::clamp((int)(vel_percent * 255), 0, 255);
-    return sf::Color(red_level, 0, 255 - red_level);
-}
-
 // See for another approach (but this new one works really good!)
 // https://gamedev.stackexchange.com/questions/15708/how-can-i-implement-gravity
 // acceleration = force(time, position) / mass;
@@ -23,54 +29,777 @@ sf::Color colorFromVelocity(const sf::Vector2f& vel, const float velExtent)
 // newAcceleration = force(time, position) / mass;
 // velocity += timestep * (acceleration + newAcceleration) / 2;
 
-sf::Vector2f gravityAccelTree(const World& world, const TreeNode& node, const Rock& a)
+/// What a gravity walk does, fixed at compile time so every combination of settings
+/// gets its own walk and kernels without branches on them in the inner loops
+template <int Dim, Expansion Far, bool SkipOverlap, bool Collide, bool Predict = false>
+struct WalkPolicy {
+    static constexpr int dim {Dim};
+    static constexpr bool quadrupole {Far == Expansion::Quadrupole};
+    static constexpr bool skipOverlap {SkipOverlap}; // ignoreShortDistGrav for near rocks
+    static constexpr bool collide {Collide}; // fused walk, collects collision pairs too
+    static constexpr bool predict {Predict}; // block steps, positions read at blockSteps.time
+    static_assert(Dim == 2 || !(Collide || Predict), "collisions and block steps are 2d only");
+    static_assert(!(Collide && Predict));
+};
+
+/// Calls f with the WalkPolicy for world's settings, the one branch on them per system
+template <int Dim, bool Collide, bool Predict = false, class F>
+void withWalkPolicy(const World& world, F&& f)
+{
+    auto overlap = [&world, &f]<Expansion Far>() {
+        if (world.ignoreShortDistGrav) {
+            f(WalkPolicy<Dim, Far, true, Collide, Predict> {});
+        } else {
+            f(WalkPolicy<Dim, Far, false, Collide, Predict> {});
+        }
+    };
+    if (world.expansion == Expansion::Quadrupole) {
+        overlap.template operator()<Expansion::Quadrupole>();
+    } else {
+        overlap.template operator()<Expansion::Monopole>();
+    }
+}
+
+/// The tree gravity walks in Dim dimensions, the octree of world.volume for 3
+template <int Dim>
+const BasicTree<Dim>& walkTree(const World& world)
+{
+    if constexpr (Dim == 2) {
+        return world.rootTree;
+    } else {
+        return world.volume.tree;
+    }
+}
+
+/// Rocks of Dim dimensions with the tree over them and their collisions, the plane's
+/// or world.volume's for 3
+template <int Dim>
+struct BodySet {
+    std::vector<Body<Dim>>& rocks;
+    BasicTree<Dim>& tree;
+    BasicCollisions<Dim>& collisions;
+};
+
+template <int Dim>
+BodySet<Dim> bodySet(World& world)
+{
+    if constexpr (Dim == 2) {
+        return {world.rocks, world.rootTree, world.collisions};
+    } else {
+        return {world.volume.rocks, world.volume.tree, world.volume.collisions};
+    }
+}
+
+/// Sources for one rock, far nodes use the aggregate mass and skip the radius check
+template <int Dim>
+struct GravitySources {
+    BasicSourceBatch<Dim> far;
+    BasicQuadrupoleBatch<Dim> farQuad;
+    BasicSourceBatch<Dim> near;
+    GravityStats stats;  // running totals for this thread
+
+    void clear() {
+        far.clear();
+        farQuad.clear();
+        near.clear();
+    }
+};
+
+template <int Dim>
+tbb::enumerable_thread_specific<GravitySources<Dim>> gravitySources;
+
+/// Where a rock is blockSteps.time into a block step update
+sf::Vector2f predicted(const World& world, const Rock& rock)
 {
-    sf::Vector2f pos_vec = node.center_mass - a.pos;
-    float dist2 = pos_vec.x * pos_vec.x + pos_vec.y * pos_vec.y;
-    if (dist2 < 0.00001) {return {0.0f, 0.0f};}  // if on top of COM (or is same as a), do nothing
-    float dist = sqrt(dist2);
-    if ((node.nodeWidth() / dist) < world.theta) {
-        // use aggregrate mass
-        float grav_a = world.gravity * node.total_mass / dist2;
-        return {(pos_vec.x * grav_a) / dist, (pos_vec.y * grav_a) / dist};
+    return rock.pos + rock.vel * world.blockSteps.time;
+}
+
+/// Where a node's center of mass is blockSteps.time into a block step update
+sf::Vector2f predictedCenter(const World& world, int32_t index)
+{
+    return world.rootTree.nodes[index].center_mass + world.blockSteps.nodeVels[index] * world.blockSteps.time;
+}
+
+/// Node totals go to the far batch (with the quadrupole if enabled), rocks to near
+/// Kept out of line, with the pushes inlined the recursive walk is ~10% slower
+template <class P>
+[[gnu::noinline]] void addFarSource(const BasicTreeNode<P::dim>& node, Vec<P::dim> center,
+                                    GravitySources<P::dim>& sources)
+{
+    if constexpr (P::quadrupole) {
+        if (node.hasChildren()) {
+            sources.farQuad.add(center, node.total_mass, node.quad);
+            return;
+        }
+    }
+    sources.far.add(center, node.total_mass, 0.0f);
+}
+
+template <class P>
+void addNearSources(const World& world, int32_t index, GravitySources<P::dim>& sources)
+{
+    for (const Body<P::dim>* rock : walkTree<P::dim>(world).elements(index)) {
+        if constexpr (P::predict) {
+            sources.near.add(predicted(world, *rock), rock->mass, rock->radius);
+        } else {
+            sources.near.add(rock->pos, rock->mass, rock->radius);
+        }
+    }
+}
+
+/// Walks the tree collecting the nodes and rocks that act on a
+template <class P>
+void gatherGravitySources(const World& world, int32_t index, const Body<P::dim>& a, float theta,
+                          GravitySources<P::dim>& sources)
+{
+    const BasicTree<P::dim>& tree = walkTree<P::dim>(world);
+    const auto& node = tree.nodes[index];
+    ++sources.stats.nodeVisits;
+    if (node.total_mass == 0.0f) return;
+    Vec<P::dim> center = node.center_mass;
+    if constexpr (P::predict) center = predictedCenter(world, index);
+    float dist2 = lengthSquared(center - a.pos);
+    // a node centered on a is opened, the kernel skips a itself
+    if (dist2 >= 0.00001f && (node.width * node.width) < (theta * theta * dist2)) {
+        // use aggregrate mass, same as width / dist < theta
+        addFarSource<P>(node, center, sources);
     } else if (node.hasChildren()) {
-        // use children
-        sf::Vector2f acc_a {0.0,0.0};
-        for (const auto& child : node.children) {
-            acc_a += gravityAccelTree(world, child, a);
-        }
-        return acc_a;
-    } else if (!node.element) {
-        return {0.0f, 0.0f};
+        for (int32_t child = node.children; child < node.children + tree.fanout; ++child) {
+            gatherGravitySources<P>(world, child, a, theta, sources);
+        }
     } else {
-        // single element @ node
-        if (world.ignoreShortDistGrav && dist < (a.radius + node.element->radius)) {
-            return {0.0f, 0.0f};
+        addNearSources<P>(world, index, sources);
+    }
+}
+
+/// Rock pairs of two leaves (or within one) that collide, for the fused walk
+/// Rocks of first out of reach of second's box are skipped before testing each pair
+void findLeafPairCollisions(const Tree& tree, Collisions& collisions, int32_t first, int32_t second)
+{
+    std::vector<CollidingPair>& found = collisions.found.local();
+    auto test = [&found, sweep = collisions.sweep](Rock* a, Rock* b) {
+        auto [lower, upper] = std::minmax(a, b);
+        if (sweep > 0.0f) {
+            auto time = timeOfImpact(*lower, *upper, sweep);
+            if (time) found.push_back({*time, lower, upper});
+        } else if (isColliding(*lower, *upper)) {
+            found.push_back({0.0f, lower, upper});
+        }
+    };
+    std::span<Rock* const> rocks = tree.elements(first);
+    if (first == second) {
+        for (size_t i = 0; i < rocks.size(); ++i) {
+            for (size_t j = i + 1; j < rocks.size(); ++j) test(rocks[i], rocks[j]);
+        }
+        return;
+    }
+    float r = collisions.nodeReach[first] + collisions.nodeReach[second];
+    for (Rock* a : rocks) {
+        if (a->pos.x < tree.left(second) - r || a->pos.x > tree.right(second) + r
+            || a->pos.y < tree.bottom(second) - r || a->pos.y > tree.top(second) + r) {
+            continue;
         }
-        float grav_a = world.gravity * node.total_mass / dist2;
-        return {(pos_vec.x * grav_a) / dist, (pos_vec.y * grav_a) / dist};
+        for (Rock* b : tree.elements(second)) test(a, b);
     }
 }
 
-void checkForCollisions(World& world, const TreeNode& node, Rock& a)
+/// Rocks of a leaf walking the tree together
+template <int Dim>
+struct Group {
+    int32_t leaf {-1};
+    Vec<Dim> boxMin; // box around the rocks' positions
+    Vec<Dim> boxMax;
+    Collisions* collisions {nullptr}; // with a colliding policy, collects pairs with rocks in reach
+};
+
+/// Whether a node is within collision reach (nodeReach of both) of the group's rocks
+bool inCollisionReach(const Tree& tree, const Group<2>& group, int32_t index)
 {
-    if (node.element) {
-        if (node.element <= &a) return; // prevents repeating pairs
-        if (isColliding(a, *node.element)) {
-            world.collisions.enqueue({&a,node.element});
-            return;
+    const std::vector<float>& reach = group.collisions->nodeReach;
+    float r = reach[group.leaf] + reach[index];
+    return tree.left(index) - r <= group.boxMax.x && tree.right(index) + r >= group.boxMin.x
+        && tree.bottom(index) - r <= group.boxMax.y && tree.top(index) + r >= group.boxMin.y;
+}
+
+/// Checks the leaves under a node the gravity walk doesn't open (used whole or
+/// massless) that are in collision reach of the group, from this leaf or a later one
+void findGroupCollisions(const Tree& tree, const Group<2>& group, int32_t index)
+{
+    if (!inCollisionReach(tree, group, index)) return;
+    const TreeNode& node = tree.nodes[index];
+    if (node.hasChildren()) {
+        for (int32_t child = node.children; child < node.children + tree.fanout; ++child) {
+            findGroupCollisions(tree, group, child);
         }
+    } else if (index >= group.leaf) {
+        findLeafPairCollisions(tree, *group.collisions, group.leaf, index);
     }
-    float sr = node.max_radius + a.radius;
-    if (a.pos.x < (node.left-sr) || a.pos.x > (node.right+sr) || a.pos.y < (node.bottom-sr) || a.pos.y > (node.top+sr)) {
-        // means far enough away can ignore
+}
+
+/// Same walk for every rock of a leaf at once, a node is only used as a whole if it
+/// passes the theta test from the nearest point of the box around the rocks
+/// With collisions, leaves in reach are checked for pairs (from this leaf or a later
+/// one) where the walk reads them as near sources, and below the nodes it doesn't open
+template <class P>
+void gatherGroupSources(const World& world, int32_t index, const Group<P::dim>& group,
+                        GravitySources<P::dim>& sources)
+{
+    constexpr int Dim = P::dim;
+    const BasicTree<Dim>& tree = walkTree<Dim>(world);
+    const auto& node = tree.nodes[index];
+    ++sources.stats.nodeVisits;
+    if (node.total_mass == 0.0f) {
+        // massless rocks can still collide
+        if constexpr (P::collide) findGroupCollisions(tree, group, index);
         return;
+    }
+    float dist2 = 0.0f;
+    for (int k = 0; k < Dim; ++k) {
+        float c = axis(node.center_mass, k);
+        float d = std::max({axis(group.boxMin, k) - c, 0.0f, c - axis(group.boxMax, k)});
+        dist2 += d * d;
+    }
+    if (dist2 > 0.0f && (node.width * node.width) < (world.theta * world.theta * dist2)) {
+        addFarSource<P>(node, node.center_mass, sources);
+        if constexpr (P::collide) findGroupCollisions(tree, group, index);
     } else if (node.hasChildren()) {
-        int result = 0;
-        for (const auto& child : node.children) {
-            checkForCollisions(world, child, a);
+        for (int32_t child = node.children; child < node.children + tree.fanout; ++child) {
+            gatherGroupSources<P>(world, child, group, sources);
+        }
+    } else {
+        addNearSources<P>(world, index, sources);
+        if constexpr (P::collide) {
+            if (index >= group.leaf && inCollisionReach(tree, group, index)) {
+                findLeafPairCollisions(tree, *group.collisions, group.leaf, index);
+            }
+        }
+    }
+}
+
+template <class P>
+Vec<P::dim> sourcesAccel(const World& world, const GravitySources<P::dim>& sources, const Body<P::dim>& a)
+{
+    Vec<P::dim> acc = batchAccel<P::dim, false>(sources.far, a.pos, a.radius);
+    if constexpr (P::quadrupole) acc += quadrupoleAccel(sources.farQuad, a.pos);
+    acc += batchAccel<P::dim, P::skipOverlap>(sources.near, a.pos, a.radius);
+    return acc * world.gravity;
+}
+
+template <class P>
+Vec<P::dim> gravityAccelTree(const World& world, const Body<P::dim>& a)
+{
+    GravitySources<P::dim>& sources = gravitySources<P::dim>.local();
+    sources.clear();
+    gatherGravitySources<P>(world, 0, a, world.theta, sources);
+    sources.stats.farInteractions += sources.far.size() + sources.farQuad.size();
+    sources.stats.nearInteractions += sources.near.size();
+    return sourcesAccel<P>(world, sources, a);
+}
+
+/// gravityAccelTree for world's settings, picked once for loops over many rocks
+/// The block step one reads positions at blockSteps.time, a is given there too
+using AccelFunction = sf::Vector2f (*)(const World&, const Rock&);
+
+AccelFunction blockStepAccelFunction(const World& world)
+{
+    AccelFunction accel = nullptr;
+    withWalkPolicy<2, false, true>(world, [&accel](auto policy) { accel = &gravityAccelTree<decltype(policy)>; });
+    return accel;
+}
+
+/// One walk for the rocks of a leaf, with collisions also finding the leaf's pairs
+/// Returns the shared sources, which the caller applies to each rock
+template <class P>
+GravitySources<P::dim>& walkLeaf(const World& world, int32_t leaf, Collisions* collisions)
+{
+    constexpr int Dim = P::dim;
+    std::span<Body<Dim>* const> rocks = walkTree<Dim>(world).elements(leaf);
+    Group<Dim> group {.leaf = leaf, .boxMin = rocks[0]->pos, .boxMax = rocks[0]->pos, .collisions = collisions};
+    for (const Body<Dim>* rock : rocks) {
+        for (int k = 0; k < Dim; ++k) {
+            axis(group.boxMin, k) = std::min(axis(group.boxMin, k), axis(rock->pos, k));
+            axis(group.boxMax, k) = std::max(axis(group.boxMax, k), axis(rock->pos, k));
+        }
+    }
+    GravitySources<Dim>& sources = gravitySources<Dim>.local();
+    sources.clear();
+    gatherGroupSources<P>(world, 0, group, sources);
+    sources.stats.farInteractions += (sources.far.size() + sources.farQuad.size()) * rocks.size();
+    sources.stats.nearInteractions += sources.near.size() * rocks.size();
+    return sources;
+}
+
+template <class P>
+void updateLeafGravity(const World& world, int32_t leaf, float timestep)
+{
+    const GravitySources<P::dim>& sources = walkLeaf<P>(world, leaf, nullptr);
+    for (Body<P::dim>* rock : walkTree<P::dim>(world).elements(leaf)) {
+        rock->vel += sourcesAccel<P>(world, sources, *rock) * timestep;
+    }
+}
+
+/// Kicks rocks by their gravity over timestep, walking the tree once per leaf
+/// Rocks outside the root are in no leaf, they walk the tree on their own
+template <class P>
+void kickRocks(const World& world, std::span<Body<P::dim>> rocks, float timestep)
+{
+    constexpr int Dim = P::dim;
+    const BasicTree<Dim>& tree = walkTree<Dim>(world);
+    tbb::parallel_for(tbb::blocked_range<int32_t>(0, static_cast<int32_t>(tree.nodes.size()), 64),
+                      [&world, &tree, timestep](const auto& range) {
+        profile::Scope zone {"gravity task"};
+        for (int32_t i = range.begin(); i != range.end(); ++i) {
+            if (!tree.elements(i).empty()) updateLeafGravity<P>(world, i, timestep);
         }
-    } 
+    });
+    if (tree.size() != rocks.size()) {
+        tbb::parallel_for_each(rocks.begin(), rocks.end(), [timestep, &world, &tree](Body<Dim>& a) {
+            if (!tree.contains(0, a.pos)) a.vel += (gravityAccelTree<P>(world, a) * timestep);
+        });
+    }
+}
+
+/// Accel of a from a per rock walk at theta, without counting stats
+template <class P>
+Vec<P::dim> sampleAccel(const World& world, const Body<P::dim>& a, float theta)
+{
+    thread_local GravitySources<P::dim> sources;
+    sources.clear();
+    gatherGravitySources<P>(world, 0, a, theta, sources);
+    return sourcesAccel<P>(world, sources, a);
+}
+
+/// Relative accel error at theta against a walk at a third of it, for a few rocks
+/// The gravity system walks per leaf which is a bit more accurate, so this errs high
+template <int Dim>
+void estimateThetaError(World& world)
+{
+    constexpr int samples {8};
+    ThetaControl& control = world.thetaControl;
+    const std::vector<Body<Dim>>& rocks = bodySet<Dim>(world).rocks;
+    if (rocks.empty()) return;
+    util::Random random(control.frame++, 0);
+    float error = 0.0f;
+    withWalkPolicy<Dim, false>(world, [&world, &rocks, &random, &error](auto policy) {
+        using P = decltype(policy);
+        for (int i = 0; i < samples; ++i) {
+            const Body<Dim>& rock = rocks[random.next() % rocks.size()];
+            Vec<Dim> exact = sampleAccel<P>(world, rock, world.theta / 3.0f);
+            Vec<Dim> diff = sampleAccel<P>(world, rock, world.theta) - exact;
+            float size = std::sqrt(lengthSquared(exact));
+            if (size > 0.0f) error += std::sqrt(lengthSquared(diff)) / size / samples;
+        }
+    });
+    control.error = (control.error == 0.0f) ? error : 0.8f * control.error + 0.2f * error;
+}
+
+constexpr float rootPadding {0.125f}; // fitted root is this much wider than the rocks
+
+/// Smallest box holding every rock's position
+template <int Dim>
+struct RockBounds {
+    Vec<Dim> min {splat<Dim>(std::numeric_limits<float>::max())};
+    Vec<Dim> max {splat<Dim>(std::numeric_limits<float>::lowest())};
+
+    void add(Vec<Dim> pos) {
+        for (int k = 0; k < Dim; ++k) {
+            axis(min, k) = std::min(axis(min, k), axis(pos, k));
+            axis(max, k) = std::max(axis(max, k), axis(pos, k));
+        }
+    }
+
+    void add(const RockBounds& other) {
+        add(other.min);
+        add(other.max);
+    }
+};
+
+template <int Dim>
+RockBounds<Dim> rockBounds(const std::vector<Body<Dim>>& rocks)
+{
+    return tbb::parallel_reduce(
+        tbb::blocked_range<size_t>(0, rocks.size(), 4096), RockBounds<Dim> {},
+        [&rocks](const auto& range, RockBounds<Dim> bounds) {
+            for (size_t i = range.begin(); i != range.end(); ++i) bounds.add(rocks[i].pos);
+            return bounds;
+        },
+        [](RockBounds<Dim> a, const RockBounds<Dim>& b) {
+            a.add(b);
+            return a;
+        });
+}
+
+/// Size of the box's longest side, never quite 0
+template <int Dim>
+float boundsSize(const RockBounds<Dim>& bounds)
+{
+    float size = 1e-3f;
+    for (int k = 0; k < Dim; ++k) size = std::max(size, axis(bounds.max, k) - axis(bounds.min, k));
+    return size;
+}
+
+/// Lower corner of the padded square (cube in 3d) around bounds that is width across
+template <int Dim>
+Vec<Dim> paddedCorner(const RockBounds<Dim>& bounds, float width)
+{
+    Vec<Dim> center = (bounds.min + bounds.max) / 2.0f;
+    return center - splat<Dim>(width) / 2.0f;
+}
+
+RootSquare squareAround(const RockBounds<2>& bounds)
+{
+    float width = (1.0f + rootPadding) * boundsSize(bounds);
+    return {.min = paddedCorner(bounds, width), .width = width};
+}
+
+void collectGravityStats(World& world)
+{
+    auto collect = [&world](auto& perThread) {
+        for (auto& sources : perThread) {
+            world.gravityStats.nodeVisits += sources.stats.nodeVisits;
+            world.gravityStats.farInteractions += sources.stats.farInteractions;
+            world.gravityStats.nearInteractions += sources.stats.nearInteractions;
+            sources.stats = {};
+        }
+    };
+    collect(gravitySources<2>);
+    collect(gravitySources<3>);
+}
+
+/// world.rocks set to the x-y projection of world.volume's rocks, index for index
+void projectVolume(World& world)
+{
+    const std::vector<Rock3>& volume = world.volume.rocks;
+    world.rocks.resize(volume.size());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, volume.size(), 4096), [&world, &volume](const auto& range) {
+        for (size_t i = range.begin(); i != range.end(); ++i) {
+            const Rock3& rock = volume[i];
+            world.rocks[i] = {.pos = {rock.pos.x, rock.pos.y},
+                              .vel = {rock.vel.x, rock.vel.y},
+                              .radius = rock.radius,
+                              .mass = rock.mass,
+                              .id = rock.id};
+        }
+    });
+}
+
+/// Rung whose step keeps the rock within the accuracy limits
+uint8_t rungFor(const World& world, const Rock& rock, sf::Vector2f acc, float delta)
+{
+    float dt = delta;
+    float acc2 = acc.x * acc.x + acc.y * acc.y;
+    if (acc2 > 0.0f) dt = std::min(dt, world.timestepAccuracy * std::sqrt(rock.radius / std::sqrt(acc2)));
+    int rung = (dt < delta) ? static_cast<int>(std::ceil(std::log2(delta / dt))) : 0;
+    return static_cast<uint8_t>(std::clamp(rung, 0, world.maxRung));
+}
+
+/// Parent of each tree node and leaf of each rock, so the nodes above a rock can be
+/// found from it
+void indexTree(World& world)
+{
+    const Tree& tree = world.rootTree;
+    BlockSteps& steps = world.blockSteps;
+    const Rock* base = world.rocks.data();
+    steps.parents.resize(tree.nodes.size());
+    steps.parents[0] = -1;
+    steps.leaves.assign(world.rocks.size(), -1);
+    tbb::parallel_for(tbb::blocked_range<int32_t>(0, static_cast<int32_t>(tree.nodes.size()), 1024),
+                      [&tree, &steps, base](const auto& range) {
+        for (int32_t i = range.begin(); i != range.end(); ++i) {
+            const TreeNode& node = tree.nodes[i];
+            if (node.hasChildren()) {
+                for (int32_t child = node.children; child < node.children + tree.fanout; ++child) {
+                    steps.parents[child] = i;
+                }
+            }
+            for (const Rock* rock : tree.elements(i)) steps.leaves[rock - base] = i;
+        }
+    });
+}
+
+/// Mass weighted velocity of the rocks under each node, leaves first then parents
+/// (which always come before their children in nodes)
+void computeNodeVels(World& world)
+{
+    const Tree& tree = world.rootTree;
+    std::vector<sf::Vector2f>& vels = world.blockSteps.nodeVels;
+    vels.resize(tree.nodes.size());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, tree.nodes.size(), 1024), [&tree, &vels](const auto& range) {
+        for (size_t i = range.begin(); i != range.end(); ++i) {
+            sf::Vector2f momentum;
+            for (const Rock* rock : tree.elements(static_cast<int32_t>(i))) momentum += rock->mass * rock->vel;
+            float mass = tree.nodes[i].total_mass;
+            vels[i] = (mass > 0.0f) ? momentum / mass : sf::Vector2f();
+        }
+    });
+    for (int32_t i = static_cast<int32_t>(tree.nodes.size()) - 1; i >= 0; --i) {
+        const TreeNode& node = tree.nodes[i];
+        if (!node.hasChildren()) continue;
+        sf::Vector2f momentum;
+        for (int32_t child = node.children; child < node.children + tree.fanout; ++child) {
+            momentum += tree.nodes[child].total_mass * vels[child];
+        }
+        vels[i] = (node.total_mass > 0.0f) ? momentum / node.total_mass : sf::Vector2f();
+    }
+}
+
+/// Moves the nodes above each rock of the last substep by its share of the rock's kick,
+/// so centers still come out at center_mass + nodeVel * time for any later time
+/// The rock's pos was shifted back by kick * blockSteps.time, its node's center goes too
+/// Serial, it is depth nodes per kicked rock against the walk each of them just did
+void moveNodesForKicks(World& world)
+{
+    BlockSteps& steps = world.blockSteps;
+    Tree& tree = world.rootTree;
+    for (size_t k = 0; k < steps.active.size(); ++k) {
+        uint32_t i = steps.active[k];
+        float mass = world.rocks[i].mass;
+        if (mass == 0.0f) continue;
+        sf::Vector2f kick = steps.kicks[k];
+        for (int32_t index = steps.leaves[i]; index >= 0; index = steps.parents[index]) {
+            TreeNode& node = tree.nodes[index];
+            float share = mass / node.total_mass;
+            node.center_mass -= share * kick * steps.time;
+            steps.nodeVels[index] += share * kick;
+            ++steps.nodeMoves;
+        }
+    }
+}
+
+/// Largest radius plus distance moved in sweep of the rocks under each node, leaves
+/// first then parents (which always come before their children in nodes)
+template <int Dim>
+void computeNodeReach(const BasicTree<Dim>& tree, BasicCollisions<Dim>& collisions, float sweep)
+{
+    std::vector<float>& reach = collisions.nodeReach;
+    reach.resize(tree.nodes.size());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, tree.nodes.size(), 1024), [&](const auto& range) {
+        for (size_t i = range.begin(); i != range.end(); ++i) {
+            float r = 0.0f;
+            for (const Body<Dim>* rock : tree.elements(static_cast<int32_t>(i))) {
+                r = std::max(r, rock->radius + std::sqrt(lengthSquared(rock->vel)) * sweep);
+            }
+            reach[i] = r;
+        }
+    });
+    for (int32_t i = static_cast<int32_t>(tree.nodes.size()) - 1; i >= 0; --i) {
+        const auto& node = tree.nodes[i];
+        if (!node.hasChildren()) continue;
+        float r = 0.0f;
+        for (int32_t child = node.children; child < node.children + tree.fanout; ++child) {
+            r = std::max(r, reach[child]);
+        }
+        reach[i] = r;
+    }
+}
+
+/// Pairs of a with rocks below index, a_reach is a's radius plus its move in the step
+template <int Dim>
+void checkForCollisions(const BasicTree<Dim>& tree, BasicCollisions<Dim>& collisions, int32_t index,
+                        Body<Dim>& a, float a_reach)
+{
+    float sr = collisions.nodeReach[index] + a_reach;
+    for (int k = 0; k < Dim; ++k) {
+        if (axis(a.pos, k) < (tree.lower(index, k) - sr) || axis(a.pos, k) > (tree.upper(index, k) + sr)) {
+            // means far enough away can ignore
+            return;
+        }
+    }
+    if (tree.nodes[index].hasChildren()) {
+        int32_t children = tree.nodes[index].children;
+        for (int32_t child = children; child < children + tree.fanout; ++child) {
+            checkForCollisions(tree, collisions, child, a, a_reach);
+        }
+    } else {
+        for (Body<Dim>* b : tree.elements(index)) {
+            if (b <= &a) continue; // prevents repeating pairs
+            if (collisions.sweep > 0.0f) {
+                auto time = timeOfImpact(a, *b, collisions.sweep);
+                if (time) collisions.found.local().push_back({*time, &a, b});
+            } else if (isColliding(a, *b)) {
+                collisions.found.local().push_back({0.0f, &a, b});
+            }
+        }
+    }
+}
+
+/// Adds the kicks updateGravityCollisionSystem held back, if any
+void applyHeldKicks(World& world)
+{
+    std::vector<sf::Vector2f>& kicks = world.fusedKicks;
+    if (kicks.size() == world.rocks.size()) {
+        tbb::parallel_for(size_t(0), world.rocks.size(), [&world, &kicks](size_t i) {
+            world.rocks[i].vel += kicks[i];
+        });
+    }
+    kicks.clear();
+}
+
+/// Packs the rocks not merged away (and in the plane their block step accels) to the
+/// front in order, a parallel scan gives each kept rock its new index
+template <int Dim>
+void compactRocks(World& world)
+{
+    BodySet<Dim> set = bodySet<Dim>(world);
+    std::vector<Body<Dim>>& rocks = set.rocks;
+    BasicCollisions<Dim>& collisions = set.collisions;
+    const size_t n = rocks.size();
+    std::vector<sf::Vector2f>* accels = nullptr;
+    if constexpr (Dim == 2) {
+        if (world.blockSteps.accels.size() == n) accels = &world.blockSteps.accels;
+    }
+    collisions.compacted.resize(n);
+    if (accels) collisions.compactedAccels.resize(n);
+    size_t kept = tbb::parallel_scan(
+        tbb::blocked_range<size_t>(0, n, 4096), size_t(0),
+        [&](const auto& range, size_t next, bool final) {
+            for (size_t i = range.begin(); i != range.end(); ++i) {
+                if (collisions.mergedAway[i]) continue;
+                if (final) {
+                    collisions.compacted[next] = rocks[i];
+                    if (accels) collisions.compactedAccels[next] = (*accels)[i];
+                }
+                ++next;
+            }
+            return next;
+        },
+        std::plus<size_t>());
+    collisions.compacted.resize(kept);
+    rocks.swap(collisions.compacted);
+    if (accels) {
+        collisions.compactedAccels.resize(kept);
+        accels->swap(collisions.compactedAccels);
+    }
+    collisions.merged = n - kept;
+}
+
+/// findCollisions for the plane's or the volume's rocks
+template <int Dim>
+void findBodyCollisions(World& world, float timestep)
+{
+    profile::Scope zone {"collision find"};
+    BodySet<Dim> set = bodySet<Dim>(world);
+    const BasicTree<Dim>& tree = set.tree;
+    BasicCollisions<Dim>& collisions = set.collisions;
+    collisions.sweep = world.sweptCollisions ? std::max(timestep, 0.0f) : 0.0f;
+    if constexpr (Dim == 2) {
+        if (world.broadphase == Broadphase::Grid) {
+            world.grid.build(world.rocks, collisions.sweep);
+            world.grid.forEachCandidate([&collisions](Rock* a, Rock* b) {
+                auto [first, second] = std::minmax(a, b);
+                if (collisions.sweep > 0.0f) {
+                    auto time = timeOfImpact(*first, *second, collisions.sweep);
+                    if (time) collisions.found.local().push_back({*time, first, second});
+                } else if (isColliding(*a, *b)) {
+                    collisions.found.local().push_back({0.0f, first, second});
+                }
+            });
+            return;
+        }
+    }
+    computeNodeReach(tree, collisions, collisions.sweep);
+    tbb::parallel_for_each(set.rocks, [&tree, &collisions](Body<Dim>& a) {
+        checkForCollisions(tree, collisions, 0, a, a.radius + std::sqrt(lengthSquared(a.vel)) * collisions.sweep);
+    });
+}
+
+/// resolveCollisions for the plane's or the volume's rocks, only the plane has held
+/// kicks and block step accels
+template <int Dim>
+void resolveBodyCollisions(World& world)
+{
+    profile::Scope zone {"collision resolve"};
+    BodySet<Dim> set = bodySet<Dim>(world);
+    std::vector<Body<Dim>>& rocks = set.rocks;
+    BasicCollisions<Dim>& collisions = set.collisions;
+    auto applyKicks = [&world] {
+        if constexpr (Dim == 2) applyHeldKicks(world);
+    };
+    std::vector<typename BasicCollisions<Dim>::Pair>& pairs = collisions.pairs;
+    pairs.clear();
+    collisions.merged = 0;
+    for (auto& found : collisions.found) {
+        pairs.insert(pairs.end(), found.begin(), found.end());
+        found.clear();
+    }
+    if (pairs.empty()) {
+        applyKicks();
+        return;
+    }
+    tbb::parallel_sort(pairs.begin(), pairs.end());
+
+    Body<Dim>* base = rocks.data();
+    collisions.rockBatch.assign(rocks.size(), 0);
+    collisions.pairBatch.resize(pairs.size());
+    uint32_t batches = 0;
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        uint32_t& a_batch = collisions.rockBatch[pairs[i].first - base];
+        uint32_t& b_batch = collisions.rockBatch[pairs[i].second - base];
+        uint32_t batch = std::max(a_batch, b_batch);
+        collisions.pairBatch[i] = batch;
+        a_batch = b_batch = batch + 1;
+        batches = std::max(batches, batch + 1);
+    }
+
+    // stable counting sort of pairs by batch
+    collisions.batchStart.assign(batches + 1, 0);
+    for (uint32_t batch : collisions.pairBatch) ++collisions.batchStart[batch + 1];
+    for (uint32_t b = 0; b < batches; ++b) collisions.batchStart[b + 1] += collisions.batchStart[b];
+    auto& batched = collisions.batched;
+    batched.resize(pairs.size());
+    std::vector<uint32_t> next(collisions.batchStart.begin(), collisions.batchStart.end() - 1);
+    for (size_t i = 0; i < pairs.size(); ++i) batched[next[collisions.pairBatch[i]]++] = pairs[i];
+
+    float sweep = collisions.sweep;
+    if (world.mergeCollisions) {
+        std::vector<uint8_t>& merged_away = collisions.mergedAway;
+        merged_away.assign(rocks.size(), 0);
+        std::atomic<size_t> merges {0};
+        std::vector<sf::Vector2f>* kicks = nullptr;
+        if constexpr (Dim == 2) {
+            if (world.fusedKicks.size() == rocks.size()) kicks = &world.fusedKicks;
+        }
+        for (uint32_t b = 0; b < batches; ++b) {
+            tbb::parallel_for(collisions.batchStart[b], collisions.batchStart[b + 1], [&, sweep](uint32_t i) {
+                Body<Dim>& a = *batched[i].first;
+                Body<Dim>& b = *batched[i].second;
+                if (merged_away[&a - base] || merged_away[&b - base]) return;
+                if (sweep > 0.0f && !timeOfImpact(a, b, sweep)) return;
+                if (kicks) {
+                    // weighted like the velocities, so the kicks keep momentum too
+                    float mass = a.mass + b.mass;
+                    float b_share = (mass > 0.0f) ? b.mass / mass : 0.5f;
+                    (*kicks)[&a - base] += ((*kicks)[&b - base] - (*kicks)[&a - base]) * b_share;
+                }
+                mergeRocks(a, b);
+                merged_away[&b - base] = 1;
+                merges.fetch_add(1, std::memory_order_relaxed);
+            });
+        }
+        applyKicks();
+        if (merges == 0) return;
+        compactRocks<Dim>(world);
+        // rebuilt in the same root rather than by a tree update, which in the plane counts
+        // tree updates for reorderEvery and could reorder the rocks in the middle of a step
+        BasicTree<Dim>& tree = set.tree;
+        Vec<Dim> corner = tree.bounds[0].corner;
+        float width = tree.root().width;
+        tree.reset(corner, width);
+        tree.buildPar(rocks);
+        return;
+    }
+    for (uint32_t b = 0; b < batches; ++b) {
+        tbb::parallel_for(collisions.batchStart[b], collisions.batchStart[b + 1], [&batched, sweep](uint32_t i) {
+            Body<Dim>& a = *batched[i].first;
+            Body<Dim>& b = *batched[i].second;
+            if (sweep == 0.0f) {
+                updateForCollision(a, b);
+            } else if (auto time = timeOfImpact(a, b, sweep)) {
+                updateForCollision(a, b, *time);
+            }
+        });
+    }
+    applyKicks();
 }
 
 }  // namespace
@@ -79,40 +808,109 @@ void checkForCollisions(World& world, const TreeNode& node, Rock& a)
 // General Functions
 //
 
+RootSquare fitRootSquare(const std::vector<Rock>& rocks)
+{
+    return squareAround(rockBounds(rocks));
+}
+
+void reorderRocks(World& world, RootSquare square)
+{
+    profile::Scope zone {"reorder"};
+    Reorder& reorder = world.reorder;
+    std::vector<Rock>& rocks = world.rocks;
+    std::vector<sf::Vector2f>& accels = world.blockSteps.accels;
+    const size_t n = rocks.size();
+    const bool with_accels = (accels.size() == n);
+    reorder.keys.resize(n);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, n, 4096), [&](const auto& range) {
+        for (size_t i = range.begin(); i != range.end(); ++i) {
+            reorder.keys[i] = (uint64_t(mortonKey(rocks[i].pos, square.min, square.width)) << 32) | i;
+        }
+    });
+    radixSort(reorder.keys, reorder.sortScratch, 32, 64);
+    reorder.rocks.resize(n);
+    if (with_accels) reorder.accels.resize(n);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, n, 4096), [&](const auto& range) {
+        for (size_t i = range.begin(); i != range.end(); ++i) {
+            uint32_t from = static_cast<uint32_t>(reorder.keys[i]);
+            reorder.rocks[i] = rocks[from];
+            if (with_accels) reorder.accels[i] = accels[from];
+        }
+    });
+    rocks.swap(reorder.rocks);
+    if (with_accels) accels.swap(reorder.accels);
+    ++reorder.count;
+}
+
 void addRock(World& world, Rock rock)
 {
-    world.rocks.reserve(world.rocks.size() + 1);
-    world.shapes.reserve(world.shapes.size() + 1);
+    rock.id = world.nextRockId++;
     world.rocks.push_back(rock);
-    world.shapes.push_back(shapeFor(rock));
+    if (world.threeD) {
+        world.volume.rocks.push_back(
+            {.pos = {rock.pos.x, rock.pos.y, 0.0f}, .vel = {rock.vel.x, rock.vel.y, 0.0f},
+             .radius = rock.radius, .mass = rock.mass, .id = rock.id});
+    }
 }
 
 void addRandomRocks(World& world, size_t numRocks, RockConfig rockConfig)
 {
-    world.rocks.reserve(world.rocks.size() + numRocks);
-    world.shapes.reserve(world.shapes.size() + numRocks);
-    for (size_t i = 0; i<numRocks; ++i) {
-        Rock rock = newRandomRock(rockConfig);
-        world.rocks.push_back(rock);
-        world.shapes.push_back(shapeFor(rock));
+    // indices continue from the rocks already there so adding more gives new rocks
+    if (world.threeD) {
+        std::vector<Rock3>& rocks = world.volume.rocks;
+        size_t first = rocks.size();
+        rocks.resize(first + numRocks);
+        generateRocks(std::span(rocks).subspan(first), rockConfig, world.gravity, first);
+        for (size_t i = first; i < rocks.size(); ++i) rocks[i].id = world.nextRockId++;
+        projectVolume(world);
+        return;
     }
+    size_t first = world.rocks.size();
+    world.rocks.resize(first + numRocks);
+    generateRocks(std::span(world.rocks).subspan(first), rockConfig, world.gravity, first);
+    for (size_t i = first; i < world.rocks.size(); ++i) world.rocks[i].id = world.nextRockId++;
 }
 
 void addSatRocks(World& world)
 {
-    world.rocks.push_back(Rock {.pos = {0,0}, .vel = {0,0}, .radius = 20.0f});
+    addRock(world, Rock {.pos = {0,0}, .vel = {0,0}, .radius = 20.0f});
     for (size_t i = 4; i < 10; ++i) {
-        world.rocks.push_back(Rock {.pos = {i*5.0f,0}, .vel = {0, 4.0}, .radius = 2.0});
-    }
-    for (auto& rock: world.rocks) {
-        world.shapes.push_back(shapeFor(rock));
+        addRock(world, Rock {.pos = {i*5.0f,0}, .vel = {0, 4.0}, .radius = 2.0});
     }
 }
 
 void deleteAllRocks(World& world)
 {
     world.rocks = {};
-    world.shapes = {};
+    world.blockSteps.accels = {};
+    world.rootTree.reset(world.worldExtent);
+    world.volume.rocks = {};
+    world.volume.tree.reset(world.worldExtent);
+    world.nextRockId = 0;
+}
+
+void liftRocks(World& world)
+{
+    std::vector<Rock3>& volume = world.volume.rocks;
+    volume.resize(world.rocks.size());
+    for (size_t i = 0; i < volume.size(); ++i) {
+        const Rock& rock = world.rocks[i];
+        volume[i] = {.pos = {rock.pos.x, rock.pos.y, 0.0f}, .vel = {rock.vel.x, rock.vel.y, 0.0f},
+                     .radius = rock.radius, .mass = rock.mass, .id = rock.id};
+    }
+}
+
+void setThreeD(World& world, bool threeD)
+{
+    if (threeD == world.threeD) return;
+    world.threeD = threeD;
+    world.blockSteps.accels.clear();
+    if (threeD) {
+        liftRocks(world);
+    } else {
+        // world.rocks already holds the projection
+        world.volume.rocks = {};
+    }
 }
 
 //
@@ -121,64 +919,295 @@ void deleteAllRocks(World& world)
 
 void updateTreeSystem(World& world)
 {
-    world.rootTree = TreeNode(world.worldExtent);
-    for (auto& rock : world.rocks) {
-        world.rootTree.insert(&rock);
+    profile::Scope zone {"tree"};
+    Tree& tree = world.rootTree;
+    Reorder& reorder = world.reorder;
+    bool reordering = world.reorderEvery > 0 && ++reorder.treeUpdates % world.reorderEvery == 0;
+    if (!world.fitRoot || world.rocks.empty()) {
+        if (reordering) {
+            float extent = world.worldExtent;
+            reorderRocks(world, {.min = {-extent, -extent}, .width = 2.0f * extent});
+        } else if (world.incrementalTree && tree.leafSize == world.leafSize && tree.update(world.rocks)) {
+            return;
+        }
+        tree.leafSize = world.leafSize;
+        tree.reset(world.worldExtent);
+        tree.buildPar(world.rocks);
+        return;
+    }
+
+    RockBounds bounds = rockBounds(world.rocks);
+    // the current root still works while every rock is inside and it isn't much bigger
+    bool fits = tree.contains(0, bounds.min) && tree.contains(0, bounds.max)
+        && tree.root().width <= 2.0f * (1.0f + rootPadding) * boundsSize(bounds);
+    if (!reordering && fits && world.incrementalTree && tree.leafSize == world.leafSize
+        && tree.update(world.rocks)) {
+        return;
     }
+    RootSquare square = squareAround(bounds);
+    // the new root's quadrants, so each subtree's rocks end up together
+    if (reordering) reorderRocks(world, square);
+    tree.leafSize = world.leafSize;
+    tree.reset(square.min.x, square.min.y, square.width);
+    tree.buildPar(world.rocks);
 }
 
-void updateCollisionSystemPar(World& world)
+void findCollisions(World& world, float timestep)
 {
-    // util::Timer timer;
-    tbb::parallel_for_each(world.rocks, [&world](Rock& a) {
-        checkForCollisions(world, world.rootTree, a);
-    });
-    CollidingPair cp;
-    while (world.collisions.try_dequeue(cp)) {
-       updateForCollision(*cp.first, *cp.second);
-    }
+    findBodyCollisions<2>(world, timestep);
+}
+
+void resolveCollisions(World& world)
+{
+    resolveBodyCollisions<2>(world);
 }
 
+void updateCollisionSystemPar(World& world, float timestep)
+{
+    findCollisions(world, timestep);
+    resolveCollisions(world);
+}
 
 void updateGravitySystemTree(World& world, float timestep)
 {
-    tbb::parallel_for_each(world.rocks, [timestep, &world](Rock& a) {
-        a.vel += (gravityAccelTree(world, world.rootTree, a) * timestep);
+    profile::Scope zone {"gravity"};
+    util::Stopwatch watch;
+    withWalkPolicy<2, false>(world, [&world, timestep](auto policy) {
+        kickRocks<decltype(policy)>(world, world.rocks, timestep);
+    });
+    world.gravityStats = {};
+    collectGravityStats(world);
+    world.blockSteps.accels.clear();  // stale once rocks move without block steps
+    world.thetaControl.lastMs = static_cast<float>(watch.elapsed());
+}
+
+void updateGravityCollisionSystem(World& world, float timestep)
+{
+    const Tree& tree = world.rootTree;
+    if (world.broadphase == Broadphase::Grid || tree.size() != world.rocks.size()) {
+        world.fusedKicks.clear();
+        updateGravitySystemTree(world, timestep);
+        findCollisions(world, timestep);
+        return;
+    }
+    profile::Scope zone {"gravity"};
+    util::Stopwatch watch;
+    Collisions& collisions = world.collisions;
+    collisions.sweep = world.sweptCollisions ? std::max(timestep, 0.0f) : 0.0f;
+    computeNodeReach(tree, collisions, collisions.sweep);
+    std::vector<sf::Vector2f>& kicks = world.fusedKicks;
+    kicks.resize(world.rocks.size());
+    const Rock* base = world.rocks.data();
+    withWalkPolicy<2, true>(world, [&world, &tree, &collisions, &kicks, base, timestep](auto policy) {
+        using P = decltype(policy);
+        tbb::parallel_for(tbb::blocked_range<int32_t>(0, static_cast<int32_t>(tree.nodes.size()), 64),
+                          [&world, &tree, &collisions, &kicks, base, timestep](const auto& range) {
+            profile::Scope zone {"gravity task"};
+            for (int32_t i = range.begin(); i != range.end(); ++i) {
+                if (tree.elements(i).empty()) continue;
+                const GravitySources<2>& sources = walkLeaf<P>(world, i, &collisions);
+                for (const Rock* rock : tree.elements(i)) {
+                    kicks[rock - base] = sourcesAccel<P>(world, sources, *rock) * timestep;
+                }
+            }
+        });
     });
+    // kicks wait until resolveCollisions has used the velocities the pairs were found with
+    world.gravityStats = {};
+    collectGravityStats(world);
+    world.blockSteps.accels.clear();
+    world.thetaControl.lastMs = static_cast<float>(watch.elapsed());
 }
 
 void updateRockPositionSystem(World& world, float timeStep)
 {
+    profile::Scope zone {"position"};
     for (auto& rock : world.rocks) {
         rock.pos += rock.vel * timeStep;
     }
 }
 
-void updateShapeSystem(World& world)
+void updateThetaSystem(World& world)
 {
-    for (size_t i = 0; i < world.shapes.size(); ++i) {
-        world.shapes[i].setPosition(world.rocks[i].pos.x, -world.rocks[i].pos.y);
-        world.shapes[i].setFillColor(colorFromVelocity(world.rocks[i].vel,
-                                                       world.velColorExtent));
+    ThetaControl& control = world.thetaControl;
+    if (world.threeD) {
+        estimateThetaError<3>(world);
+    } else {
+        estimateThetaError<2>(world);
+    }
+    if (!control.enabled && control.savedMaxRung >= 0) {
+        world.maxRung = control.savedMaxRung;
+        control.savedMaxRung = -1;
     }
+    if (!control.enabled || control.lastMs <= 0.0f) return;
+    control.gravityMs = (control.gravityMs == 0.0f) ? control.lastMs
+                                                    : 0.7f * control.gravityMs + 0.3f * control.lastMs;
+    float ratio = control.gravityMs / control.targetMs;
+    if (std::abs(ratio - 1.0f) < 0.05f) return;
+    if (world.blockTimesteps) {
+        // under budget gives back substeps before accuracy
+        if (ratio < 1.0f && control.savedMaxRung > world.maxRung) {
+            if (++world.maxRung == control.savedMaxRung) control.savedMaxRung = -1;
+            return;
+        }
+        if (ratio > 1.2f && world.theta >= control.thetaMax && world.maxRung > control.rungFloor) {
+            if (control.savedMaxRung < 0) control.savedMaxRung = world.maxRung;
+            --world.maxRung;
+            return;
+        }
+    }
+    // walk cost goes roughly as 1 / theta^2
+    float step = std::clamp(std::sqrt(ratio), 0.9f, 1.1f);
+    world.theta = std::clamp(world.theta * step, control.thetaMin, control.thetaMax);
 }
 
-//
-// Visualization
-//
+void updateBlockStepSystem(World& world, float delta)
+{
+    profile::Scope zone {"block steps"};
+    util::Stopwatch watch;
+    BlockSteps& steps = world.blockSteps;
+    const size_t n = world.rocks.size();
+    const int max_rung = std::clamp(world.maxRung, 0, 15);
+    const uint32_t substeps = 1u << max_rung;
+    const float min_dt = delta / substeps;
+    auto rungDt = [delta](uint8_t rung) { return delta / static_cast<float>(1u << rung); };
+    world.gravityStats = {};
+    steps.evaluations = 0;
+    steps.nodeMoves = 0;
+    steps.time = 0.0f;
+    steps.nodeVels.assign(world.rootTree.nodes.size(), {});  // summed after the opening kicks
+    const AccelFunction gravityAccel = blockStepAccelFunction(world);
+
+    // accels are kept from the end of the last update unless rocks changed
+    if (steps.accels.size() != n) {
+        steps.accels.resize(n);
+        tbb::parallel_for(size_t(0), n, [&world, &steps, gravityAccel](size_t i) {
+            steps.accels[i] = gravityAccel(world, world.rocks[i]);
+        });
+        steps.evaluations += n;
+    }
+    steps.rungs.resize(n);
+    steps.rungRocks.resize(max_rung + 1);
+    for (auto& rocks : steps.rungRocks) rocks.clear();
+    tbb::parallel_for(size_t(0), n, [&](size_t i) {
+        Rock& rock = world.rocks[i];
+        steps.rungs[i] = std::min<uint8_t>(rungFor(world, rock, steps.accels[i], delta), max_rung);
+        rock.vel += steps.accels[i] * (0.5f * rungDt(steps.rungs[i]));  // opening half kick
+    });
+    for (uint32_t i = 0; i < n; ++i) steps.rungRocks[steps.rungs[i]].push_back(i);
+    steps.rungCounts.assign(max_rung + 1, 0);
+    for (int r = 0; r <= max_rung; ++r) steps.rungCounts[r] = steps.rungRocks[r].size();
+    indexTree(world);
+    computeNodeVels(world);
+
+    for (uint32_t s = 1; s <= substeps; ++s) {
+        // rocks on rungs >= level have a step ending at s
+        int level = max_rung - std::countr_zero(s);
+        steps.active.clear();
+        for (int r = level; r <= max_rung; ++r) {
+            steps.active.insert(steps.active.end(), steps.rungRocks[r].begin(), steps.rungRocks[r].end());
+            steps.rungRocks[r].clear();
+        }
+        if (steps.active.empty()) continue;
 
-sf::CircleShape shapeFor(const Rock& rock)
+        // walks read every rock's pos and vel, so nothing is kicked until all are done
+        steps.time = min_dt * s;
+        tbb::parallel_for(size_t(0), steps.active.size(), [&world, &steps, gravityAccel](size_t k) {
+            uint32_t i = steps.active[k];
+            Rock at = world.rocks[i];
+            at.pos = predicted(world, at);
+            steps.accels[i] = gravityAccel(world, at);
+        });
+        steps.kicks.resize(steps.active.size());
+        tbb::parallel_for(size_t(0), steps.active.size(), [&](size_t k) {
+            uint32_t i = steps.active[k];
+            Rock& rock = world.rocks[i];
+            sf::Vector2f acc = steps.accels[i];
+            sf::Vector2f kick = acc * (0.5f * rungDt(steps.rungs[i]));  // closing half kick
+            if (s != substeps) {
+                // may go to any finer rung, coarser only if its step boundary lines up with s
+                uint8_t rung = rungFor(world, rock, acc, delta);
+                while (rung < steps.rungs[i] && (s & ((substeps >> rung) - 1)) != 0) ++rung;
+                steps.rungs[i] = rung;
+                kick += acc * (0.5f * rungDt(rung));  // opening half kick of next step
+            }
+            // pos is shifted back so pos + vel * time stays where the rock is now
+            rock.vel += kick;
+            rock.pos -= kick * steps.time;
+            steps.kicks[k] = kick;
+        });
+        steps.evaluations += steps.active.size();
+        if (s != substeps) moveNodesForKicks(world);
+        for (uint32_t i : steps.active) steps.rungRocks[steps.rungs[i]].push_back(i);
+    }
+
+    // one drift to the end for rocks and node centers, every rock was kicked at the end
+    // so the last kicks didn't move the nodes
+    Tree& tree = world.rootTree;
+    tbb::parallel_for(size_t(0), n, [&world, delta](size_t i) {
+        world.rocks[i].pos += world.rocks[i].vel * delta;
+    });
+    tbb::parallel_for(size_t(0), tree.nodes.size(), [&tree, &steps, delta](size_t i) {
+        tree.nodes[i].center_mass += steps.nodeVels[i] * delta;
+    });
+    steps.time = 0.0f;
+    collectGravityStats(world);
+    world.thetaControl.lastMs = static_cast<float>(watch.elapsed());
+}
+
+void updateVolumeTreeSystem(World& world)
+{
+    profile::Scope zone {"tree"};
+    Volume& volume = world.volume;
+    Octree& tree = volume.tree;
+    if (volume.rocks.empty()) {
+        tree.reset(world.worldExtent);
+        return;
+    }
+    RockBounds<3> bounds = rockBounds(volume.rocks);
+    bool fits = tree.contains(0, bounds.min) && tree.contains(0, bounds.max)
+        && tree.root().width <= 2.0f * (1.0f + rootPadding) * boundsSize(bounds);
+    if (fits && world.incrementalTree && tree.leafSize == world.leafSize && tree.update(volume.rocks)) return;
+    float width = (1.0f + rootPadding) * boundsSize(bounds);
+    tree.leafSize = world.leafSize;
+    tree.reset(paddedCorner(bounds, width), width);
+    tree.buildPar(volume.rocks);
+}
+
+void updateVolumeGravitySystem(World& world, float timestep)
+{
+    profile::Scope zone {"gravity"};
+    util::Stopwatch watch;
+    withWalkPolicy<3, false>(world, [&world, timestep](auto policy) {
+        kickRocks<decltype(policy)>(world, world.volume.rocks, timestep);
+    });
+    world.gravityStats = {};
+    collectGravityStats(world);
+    world.thetaControl.lastMs = static_cast<float>(watch.elapsed());
+}
+
+void updateVolumeCollisionSystem(World& world, float timestep)
 {
-    sf::CircleShape circle;
-    circle.setRadius(rock.radius);
-    circle.setOrigin(rock.radius, rock.radius);
-    circle.setPosition({rock.pos.x, -rock.pos.y});
-    return circle;
+    findBodyCollisions<3>(world, timestep);
+    resolveBodyCollisions<3>(world);
 }
 
-void draw(const World& world)
+void updateVolumePositionSystem(World& world, float timestep)
 {
-    for (auto& shape : world.shapes) {
-        world.window->draw(shape);
+    profile::Scope zone {"position"};
+    std::vector<Rock3>& rocks = world.volume.rocks;
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, rocks.size(), 4096), [&rocks, timestep](const auto& range) {
+        for (size_t i = range.begin(); i != range.end(); ++i) rocks[i].pos += rocks[i].vel * timestep;
+    });
+    projectVolume(world);
+    // not updateTreeSystem, reordering world.rocks would lose their match with the volume
+    Tree& tree = world.rootTree;
+    tree.leafSize = world.leafSize;
+    if (world.rocks.empty()) {
+        tree.reset(world.worldExtent);
+        return;
     }
+    RootSquare square = fitRootSquare(world.rocks);
+    tree.reset(square.min.x, square.min.y, square.width);
+    tree.buildPar(world.rocks);
 }
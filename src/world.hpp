@@ -1,60 +1,265 @@
 #pragma once
 
+#include <compare>
 #include <SFML/Graphics.hpp>
 #include <SFML/System.hpp>
+#include "grid.hpp"
 #include "rock.hpp"
 #include "tree.hpp"
-#include <concurrentqueue/concurrentqueue.h>
+#include <oneapi/tbb/enumerable_thread_specific.h>
 
 //
 // Simulation World that holds Entities and Config
 //
 
-using CollidingPair = std::pair<Rock*,Rock*>;
-using Queue = moodycamel::ConcurrentQueue<CollidingPair>;
+/// Rocks that touch within the step, sorted by time then address
+template <int Dim>
+struct BasicCollidingPair {
+    float time {0.0f}; // into the step, 0 for rocks already touching
+    Body<Dim>* first {nullptr}; // lower address first
+    Body<Dim>* second {nullptr};
+
+    auto operator<=>(const BasicCollidingPair&) const = default;
+};
+
+/// Collisions found in a frame and the order they are resolved in
+/// Pairs are sorted so results don't depend on threads, then split into batches
+/// where no rock is in two pairs, so a batch can be resolved in parallel
+template <int Dim>
+struct BasicCollisions {
+    using Pair = BasicCollidingPair<Dim>;
+
+    tbb::enumerable_thread_specific<std::vector<Pair>> found; // per thread, no locks
+    std::vector<Pair> pairs; // sorted
+    std::vector<Pair> batched; // pairs grouped by batch, same order within a batch
+    std::vector<uint32_t> batchStart; // batch b is batched [batchStart[b], batchStart[b + 1])
+    std::vector<uint32_t> pairBatch; // scratch
+    std::vector<uint32_t> rockBatch; // scratch, first batch each rock is free in
+    std::vector<float> nodeReach; // scratch, per tree node max_radius plus farthest move
+    float sweep {0.0f}; // step the pairs were found over, 0 without sweptCollisions
+    std::vector<uint8_t> mergedAway; // scratch, per rock, set once merged into another
+    std::vector<Body<Dim>> compacted; // scratch, rocks left after merging, swapped with rocks
+    std::vector<sf::Vector2f> compactedAccels; // scratch, same for block step accels (plane only)
+    size_t merged {0}; // rocks removed by the last resolve
+};
+
+using CollidingPair = BasicCollidingPair<2>;
+using Collisions = BasicCollisions<2>;
+
+/// Multipole order used for tree nodes far enough away (see theta)
+enum class Expansion { Monopole, Quadrupole };
+
+/// How collision candidates are found
+enum class Broadphase { Tree, Grid };
+
+/// Work done by the last gravity update
+struct GravityStats {
+    size_t nodeVisits {0};
+    size_t farInteractions {0};  // nodes used as a whole
+    size_t nearInteractions {0};  // single rocks
+};
+
+/// Per rock state for hierarchical block timesteps, same index as rocks
+/// A rock on rung r steps delta / 2^r and only gets gravity at the ends of its steps
+/// Within an update rocks and tree nodes aren't moved each substep, they are read at
+/// pos + vel * time (see updateBlockStepSystem)
+struct BlockSteps {
+    std::vector<sf::Vector2f> accels; // accel at the start of each rock's current step
+    std::vector<uint8_t> rungs;
+    std::vector<std::vector<uint32_t>> rungRocks; // scratch, rocks on each rung
+    std::vector<uint32_t> active; // scratch
+    std::vector<sf::Vector2f> kicks; // scratch, velocity change of each active rock
+    std::vector<sf::Vector2f> nodeVels; // scratch, mass weighted velocity of each tree node
+    std::vector<int32_t> parents; // scratch, parent of each tree node, -1 for the root
+    std::vector<int32_t> leaves; // scratch, leaf holding each rock, -1 outside the root
+    float time {0.0f}; // into the update, what positions are read at
+    std::vector<size_t> rungCounts; // rocks per rung at the start of the last update
+    size_t evaluations {0}; // gravity evaluations in the last update
+    size_t nodeMoves {0}; // node totals moved for kicked rocks in the last update
+};
+
+/// Moves theta each frame to keep the gravity phase near targetMs, within bounds
+/// Over budget at thetaMax with block timesteps, maxRung is lowered as well
+struct ThetaControl {
+    bool enabled {false};
+    float targetMs {8.0f};
+    float thetaMin {0.3f}; // accuracy bounds
+    float thetaMax {1.0f};
+    int rungFloor {2}; // maxRung isn't lowered below this
+    float lastMs {0.0f}; // last gravity phase, set by the gravity systems
+    float gravityMs {0.0f}; // smoothed
+    float error {0.0f}; // smoothed relative accel error of sampled rocks at theta
+    int savedMaxRung {-1}; // maxRung before it was lowered, -1 when it wasn't
+    uint64_t frame {0}; // seeds which rocks are sampled
+};
+
+/// Scratch for putting rocks in Morton order (see World::reorderEvery)
+struct Reorder {
+    std::vector<uint64_t> keys; // Morton key above rock index
+    std::vector<uint64_t> sortScratch;
+    std::vector<Rock> rocks; // swapped with world.rocks
+    std::vector<sf::Vector2f> accels; // same for block step accels
+    uint64_t treeUpdates {0};
+    size_t count {0}; // times rocks were reordered
+};
+
+/// Rocks in space for World::threeD, stepped with the same tree, gravity walk and
+/// collision code as the plane's, in an octree
+struct Volume {
+    std::vector<Rock3> rocks;
+    Octree tree;
+    BasicCollisions<3> collisions;
+};
 
 struct World {
     std::vector<Rock> rocks;  // abstract objects in world
-    std::vector<sf::CircleShape> shapes;  // screen object cache
     sf::RenderWindow* window;
     float gravity {6.67408e-2f};
     bool ignoreShortDistGrav {true};
     float theta {0.5f}; // ratio of node size to dist to use node totals
+    Expansion expansion {Expansion::Monopole};
+    Broadphase broadphase {Broadphase::Tree};
+    bool sweptCollisions {true}; // find rocks that meet during the step, not only ones touching
+    bool mergeCollisions {false}; // colliding rocks merge into one instead of bouncing
+    bool fusedTraversal {false}; // one tree walk for gravity and collision finding
+    bool incrementalTree {true}; // only move rocks that left their leaf, rebuild when needed
+    int leafSize {16}; // rocks per tree leaf, each leaf walks the tree once for gravity
+    bool blockTimesteps {false}; // use updateBlockStepSystem instead of gravity + position
+    int maxRung {6}; // smallest step is delta / 2^maxRung
+    float timestepAccuracy {0.1f}; // eta, step <= eta * sqrt(radius / |accel|)
     float velColorExtent {20.0f};  // Vel for full red color
-    float worldExtent {1000.0f};  // Max extent of world +/-
-    TreeNode rootTree;
-    Queue collisions;
+    bool fitRoot {true}; // fit the tree root to the rocks each frame
+    float worldExtent {1000.0f};  // Max extent of world +/-, the tree root without fitRoot
+    int reorderEvery {0}; // sort rocks into Morton order every this many tree updates, 0 never
+    int domainWorkers {0}; // > 0 steps split across this many worker processes, see DomainSim
+    uint32_t nextRockId {0}; // id for the next rock added
+    bool threeD {false}; // rocks live in volume, world.rocks is their x-y projection, see setThreeD
+    Tree rootTree;
+    CollisionGrid grid;
+    Collisions collisions;
+    GravityStats gravityStats;
+    BlockSteps blockSteps;
+    ThetaControl thetaControl;
+    std::vector<sf::Vector2f> fusedKicks; // velocity changes held back by the fused walk, until resolved
+    Reorder reorder;
+    Volume volume;
 
     explicit World(sf::RenderWindow* window)
-        : window {window}, rootTree {TreeNode(worldExtent)}, collisions {10000} {};
+        : window {window}, rootTree {worldExtent}, volume {.tree = Octree {worldExtent}} {};
+};
+
+/// Square around the rocks a fitted tree root uses (see fitRoot)
+struct RootSquare {
+    sf::Vector2f min {0.0f, 0.0f};
+    float width {0.0f};
 };
 
+/// The padded square around rocks updateTreeSystem fits the root to, found in parallel
+RootSquare fitRootSquare(const std::vector<Rock>& rocks);
+
+/// Sorts world.rocks (and block step accels) by the Morton key of their position in
+/// square, with a parallel radix sort. Ties keep their order so the result doesn't
+/// depend on threads. The tree is stale afterwards
+void reorderRocks(World& world, RootSquare square);
+
+/// Adds rock with the next id, in threeD at z = 0
 void addRock(World& world, Rock rock);
 
+/// Appends numRocks laid out by generateRocks, reproducible from rockConfig.seed
+/// In threeD they are generated in space and projected
 void addRandomRocks(World& world, size_t numRocks, RockConfig rockConfig);
 
 void addSatRocks(World& world);
 
+/// Removes every rock, ids start again from 0
 void deleteAllRocks(World& world);
 
+/// Replaces world.volume's rocks with world.rocks at z = 0, for rocks set in the plane
+/// (like a loaded snapshot) while threeD
+void liftRocks(World& world);
+
+/// Switches between the plane and space. Rocks carry over, lifted to z = 0 going to
+/// 3d and left as their projection going back
+void setThreeD(World& world, bool threeD);
+
 //
 // Entity Systems
 //
 
+/// Builds rootTree, or with incrementalTree just moves the rocks that left their leaf
+/// With fitRoot the root is a square around all rocks (found by a parallel reduce),
+/// padded so rebuilds are only needed once rocks leave it or it is far too big
+/// Every reorderEvery calls the rocks (and block step accels) are first sorted by
+/// the Morton key of their position in the root, so rocks near in space are near in
+/// memory, and the tree is rebuilt. Rock indices and addresses change, ids don't
 void updateTreeSystem(World& world);
 
-void updateCollisionSystemPar(World& world);
+/// Collects colliding pairs into world.collisions.found using world.broadphase
+/// With sweptCollisions pairs are rocks that meet within timestep moving at their
+/// velocities (so fast rocks can't pass through each other), found by growing the
+/// broadphase bounds by how far rocks move. Otherwise only rocks touching now
+void findCollisions(World& world, float timestep);
+
+/// Resolves found pairs in sorted order, with pairs that share no rock run in parallel
+/// Each pair goes in the batch after the last one holding either of its rocks,
+/// so every rock sees its collisions in the same order as a serial loop would
+/// Swept pairs bounce at their time of impact, and are checked again first since an
+/// earlier bounce may have turned one of the rocks away
+/// With mergeCollisions the higher address rock of a pair is merged into the other
+/// (pairs holding an already merged rock are skipped), then the rocks left are packed
+/// to the front of world.rocks in order and the tree is rebuilt in its current root, as
+/// its pointers and the found pairs' are stale. Per rock block step state is packed
+/// along with them. The rebuild isn't a tree update, so it never reorders the rocks
+/// Kicks held back by updateGravityCollisionSystem are added after the pairs
+void resolveCollisions(World& world);
 
+/// findCollisions then resolveCollisions, run before positions move by timestep
+void updateCollisionSystemPar(World& world, float timestep);
+
+/// Walks the tree once per leaf, the leaf's rocks share what the walk collected
 void updateGravitySystemTree(World& world, float timestep);
 
+/// updateGravitySystemTree and findCollisions in one walk per leaf, for fusedTraversal
+/// Leaves within collision reach of the leaf's rocks are checked for pairs where the
+/// walk reads them, or below the nodes theta uses whole, which gravity doesn't open
+/// Pairs are found with the velocities from before the gravity kick, which is held in
+/// fusedKicks until resolveCollisions (which must run next) has resolved the pairs with
+/// those velocities, so the step collides then kicks. Falls back to the two systems
+/// (kick then collide) with the grid broadphase or rocks outside the root
+void updateGravityCollisionSystem(World& world, float timestep);
+
 void updateRockPositionSystem(World& world, float timeStep);
 
-void updateShapeSystem(World& world);
+/// Estimates the force error at theta and, with thetaControl.enabled, adjusts theta
+/// (and maxRung) from the last gravity phase's time. Run after gravity
+void updateThetaSystem(World& world);
+
+/// Replaces the gravity and position systems when world.blockTimesteps is set
+/// Kick-drift-kick leapfrog where each rock steps on its own power of two rung.
+/// Nothing is drifted between substeps: a rock's position is pos + vel * time (pos
+/// is shifted back when it is kicked so that stays true), and node centers move at
+/// their mass weighted velocity, so a substep only updates the nodes above the rocks
+/// it kicked. Quadrupoles keep the shape from the start. Needs a fresh tree, and
+/// leaves its centers at the end positions.
+void updateBlockStepSystem(World& world, float delta);
 
 //
-// Visualization
+// 3D Systems - used instead of the ones above while world.threeD
+// Block timesteps, the grid broadphase, the fused walk, reordering and domains are
+// plane only
 //
 
-sf::CircleShape shapeFor(const Rock& rock);
+/// Builds the volume's octree around its rocks (always fitted), or with
+/// incrementalTree just moves the rocks that left their leaf
+void updateVolumeTreeSystem(World& world);
+
+/// Same per leaf walk as updateGravitySystemTree, over the octree
+void updateVolumeGravitySystem(World& world, float timestep);
+
+/// findCollisions then resolveCollisions for the volume's rocks, always with the
+/// octree as broadphase. Merges rebuild the octree in its current root
+void updateVolumeCollisionSystem(World& world, float timestep);
 
-void draw(const World& world);
+/// Moves the volume's rocks, then projects them into world.rocks and builds
+/// rootTree over the projection for drawing
+void updateVolumePositionSystem(World& world, float timestep);
@@ -1,7 +1,48 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include <algorithm>
+#include <array>
 #include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <random>
 #include <doctest/doctest.h>
+#include "../src/domain.hpp"
+#include "../src/grid.hpp"
+#include "../src/kernel.hpp"
+#include "../src/order.hpp"
+#include "../src/pipeline.hpp"
+#include "../src/generate.hpp"
+#include "../src/profile.hpp"
+#include "../src/render.hpp"
+#include "../src/runner.hpp"
+#include "../src/snapshot.hpp"
 #include "../src/tree.hpp"
+#include "../src/util.h"
+#include "../src/world.hpp"
+
+namespace {
+
+/// n rocks uniform in +/- posExtent with velocities uniform in +/- velExtent (at rest
+/// for 0), radius uniform in [rMin, rMax) and mass radius^3, the same for a seed
+std::vector<Rock> randomRocks(uint32_t seed, size_t n, float posExtent, float velExtent, float rMin, float rMax) {
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<float> pos(-posExtent, posExtent);
+    std::uniform_real_distribution<float> vel(-velExtent, velExtent);
+    std::uniform_real_distribution<float> radius(rMin, rMax);
+    std::vector<Rock> rocks(n);
+    for (Rock& rock : rocks) {
+        rock.pos = {pos(gen), pos(gen)};
+        if (velExtent > 0.0f) rock.vel = {vel(gen), vel(gen)};
+        rock.radius = radius(gen);
+        rock.mass = rock.radius * rock.radius * rock.radius;
+    }
+    return rocks;
+}
+
+}  // namespace
 
 TEST_CASE("vectors can be sized and resized") {
     std::vector<int> v(5);
@@ -24,40 +65,1291 @@ TEST_CASE("vectors can be sized and resized") {
 }
 
 TEST_CASE("Tree Tests") {
-    TreeNode t(0.0, 1.0, 0.0, 1.0);
-    REQUIRE(!t.element);
-    REQUIRE(!t.hasChildren());
+    Tree t(0.0, 0.0, 1.0);
+    t.leafSize = 1;
+    REQUIRE(t.elements(0).empty());
+    REQUIRE(!t.root().hasChildren());
     Rock r = Rock {.pos = {0.1, 0.1}, .radius = 2.0f, .mass = 8.0f};
     t.insert(&r);
-    REQUIRE(t.element == &r);
-    REQUIRE(!t.hasChildren());
-    REQUIRE(t.total_mass == r.mass);
-    REQUIRE(t.center_mass == r.pos);
-    REQUIRE(t.max_radius == r.radius);
+    REQUIRE(t.elements(0).size() == 1);
+    REQUIRE(t.elements(0)[0] == &r);
+    REQUIRE(!t.root().hasChildren());
+    REQUIRE(t.root().total_mass == r.mass);
+    REQUIRE(t.root().center_mass == r.pos);
+    REQUIRE(t.root().max_radius == r.radius);
     Rock r2 = Rock {.pos = {0.6, 0.6}, .radius = 4.0f, .mass = 64.0f};
     t.insert(&r2);
-    REQUIRE(t.element == nullptr);
-    REQUIRE(t.hasChildren());
-    TreeNode* r_node = t.getChild(r.pos);
-    TreeNode* r2_node = t.getChild(r2.pos);
-    REQUIRE(r_node != r2_node);
-    REQUIRE(r_node != &t);
-    REQUIRE(r_node->element == &r);
-    REQUIRE(t.max_radius == 4.0f);
-    REQUIRE(!r_node->hasChildren());
-    REQUIRE(r2_node->element == &r2);
-    REQUIRE(!r2_node->hasChildren());
-    REQUIRE(r2_node->total_mass == r2.mass);
-    REQUIRE(r2_node->center_mass == r2.pos);
-    TreeNode* r3_node = t.getChild({0.2, 0.6});
-    REQUIRE(r3_node->element == nullptr);
-    REQUIRE(!r3_node->hasChildren());
+    REQUIRE(t.elements(0).empty());
+    REQUIRE(t.root().hasChildren());
+    int32_t r_index = t.getChild(0, r.pos);
+    int32_t r2_index = t.getChild(0, r2.pos);
+    REQUIRE(r_index != r2_index);
+    REQUIRE(r_index > 0);
+    const TreeNode& r_node = t.nodes[r_index];
+    const TreeNode& r2_node = t.nodes[r2_index];
+    REQUIRE(t.elements(r_index)[0] == &r);
+    REQUIRE(t.root().max_radius == 4.0f);
+    REQUIRE(!r_node.hasChildren());
+    REQUIRE(t.elements(r2_index)[0] == &r2);
+    REQUIRE(!r2_node.hasChildren());
+    REQUIRE(r2_node.total_mass == r2.mass);
+    REQUIRE(r2_node.center_mass == r2.pos);
+    REQUIRE(r2_node.width == 0.5f);
+    REQUIRE(t.left(r2_index) == 0.5f);
+    REQUIRE(t.bottom(r2_index) == 0.5f);
+    int32_t r3_index = t.getChild(0, {0.2, 0.6});
+    const TreeNode& r3_node = t.nodes[r3_index];
+    REQUIRE(t.elements(r3_index).empty());
+    REQUIRE(!r3_node.hasChildren());
     float total_mass = r.mass + r2.mass;
-    REQUIRE(fabs(t.total_mass - total_mass) < 0.001);
+    REQUIRE(fabs(t.root().total_mass - total_mass) < 0.001);
     sf::Vector2f com = (r.mass/total_mass) * r.pos + (r2.mass/total_mass) * r2.pos;
-    REQUIRE(fabs(t.center_mass.x - com.x) < 0.001);
+    REQUIRE(fabs(t.root().center_mass.x - com.x) < 0.001);
     // Test when rocks are directly on top of each other
     // Rock r4 {.pos = {0.1, 0.1}, .radius = 2.0f};
     // auto r4_node = t.insert(&r4);
-    // REQUIRE(r4_node->element == &r4);
+    // REQUIRE(t.elements(r4_index)[0] == &r4);
+}
+
+TEST_CASE("Tree storage is reused") {
+    Tree t(1.0f);
+    t.leafSize = 1;
+    Rock r = Rock {.pos = {0.1, 0.1}, .radius = 1.0f, .mass = 1.0f};
+    Rock r2 = Rock {.pos = {-0.1, 0.1}, .radius = 1.0f, .mass = 1.0f};
+    Rock outside = Rock {.pos = {5.0, 0.1}, .radius = 1.0f, .mass = 1.0f};
+    t.insert(&r);
+    t.insert(&r2);
+    t.insert(&outside);
+    REQUIRE(t.nodes.size() == 5);
+    REQUIRE(t.root().total_mass == 2.0f);
+    const TreeNode* storage = t.nodes.data();
+    t.reset(1.0f);
+    REQUIRE(t.nodes.size() == 1);
+    REQUIRE(t.nodes.data() == storage);
+    REQUIRE(!t.root().hasChildren());
+    REQUIRE(t.root().total_mass == 0.0f);
+}
+
+namespace {
+
+void requireSameTree(const Tree& a, int32_t ai, const Tree& b, int32_t bi) {
+    const TreeNode& an = a.nodes[ai];
+    const TreeNode& bn = b.nodes[bi];
+    std::vector<Rock*> a_elements(a.elements(ai).begin(), a.elements(ai).end());
+    std::vector<Rock*> b_elements(b.elements(bi).begin(), b.elements(bi).end());
+    std::sort(a_elements.begin(), a_elements.end());
+    std::sort(b_elements.begin(), b_elements.end());
+    REQUIRE(a_elements == b_elements);
+    REQUIRE(an.hasChildren() == bn.hasChildren());
+    REQUIRE(an.width == bn.width);
+    REQUIRE(a.left(ai) == b.left(bi));
+    REQUIRE(a.bottom(ai) == b.bottom(bi));
+    REQUIRE(an.max_radius == bn.max_radius);
+    REQUIRE(fabs(an.total_mass - bn.total_mass) <= 1e-4f * an.total_mass);
+    REQUIRE(fabs(an.center_mass.x - bn.center_mass.x) < 1e-3f);
+    REQUIRE(fabs(an.center_mass.y - bn.center_mass.y) < 1e-3f);
+    if (an.hasChildren()) {
+        for (int32_t q = 0; q < Tree::fanout; ++q) {
+            requireSameTree(a, an.children + q, b, bn.children + q);
+        }
+    }
+}
+
+}  // namespace
+
+TEST_CASE("Parallel tree build matches serial inserts") {
+    // more rocks than one split block, so the top levels scatter from several blocks
+    std::vector<Rock> rocks = randomRocks(7, 3 * Tree::splitBlock, 90.0f, 0.0f, 1.0f, 6.0f);
+    rocks[0].pos = {150.0f, 0.0f}; // outside root is left out by both
+    Tree serial(100.0f);
+    for (auto& rock : rocks) serial.insert(&rock);
+    Tree parallel(100.0f);
+    parallel.buildPar(rocks);
+    REQUIRE(parallel.nodes.size() == serial.nodes.size());
+    requireSameTree(serial, 0, parallel, 0);
+    // leaves hold their rocks in insert order, as serial inserts do
+    for (size_t i = 0; i < parallel.nodes.size(); ++i) {
+        auto leaf = parallel.elements(static_cast<int32_t>(i));
+        REQUIRE(std::is_sorted(leaf.begin(), leaf.end()));
+    }
+}
+
+TEST_CASE("Tree update matches a fresh build") {
+    std::vector<Rock> rocks = randomRocks(11, 20000, 90.0f, 0.0f, 1.0f, 6.0f);
+    std::mt19937 gen(12);
+    std::uniform_real_distribution<float> pos(-90.0f, 90.0f);
+    std::uniform_real_distribution<float> step(-0.05f, 0.05f);
+    Tree tree(100.0f);
+    tree.buildPar(rocks);
+    for (int frame = 0; frame < 5; ++frame) {
+        for (auto& rock : rocks) rock.pos += sf::Vector2f(step(gen), step(gen));
+        if (frame == 2) rocks[1].pos = {150.0f, 0.0f}; // leaving the root is fine
+        REQUIRE(tree.update(rocks));
+        REQUIRE(tree.moved > 0);
+        REQUIRE(tree.builds == 1);
+        Tree fresh(100.0f);
+        fresh.buildPar(rocks);
+        requireSameTree(fresh, 0, tree, 0);
+    }
+
+    rocks[1].pos = {0.5f, 0.5f}; // coming back in needs a build
+    REQUIRE(!tree.update(rocks));
+    tree.reset(100.0f);
+    tree.buildPar(rocks);
+    for (auto& rock : rocks) rock.pos = {pos(gen), pos(gen)}; // everything moved
+    REQUIRE(!tree.update(rocks));
+    std::vector<Rock> other = rocks;
+    tree.reset(100.0f);
+    tree.buildPar(rocks);
+    REQUIRE(!tree.update(other));
+}
+
+namespace {
+
+/// Rocks below node, checking that only nodes with more than leafSize have children
+size_t requireLeafSizes(const Tree& t, int32_t index) {
+    const TreeNode& node = t.nodes[index];
+    if (!node.hasChildren()) {
+        REQUIRE(node.count <= t.leafSize);
+        return node.count;
+    }
+    size_t count = 0;
+    for (int32_t q = 0; q < Tree::fanout; ++q) count += requireLeafSizes(t, node.children + q);
+    REQUIRE(count > static_cast<size_t>(t.leafSize));
+    return count;
+}
+
+}  // namespace
+
+TEST_CASE("Leaves hold up to leafSize rocks") {
+    std::mt19937 gen(12);
+    std::normal_distribution<float> pos(0.0f, 20.0f);
+    std::vector<Rock> rocks(5000);
+    for (auto& rock : rocks) {
+        rock.pos = {pos(gen), pos(gen)};
+        rock.radius = 1.0f;
+        rock.mass = 1.0f;
+    }
+    for (int32_t leaf_size : {1, 3, 8, 32}) {
+        Tree t(100.0f);
+        t.leafSize = leaf_size;
+        t.buildPar(rocks);
+        REQUIRE(requireLeafSizes(t, 0) == rocks.size());
+        REQUIRE(t.size() == rocks.size());
+    }
+}
+
+TEST_CASE("Leaf group gravity is as accurate as walking per rock") {
+    World world(nullptr);
+    world.ignoreShortDistGrav = false;
+    world.rocks = randomRocks(13, 4000, 300.0f, 0.0f, 1.0f, 3.0f);
+    std::vector<sf::Vector2<double>> direct(world.rocks.size());
+    for (size_t i = 0; i < world.rocks.size(); ++i) {
+        for (size_t j = 0; j < world.rocks.size(); ++j) {
+            if (i == j) continue;
+            double dx = world.rocks[j].pos.x - world.rocks[i].pos.x;
+            double dy = world.rocks[j].pos.y - world.rocks[i].pos.y;
+            double dist = std::sqrt(dx * dx + dy * dy);
+            double s = world.gravity * world.rocks[j].mass / (dist * dist * dist);
+            direct[i] += {dx * s, dy * s};
+        }
+    }
+    auto meanError = [&](int leaf_size) {
+        World copy(nullptr);
+        copy.rocks = world.rocks;
+        copy.ignoreShortDistGrav = false;
+        copy.leafSize = leaf_size;
+        updateTreeSystem(copy);
+        updateGravitySystemTree(copy, 1.0f);  // velocities start at 0, so vel = accel
+        double error = 0.0;
+        for (size_t i = 0; i < copy.rocks.size(); ++i) {
+            sf::Vector2<double> acc(copy.rocks[i].vel.x, copy.rocks[i].vel.y);
+            error += std::hypot(acc.x - direct[i].x, acc.y - direct[i].y) / std::hypot(direct[i].x, direct[i].y);
+        }
+        return error / copy.rocks.size();
+    };
+    double single = meanError(1);
+    double grouped = meanError(8);
+    CHECK(single < 0.02);
+    CHECK(grouped <= single);
+}
+
+TEST_CASE("Batched gravity kernel matches direct sum") {
+    std::mt19937 gen(11);
+    std::uniform_real_distribution<float> pos(-50.0f, 50.0f);
+    std::uniform_real_distribution<float> radius(1.0f, 6.0f);
+    SourceBatch batch;
+    for (int i = 0; i < 37; ++i) {  // not a multiple of the simd width
+        batch.add({pos(gen), pos(gen)}, radius(gen) * 10.0f, radius(gen));
+    }
+    sf::Vector2f at {1.0f, 2.0f};
+    batch.add(at, 1000.0f, 1.0f);  // on top of rock, always skipped
+    batch.add({at.x + 3.0f, at.y}, 1000.0f, 2.0f);  // overlaps rock of radius 2
+    for (bool checkRadius : {false, true}) {
+        double ax = 0.0;
+        double ay = 0.0;
+        for (size_t i = 0; i < 37; ++i) {
+            double dx = batch.coord[0][i] - at.x;
+            double dy = batch.coord[1][i] - at.y;
+            double dist = std::sqrt(dx * dx + dy * dy);
+            if (checkRadius && dist < 2.0 + batch.radius[i]) continue;
+            ax += batch.mass[i] * dx / (dist * dist * dist);
+            ay += batch.mass[i] * dy / (dist * dist * dist);
+        }
+        if (!checkRadius) ax += 1000.0 / 9.0;
+        sf::Vector2f acc = batchAccel(batch, at, 2.0f, checkRadius);
+        CHECK(fabs(acc.x - ax) < 1e-4 * (1.0 + fabs(ax)));
+        CHECK(fabs(acc.y - ay) < 1e-4 * (1.0 + fabs(ay)));
+    }
+}
+
+TEST_CASE("Quadrupole moments improve far field") {
+    std::vector<Rock> rocks {
+        Rock {.pos = {1.0, 1.0}, .radius = 1.0f, .mass = 5.0f},
+        Rock {.pos = {-2.0, 0.5}, .radius = 1.0f, .mass = 3.0f},
+        Rock {.pos = {0.5, -1.5}, .radius = 1.0f, .mass = 8.0f},
+        Rock {.pos = {-0.5, -0.25}, .radius = 1.0f, .mass = 2.0f},
+    };
+    Tree t(4.0f);
+    t.buildPar(rocks);
+    const TreeNode& root = t.root();
+    double xx = 0.0, xy = 0.0, yy = 0.0;
+    for (auto& rock : rocks) {
+        double dx = rock.pos.x - root.center_mass.x;
+        double dy = rock.pos.y - root.center_mass.y;
+        xx += rock.mass * (3.0 * dx * dx - (dx * dx + dy * dy));
+        xy += rock.mass * 3.0 * dx * dy;
+        yy += rock.mass * (3.0 * dy * dy - (dx * dx + dy * dy));
+    }
+    REQUIRE(fabs(root.quad[0] - xx) < 1e-3);
+    REQUIRE(fabs(root.quad[1] - xy) < 1e-3);
+    REQUIRE(fabs(root.quad[2] - yy) < 1e-3);
+
+    // from a distance the quadrupole is much closer to the direct sum than the monopole
+    sf::Vector2f at {90.0f, 60.0f};
+    double ax = 0.0, ay = 0.0;
+    for (auto& rock : rocks) {
+        double dx = rock.pos.x - at.x;
+        double dy = rock.pos.y - at.y;
+        double dist = std::sqrt(dx * dx + dy * dy);
+        ax += rock.mass * dx / (dist * dist * dist);
+        ay += rock.mass * dy / (dist * dist * dist);
+    }
+    SourceBatch mono;
+    mono.add(root.center_mass, root.total_mass, 0.0f);
+    QuadrupoleBatch quad;
+    quad.add(root.center_mass, root.total_mass, root.quad);
+    sf::Vector2f mono_acc = batchAccel(mono, at, 1.0f, false);
+    sf::Vector2f quad_acc = quadrupoleAccel(quad, at);
+    double mono_err = std::hypot(mono_acc.x - ax, mono_acc.y - ay);
+    double quad_err = std::hypot(quad_acc.x - ax, quad_acc.y - ay);
+    CHECK(quad_err < 0.2 * mono_err);
+}
+
+TEST_CASE("Grid broadphase finds the same collisions as checking every pair") {
+    std::vector<Rock> rocks = randomRocks(5, 3000, 100.0f, 10.0f, 1.0f, 6.0f);
+    rocks[0].radius = 10.0f;  // like mouse placed rocks
+    rocks[1].radius = 10.0f;
+    rocks[2].radius = 40.0f;
+    rocks[1].pos = rocks[0].pos + sf::Vector2f(15.0f, 0.0f);
+    rocks[1].vel = -rocks[0].vel;
+
+    std::vector<std::pair<Rock*, Rock*>> expected;
+    util::for_distinct_pairs(rocks, [&](Rock& a, Rock& b) {
+        if (isColliding(a, b)) expected.emplace_back(std::min(&a, &b), std::max(&a, &b));
+    });
+    CollisionGrid grid;
+    grid.build(rocks);
+    REQUIRE(grid.entries.size() - grid.gridCount == 3);
+    std::mutex mutex;
+    std::vector<std::pair<Rock*, Rock*>> found;
+    grid.forEachCandidate([&](Rock* a, Rock* b) {
+        if (!isColliding(*a, *b)) return;
+        std::lock_guard lock(mutex);
+        found.emplace_back(std::min(a, b), std::max(a, b));
+    });
+    std::sort(expected.begin(), expected.end());
+    std::sort(found.begin(), found.end());
+    REQUIRE(!expected.empty());
+    REQUIRE(found == expected);
+}
+
+TEST_CASE("Grid cells of rocks far out stay in range") {
+    // the smallest cells, with rocks more than 2^31 cells from the origin
+    std::vector<Rock> rocks;
+    for (float x : {0.0f, 1e7f, -1e7f, 3e38f}) {
+        rocks.push_back(Rock {.pos = {x, -x}, .radius = 0.0005f, .mass = 1.0f});
+        rocks.push_back(Rock {.pos = {x, -x}, .radius = 0.0005f, .mass = 1.0f});
+    }
+    CollisionGrid grid;
+    grid.build(rocks);
+    REQUIRE(grid.cellSize == 0.001f);
+    REQUIRE(grid.gridCount == rocks.size());
+    std::vector<std::pair<Rock*, Rock*>> found;
+    std::mutex mutex;
+    grid.forEachCandidate([&](Rock* a, Rock* b) {
+        if (a->pos != b->pos) return; // at rest, so isColliding wouldn't take them
+        std::lock_guard lock(mutex);
+        found.emplace_back(std::min(a, b), std::max(a, b));
+    });
+    std::sort(found.begin(), found.end());
+    std::vector<std::pair<Rock*, Rock*>> expected;
+    for (size_t i = 0; i < rocks.size(); i += 2) expected.emplace_back(&rocks[i], &rocks[i + 1]);
+    REQUIRE(found == expected);
+}
+
+TEST_CASE("Collision batches resolve like a serial loop over sorted pairs") {
+    World world(nullptr);
+    world.rocks = randomRocks(9, 2000, 30.0f, 10.0f, 1.0f, 6.0f);  // dense, rocks in many pairs
+    std::vector<Rock> expected = world.rocks;
+    std::vector<std::pair<size_t, size_t>> pairs;
+    for (size_t i = 0; i < expected.size(); ++i) {
+        for (size_t j = i + 1; j < expected.size(); ++j) {
+            if (isColliding(expected[i], expected[j])) pairs.emplace_back(i, j);
+        }
+    }
+    for (auto [i, j] : pairs) updateForCollision(expected[i], expected[j]);
+
+    for (auto broadphase : {Broadphase::Tree, Broadphase::Grid}) {
+        World copy(nullptr);
+        copy.rocks = world.rocks;
+        copy.broadphase = broadphase;
+        copy.sweptCollisions = false;
+        updateTreeSystem(copy);
+        updateCollisionSystemPar(copy, 1.0f / 60.0f);
+        REQUIRE(copy.collisions.pairs.size() == pairs.size());
+        REQUIRE(copy.collisions.batchStart.size() > 2);
+        for (size_t i = 0; i < expected.size(); ++i) {
+            REQUIRE(copy.rocks[i].vel == expected[i].vel);
+        }
+    }
+}
+
+TEST_CASE("Swept collisions find every pair meeting within the step") {
+    World world(nullptr);
+    world.rocks = randomRocks(11, 2000, 200.0f, 600.0f, 1.0f, 6.0f);  // ~10 radii per step
+    world.rocks[0].radius = 30.0f;  // large for the grid
+    world.rocks[1].vel = {5000.0f, 0.0f};  // much faster than the rest
+    const float dt = 1.0f / 60.0f;
+
+    std::vector<std::pair<size_t, size_t>> expected;
+    for (size_t i = 0; i < world.rocks.size(); ++i) {
+        for (size_t j = i + 1; j < world.rocks.size(); ++j) {
+            if (timeOfImpact(world.rocks[i], world.rocks[j], dt)) expected.emplace_back(i, j);
+        }
+    }
+    for (auto broadphase : {Broadphase::Tree, Broadphase::Grid}) {
+        World copy(nullptr);
+        copy.rocks = world.rocks;
+        copy.broadphase = broadphase;
+        updateTreeSystem(copy);
+        findCollisions(copy, dt);
+        std::vector<std::pair<size_t, size_t>> found;
+        for (const auto& thread : copy.collisions.found) {
+            for (const CollidingPair& pair : thread) {
+                REQUIRE(pair.time >= 0.0f);
+                REQUIRE(pair.time <= dt);
+                found.emplace_back(pair.first - copy.rocks.data(), pair.second - copy.rocks.data());
+            }
+        }
+        std::sort(found.begin(), found.end());
+        REQUIRE(expected.size() > 100);
+        REQUIRE(found == expected);
+    }
+}
+
+TEST_CASE("Swept collisions stop fast rocks passing through each other") {
+    // 2 radii apart after 20 radii of motion each, a touching test never sees them meet
+    for (bool swept : {false, true}) {
+        World world(nullptr);
+        world.sweptCollisions = swept;
+        world.rocks.push_back(Rock {.pos = {-10.0f, 0.0f}, .vel = {1000.0f, 0.0f}, .radius = 1.0f, .mass = 1.0f});
+        world.rocks.push_back(Rock {.pos = {10.0f, 0.0f}, .vel = {-1000.0f, 0.0f}, .radius = 1.0f, .mass = 1.0f});
+        const float dt = 1.0f / 60.0f;
+        updateTreeSystem(world);
+        updateCollisionSystemPar(world, dt);
+        updateRockPositionSystem(world, dt);
+        if (!swept) {
+            REQUIRE(world.rocks[0].pos.x > world.rocks[1].pos.x);  // tunneled
+            continue;
+        }
+        // touch at 9ms, then 7.67ms back the way they came
+        REQUIRE(world.rocks[0].vel.x == -1000.0f);
+        REQUIRE(world.rocks[0].pos.x == doctest::Approx(-1.0f - 1000.0f * (dt - 0.009f)).epsilon(1e-4));
+        REQUIRE(world.rocks[1].pos.x == doctest::Approx(1.0f + 1000.0f * (dt - 0.009f)).epsilon(1e-4));
+    }
+}
+
+TEST_CASE("Merged rocks keep mass and momentum and the rest are packed in order") {
+    World world(nullptr);
+    world.mergeCollisions = true;
+    world.sweptCollisions = false;
+    world.rocks = randomRocks(13, 3000, 40.0f, 10.0f, 1.0f, 3.0f);
+
+    // serial loop over sorted pairs, skipping rocks already merged away
+    std::vector<Rock> expected = world.rocks;
+    std::vector<bool> gone(expected.size(), false);
+    std::vector<std::pair<size_t, size_t>> pairs;
+    for (size_t i = 0; i < expected.size(); ++i) {
+        for (size_t j = i + 1; j < expected.size(); ++j) {
+            if (isColliding(expected[i], expected[j])) pairs.emplace_back(i, j);
+        }
+    }
+    for (auto [i, j] : pairs) {
+        if (gone[i] || gone[j]) continue;
+        mergeRocks(expected[i], expected[j]);
+        gone[j] = true;
+    }
+    std::erase_if(expected, [&](const Rock& rock) { return gone[&rock - expected.data()]; });
+
+    auto totals = [](const std::vector<Rock>& rocks) {
+        double mass = 0.0, px = 0.0, py = 0.0;
+        for (const Rock& rock : rocks) {
+            mass += rock.mass;
+            px += rock.mass * rock.vel.x;
+            py += rock.mass * rock.vel.y;
+        }
+        return std::array {mass, px, py};
+    };
+    auto before = totals(world.rocks);
+    world.blockSteps.accels.assign(world.rocks.size(), {1.0f, 0.0f});
+    world.reorderEvery = 2;  // the rebuild after merging isn't the second tree update
+    updateTreeSystem(world);
+    updateCollisionSystemPar(world, 1.0f / 60.0f);
+    REQUIRE(world.reorder.count == 0);
+
+    REQUIRE(world.collisions.merged > 100);
+    REQUIRE(world.rocks.size() + world.collisions.merged == 3000);
+    REQUIRE(world.rocks.size() == expected.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+        REQUIRE(world.rocks[i].pos == expected[i].pos);
+        REQUIRE(world.rocks[i].vel == expected[i].vel);
+        REQUIRE(world.rocks[i].radius == expected[i].radius);
+    }
+    auto after = totals(world.rocks);
+    for (int k = 0; k < 3; ++k) REQUIRE(after[k] == doctest::Approx(before[k]).epsilon(1e-4));
+    REQUIRE(world.blockSteps.accels.size() == world.rocks.size());
+
+    // the tree was rebuilt over the packed rocks
+    const Tree& tree = world.rootTree;
+    REQUIRE(tree.size() == world.rocks.size());
+    for (int32_t i = 0; i < static_cast<int32_t>(tree.nodes.size()); ++i) {
+        for (const Rock* rock : tree.elements(i)) {
+            REQUIRE((rock >= world.rocks.data() && rock < world.rocks.data() + world.rocks.size()));
+        }
+    }
+}
+
+TEST_CASE("Fused walk finds the same pairs and gravity as the separate systems") {
+    World world(nullptr);
+    world.rocks = randomRocks(17, 4000, 150.0f, 300.0f, 1.0f, 4.0f);
+    world.rocks[0].radius = 25.0f;
+    world.rocks[1].mass = 0.0f;  // still collides
+    const float dt = 1.0f / 60.0f;
+
+    for (bool swept : {false, true}) {
+        auto sortedPairs = [](World& w) {
+            std::vector<std::pair<size_t, size_t>> pairs;
+            for (const auto& thread : w.collisions.found) {
+                for (const CollidingPair& pair : thread) {
+                    pairs.emplace_back(pair.first - w.rocks.data(), pair.second - w.rocks.data());
+                }
+            }
+            std::sort(pairs.begin(), pairs.end());
+            return pairs;
+        };
+        World separate(nullptr);
+        separate.rocks = world.rocks;
+        separate.sweptCollisions = swept;
+        updateTreeSystem(separate);
+        findCollisions(separate, dt);  // fused pairs are found before the kick
+        auto expected = sortedPairs(separate);
+        resolveCollisions(separate);
+        World kicked(nullptr);
+        kicked.rocks = world.rocks;
+        updateTreeSystem(kicked);
+        updateGravitySystemTree(kicked, dt);
+
+        World fused(nullptr);
+        fused.rocks = world.rocks;
+        fused.sweptCollisions = swept;
+        updateTreeSystem(fused);
+        updateGravityCollisionSystem(fused, dt);
+        REQUIRE(expected.size() > 50);
+        REQUIRE(sortedPairs(fused) == expected);
+        REQUIRE(fused.fusedKicks.size() == world.rocks.size());
+        for (size_t i = 0; i < world.rocks.size(); ++i) {
+            sf::Vector2f kick = kicked.rocks[i].vel - world.rocks[i].vel;
+            REQUIRE(fused.rocks[i].vel == world.rocks[i].vel);  // held back
+            REQUIRE(fused.fusedKicks[i].x == doctest::Approx(kick.x).epsilon(1e-4));
+            REQUIRE(fused.fusedKicks[i].y == doctest::Approx(kick.y).epsilon(1e-4));
+        }
+        // pairs are resolved with the velocities they were found with, then kicked
+        resolveCollisions(fused);
+        REQUIRE(fused.fusedKicks.empty());
+        for (size_t i = 0; i < world.rocks.size(); ++i) {
+            sf::Vector2f vel = separate.rocks[i].vel + kicked.rocks[i].vel - world.rocks[i].vel;
+            REQUIRE(fused.rocks[i].pos == separate.rocks[i].pos);
+            REQUIRE(fused.rocks[i].vel.x == doctest::Approx(vel.x).epsilon(1e-4));
+            REQUIRE(fused.rocks[i].vel.y == doctest::Approx(vel.y).epsilon(1e-4));
+        }
+    }
+
+    // merged rocks take both held kicks by mass, so momentum changes by the kicks' sum
+    World merged(nullptr);
+    merged.rocks = world.rocks;
+    merged.mergeCollisions = true;
+    updateTreeSystem(merged);
+    updateGravityCollisionSystem(merged, dt);
+    double expected[2] {0.0, 0.0};
+    for (size_t i = 0; i < world.rocks.size(); ++i) {
+        merged.fusedKicks[i] = {static_cast<float>(i % 7), -static_cast<float>(i % 5)};  // big enough to tell apart
+        sf::Vector2f vel = world.rocks[i].vel + merged.fusedKicks[i];
+        expected[0] += static_cast<double>(world.rocks[i].mass) * vel.x;
+        expected[1] += static_cast<double>(world.rocks[i].mass) * vel.y;
+    }
+    resolveCollisions(merged);
+    REQUIRE(merged.collisions.merged > 0);
+    double momentum[2] {0.0, 0.0};
+    for (const Rock& rock : merged.rocks) {
+        momentum[0] += static_cast<double>(rock.mass) * rock.vel.x;
+        momentum[1] += static_cast<double>(rock.mass) * rock.vel.y;
+    }
+    REQUIRE(momentum[0] == doctest::Approx(expected[0]).epsilon(1e-6));
+    REQUIRE(momentum[1] == doctest::Approx(expected[1]).epsilon(1e-6));
+}
+
+TEST_CASE("Block timesteps follow uniform fine steps with fewer evaluations") {
+    // heavy rock with close orbiters in a sparse field
+    auto makeWorld = [] {
+        World world(nullptr);
+        world.ignoreShortDistGrav = true;
+        world.rocks.push_back(Rock {.pos = {0.0f, 0.0f}, .vel = {0.0f, 0.0f}, .radius = 10.0f, .mass = 100000.0f});
+        std::mt19937 gen(8);
+        std::uniform_real_distribution<float> angle(0.0f, 6.2831853f);
+        std::uniform_real_distribution<float> dist(15.0f, 60.0f);
+        std::uniform_real_distribution<float> pos(-800.0f, 800.0f);
+        for (int i = 0; i < 200; ++i) {
+            float a = angle(gen);
+            float d = dist(gen);
+            float v = std::sqrt(world.gravity * 100000.0f / d);
+            world.rocks.push_back(Rock {.pos = {d * std::cos(a), d * std::sin(a)},
+                                        .vel = {-v * std::sin(a), v * std::cos(a)},
+                                        .radius = 1.0f, .mass = 1.0f});
+        }
+        while (world.rocks.size() < 1000) {
+            Rock rock {.pos = {pos(gen), pos(gen)}, .vel = {0.0f, 0.0f}, .radius = 2.0f, .mass = 8.0f};
+            if (std::hypot(rock.pos.x, rock.pos.y) > 100.0f) world.rocks.push_back(rock);
+        }
+        world.blockTimesteps = true;
+        return world;
+    };
+    const float delta = 0.2f;
+    World fine = makeWorld();
+    fine.maxRung = 0;
+    for (int i = 0; i < 64; ++i) {
+        updateTreeSystem(fine);
+        updateBlockStepSystem(fine, delta / 64);
+    }
+    World block = makeWorld();
+    block.maxRung = 6;
+    updateTreeSystem(block);
+    updateBlockStepSystem(block, delta);
+
+    REQUIRE(block.blockSteps.rungCounts.size() == 7);
+    REQUIRE(block.blockSteps.rungCounts[0] > 700);  // the sparse field needs one step
+    REQUIRE(block.blockSteps.evaluations < block.rocks.size() * 64 / 8);
+    for (size_t i = 1; i <= 200; ++i) {
+        REQUIRE(block.blockSteps.rungs[i] > 0);
+        sf::Vector2f diff = block.rocks[i].pos - fine.rocks[i].pos;
+        REQUIRE(std::hypot(diff.x, diff.y) < 0.1f);
+    }
+
+    // nodes moved along with the rocks instead of being refit each substep
+    REQUIRE(block.blockSteps.nodeMoves > 0);
+    sf::Vector2f center;
+    float mass = 0.0f;
+    for (const Rock& rock : block.rocks) {
+        center += rock.mass * rock.pos;
+        mass += rock.mass;
+    }
+    center /= mass;
+    CHECK(std::hypot(block.rootTree.root().center_mass.x - center.x, block.rootTree.root().center_mass.y - center.y) < 1e-3f);
+}
+
+TEST_CASE("Renderer puts a quad over each rock") {
+    World world(nullptr);
+    world.rocks.push_back(Rock {.pos = {10.0f, 20.0f}, .vel = {0.0f, 0.0f}, .radius = 2.0f});
+    world.rocks.push_back(Rock {.pos = {-5.0f, 0.0f}, .vel = {100.0f, 0.0f}, .radius = 1.0f});
+    updateTreeSystem(world);
+    Renderer renderer;
+    renderer.update(world, sf::View({0.0f, 0.0f}, {100.0f, 100.0f}), 0.1f);
+    REQUIRE(renderer.vertices.getVertexCount() == 12);
+    const sf::Vertex* quad = &renderer.vertices[0];
+    REQUIRE(quad[0].position == sf::Vector2f(8.0f, -22.0f));  // screen y is flipped
+    REQUIRE(quad[2].position == sf::Vector2f(12.0f, -18.0f));
+    REQUIRE(quad[2].texCoords == sf::Vector2f(Renderer::discSize, Renderer::discSize));
+    REQUIRE(quad[0].color == sf::Color(0, 0, 255));  // at rest
+    REQUIRE(renderer.vertices[6].color == sf::Color(255, 0, 0));  // past velColorExtent
+}
+
+TEST_CASE("Renderer skips rocks out of view and splats tiny nodes") {
+    World world(nullptr);
+    world.rocks = randomRocks(14, 20000, 500.0f, 0.0f, 0.5f, 2.0f);
+    world.rocks[0].pos = {1500.0f, 100.0f}; // outside the root but in view
+    updateTreeSystem(world);
+    Renderer renderer;
+
+    // zoomed in on world (250, 100) to (1750, 300), screen y is flipped
+    renderer.levelOfDetail = false;
+    renderer.update(world, sf::View({1000.0f, -200.0f}, {1500.0f, 200.0f}), 1.0f);
+    size_t in_view = std::count_if(world.rocks.begin(), world.rocks.end(), [](const Rock& rock) {
+        return rock.pos.x + rock.radius >= 250.0f && rock.pos.x - rock.radius <= 1750.0f
+            && rock.pos.y + rock.radius >= 100.0f && rock.pos.y - rock.radius <= 300.0f;
+    });
+    REQUIRE(renderer.rockCount == in_view);
+    REQUIRE(renderer.splatCount == 0);
+    REQUIRE(renderer.vertices.getVertexCount() == in_view * 6);
+
+    // zoomed out so the whole world is 100 pixels across
+    renderer.update(world, sf::View({0.0f, 0.0f}, {2000.0f, 2000.0f}), 20.0f);
+    REQUIRE(renderer.rockCount == world.rocks.size() - 1);
+    renderer.levelOfDetail = true;
+    renderer.update(world, sf::View({0.0f, 0.0f}, {2000.0f, 2000.0f}), 20.0f);
+    REQUIRE(renderer.splatCount > 0);
+    REQUIRE(renderer.rockCount + renderer.splatCount < world.rocks.size() / 4);
+    REQUIRE(renderer.vertices.getVertexCount() == (renderer.rockCount + renderer.splatCount) * 6);
+}
+
+TEST_CASE("Snapshots and trajectories load back the rocks that were saved") {
+    auto dir = std::filesystem::temp_directory_path();
+    std::string snapshot = (dir / "gravity_test_snapshot.grav").string();
+    std::string trajectory = (dir / "gravity_test_trajectory.grav").string();
+    World world(nullptr);
+    addRandomRocks(world, 5000, RockConfig {});
+    auto sameRocks = [](const World& a, const World& b) {
+        REQUIRE(a.rocks.size() == b.rocks.size());
+        for (size_t i = 0; i < a.rocks.size(); ++i) {
+            REQUIRE(a.rocks[i].pos == b.rocks[i].pos);
+            REQUIRE(a.rocks[i].vel == b.rocks[i].vel);
+            REQUIRE(a.rocks[i].radius == b.rocks[i].radius);
+            REQUIRE(a.rocks[i].mass == b.rocks[i].mass);
+            REQUIRE(a.rocks[i].id == b.rocks[i].id);
+        }
+    };
+
+    REQUIRE(saveSnapshot(world, snapshot, 7, 1.5));
+    World loaded(nullptr);
+    addRandomRocks(loaded, 10, RockConfig {});
+    auto header = loadSnapshot(loaded, snapshot);
+    REQUIRE(header);
+    REQUIRE(header->frame == 7);
+    REQUIRE(header->time == 1.5);
+    sameRocks(world, loaded);
+    REQUIRE(std::filesystem::file_size(snapshot) == sizeof(SnapshotHeader) + 5000 * 7 * sizeof(float));
+    REQUIRE_FALSE(loadSnapshot(loaded, snapshot, 1));
+    REQUIRE(loaded.nextRockId == 5000);
+
+    // version 1 files have no ids, rocks are numbered in file order
+    {
+        std::ofstream out(snapshot, std::ios::binary);
+        SnapshotHeader old {.version = 1, .columns = 6, .count = 2};
+        std::array<float, 12> columns {1.0f, 2.0f, 3.0f, 4.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 5.0f, 6.0f};
+        out.write(reinterpret_cast<const char*>(&old), sizeof(old));
+        out.write(reinterpret_cast<const char*>(columns.data()), sizeof(columns));
+    }
+    REQUIRE(loadSnapshot(loaded, snapshot));
+    REQUIRE(loaded.rocks.size() == 2);
+    REQUIRE(loaded.rocks[1].pos == sf::Vector2f(2.0f, 4.0f));
+    REQUIRE(loaded.rocks[1].mass == 6.0f);
+    REQUIRE(loaded.rocks[1].id == 1);
+    REQUIRE(loaded.nextRockId == 2);
+    REQUIRE(saveSnapshot(world, snapshot, 7, 1.5));
+
+    // every 3rd of 10 frames, with the rock count changing along the way
+    std::vector<World> kept;
+    {
+        TrajectoryWriter writer(trajectory, 3);
+        REQUIRE(writer.isOpen());
+        for (uint64_t frame = 0; frame < 10; ++frame) {
+            updateTreeSystem(world);
+            updateGravitySystemTree(world, 0.01f);
+            updateRockPositionSystem(world, 0.01f);
+            if (frame == 5) addRandomRocks(world, 100, RockConfig {});
+            writer.record(world, frame, frame * 0.01);
+            if (frame % 3 == 0) {
+                kept.emplace_back(nullptr);
+                kept.back().rocks = world.rocks;
+            }
+        }
+        writer.flush();
+        REQUIRE(writer.written() == 4);
+    }
+    for (size_t i = 0; i < kept.size(); ++i) {
+        header = loadSnapshot(loaded, trajectory, i);
+        REQUIRE(header);
+        REQUIRE(header->frame == i * 3);
+        sameRocks(kept[i], loaded);
+    }
+    REQUIRE_FALSE(loadSnapshot(loaded, trajectory, kept.size()));
+
+    // a cut off file is refused rather than read past its end
+    std::filesystem::resize_file(snapshot, std::filesystem::file_size(snapshot) - 4);
+    REQUIRE_FALSE(loadSnapshot(loaded, snapshot));
+    std::filesystem::remove(snapshot);
+    std::filesystem::remove(trajectory);
+}
+
+TEST_CASE("Random streams are reproducible and generators follow their layout") {
+    util::Random a(7, 3), b(7, 3), c(7, 4);
+    double sum = 0.0, sum2 = 0.0;
+    bool differs = false;
+    for (int i = 0; i < 100000; ++i) {
+        float x = a.uniform();
+        REQUIRE(x == b.uniform());
+        differs |= (x != c.uniform());
+        REQUIRE(x >= 0.0f);
+        REQUIRE(x < 1.0f);
+        float z = a.normal();
+        b.normal();
+        sum += z;
+        sum2 += z * z;
+    }
+    REQUIRE(differs);
+    REQUIRE(std::abs(sum / 100000) < 0.02);
+    REQUIRE(std::abs(sum2 / 100000 - 1.0) < 0.02);
+
+    // same seed gives the same rocks
+    RockConfig config {.posExtent = 100.0f, .layout = Layout::Plummer, .seed = 42};
+    World once(nullptr), again(nullptr), other(nullptr);
+    addRandomRocks(once, 20000, config);
+    addRandomRocks(again, 20000, config);
+    config.seed = 43;
+    addRandomRocks(other, 20000, config);
+    for (size_t i = 0; i < once.rocks.size(); ++i) {
+        REQUIRE(once.rocks[i].pos == again.rocks[i].pos);
+        REQUIRE(once.rocks[i].vel == again.rocks[i].vel);
+        REQUIRE(once.rocks[i].mass == again.rocks[i].mass);
+    }
+    REQUIRE(once.rocks[0].pos != other.rocks[0].pos);
+
+    // box rocks added in two goes are the same as all at once
+    World box(nullptr), twice(nullptr);
+    addRandomRocks(box, 2000, RockConfig {});
+    addRandomRocks(twice, 500, RockConfig {});
+    addRandomRocks(twice, 1500, RockConfig {});
+    for (size_t i = 0; i < box.rocks.size(); ++i) {
+        REQUIRE(box.rocks[i].pos == twice.rocks[i].pos);
+        REQUIRE(box.rocks[i].vel == twice.rocks[i].vel);
+    }
+
+    // half of a projected Plummer sphere is inside about its scale radius
+    std::vector<float> dists;
+    for (const Rock& rock : once.rocks) dists.push_back(std::hypot(rock.pos.x, rock.pos.y));
+    std::nth_element(dists.begin(), dists.begin() + dists.size() / 2, dists.end());
+    REQUIRE(dists[dists.size() / 2] > 0.8f * 20.0f);
+    REQUIRE(dists[dists.size() / 2] < 1.2f * 20.0f);
+    REQUIRE(*std::max_element(dists.begin(), dists.end()) <= 100.0f);
+
+    // disk rocks orbit counterclockwise
+    World disk(nullptr);
+    addRandomRocks(disk, 5000, RockConfig {.posExtent = 100.0f, .layout = Layout::Disk});
+    for (const Rock& rock : disk.rocks) {
+        REQUIRE(std::hypot(rock.pos.x, rock.pos.y) <= 100.0f);
+        float cross = rock.pos.x * rock.vel.y - rock.pos.y * rock.vel.x;
+        float dot = rock.pos.x * rock.vel.x + rock.pos.y * rock.vel.y;
+        REQUIRE(cross > 0.0f);
+        REQUIRE(std::abs(dot) < 1e-3f * std::abs(cross));
+    }
+
+    // collision clusters start apart and head at each other
+    World collision(nullptr);
+    addRandomRocks(collision, 2000, RockConfig {.posExtent = 100.0f, .layout = Layout::Collision});
+    sf::Vector2f leftVel, rightVel;
+    for (size_t i = 0; i < 2000; ++i) {
+        const Rock& rock = collision.rocks[i];
+        (i < 1000 ? leftVel : rightVel) += rock.vel / 1000.0f;
+    }
+    REQUIRE(leftVel.x > 3.0f);
+    REQUIRE(rightVel.x < -3.0f);
+}
+
+TEST_CASE("Profiler sums outermost zones per frame and exports them all") {
+    auto findSeries = [](const std::vector<profile::Series>& all, const std::string& name) {
+        auto found = std::find_if(all.begin(), all.end(), [&](const profile::Series& s) { return s.name == name; });
+        return found == all.end() ? nullptr : &*found;
+    };
+    {
+        profile::Scope outer {"test system"};
+        profile::Scope inner {"test task"};
+    }
+    {
+        profile::Scope again {"test system"};
+    }
+    profile::counter("test counter", 3.0);
+    profile::endFrame();
+    const profile::Series* system = findSeries(profile::systems(), "test system");
+    REQUIRE(system);
+    REQUIRE(system->last > 0.0f);
+    REQUIRE(system->values[(profile::frameOffset() + profile::historyFrames - 1) % profile::historyFrames] == system->last);
+    REQUIRE_FALSE(findSeries(profile::systems(), "test task"));  // nested, only in the trace
+    REQUIRE(findSeries(profile::counters(), "test counter")->last == 3.0f);
+
+    profile::endFrame();
+    REQUIRE(findSeries(profile::systems(), "test system")->last == 0.0f);
+
+    // a frame thread's zones and counters join the next frame, other threads' don't
+    std::thread([] {
+        profile::addFrameThread();
+        profile::Scope zone {"test worker system"};
+        profile::counter("test worker counter", 2.0);
+    }).join();
+    std::thread([] { profile::Scope zone {"test other system"}; }).join();
+    profile::endFrame();
+    REQUIRE(findSeries(profile::systems(), "test worker system")->last > 0.0f);
+    REQUIRE(findSeries(profile::counters(), "test worker counter")->last == 2.0f);
+    REQUIRE_FALSE(findSeries(profile::systems(), "test other system"));
+    profile::endFrame();
+    REQUIRE(findSeries(profile::systems(), "test worker system")->last == 0.0f);
+
+    std::string path = (std::filesystem::temp_directory_path() / "gravity_test_trace.json").string();
+    REQUIRE(profile::exportChromeTrace(path));
+    std::ifstream in(path);
+    std::stringstream trace;
+    trace << in.rdbuf();
+    REQUIRE(trace.str().find("\"name\": \"test task\", \"ph\": \"X\"") != std::string::npos);
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Theta controller trades accuracy for time within its bounds") {
+    World world(nullptr);
+    addRandomRocks(world, 5000, RockConfig {.posExtent = 500.0f, .layout = Layout::Plummer});
+    world.worldExtent = 1000.0f;
+    updateTreeSystem(world);
+    ThetaControl& control = world.thetaControl;
+    control.enabled = true;
+    control.targetMs = 10.0f;
+
+    // slow gravity pushes theta up to its max, then block steps lose rungs
+    world.blockTimesteps = true;
+    world.maxRung = 6;
+    for (int i = 0; i < 100; ++i) {
+        control.lastMs = 40.0f;
+        updateThetaSystem(world);
+    }
+    REQUIRE(world.theta == control.thetaMax);
+    REQUIRE(world.maxRung == control.rungFloor);
+    float coarseError = control.error;
+
+    // fast gravity gives the rungs back first, then lowers theta to its min
+    for (int i = 0; i < 100; ++i) {
+        control.lastMs = 1.0f;
+        updateThetaSystem(world);
+    }
+    REQUIRE(world.maxRung == 6);
+    REQUIRE(control.savedMaxRung == -1);
+    REQUIRE(world.theta == control.thetaMin);
+    REQUIRE(control.error < coarseError);
+
+    // on budget nothing moves
+    world.theta = 0.5f;
+    control.gravityMs = 0.0f;
+    control.lastMs = 10.0f;
+    updateThetaSystem(world);
+    REQUIRE(world.theta == 0.5f);
+}
+
+TEST_CASE("Rocks at one point share a leaf that grows") {
+    std::vector<Rock> rocks(100, Rock {.pos = {3.0f, 4.0f}, .radius = 1.0f, .mass = 1.0f});
+    rocks.push_back(Rock {.pos = {-50.0f, 20.0f}, .radius = 1.0f, .mass = 1.0f});
+    Tree t(100.0f);
+    t.leafSize = 4;
+    t.reset(100.0f);
+    for (auto& rock : rocks) t.insert(&rock);
+    REQUIRE(t.size() == rocks.size());
+    int32_t leaf = 0;
+    while (t.nodes[leaf].hasChildren()) leaf = t.getChild(leaf, {3.0f, 4.0f});
+    REQUIRE(t.elements(leaf).size() == 100);
+    REQUIRE(t.nodes[leaf].total_mass == 100.0f);
+
+    // same through the parallel build, with more rocks than one region takes
+    std::vector<Rock> many(5000, Rock {.pos = {3.0f, 4.0f}, .radius = 1.0f, .mass = 1.0f});
+    Tree par(100.0f);
+    par.buildPar(many);
+    REQUIRE(par.size() == many.size());
+    REQUIRE(par.root().total_mass == 5000.0f);
+}
+
+TEST_CASE("Fitted root keeps rocks far outside worldExtent in the tree") {
+    World world(nullptr);
+    addRandomRocks(world, 3000, RockConfig {.posExtent = 10.0f});
+    world.rocks.push_back(Rock {.pos = {50000.0f, -20000.0f}, .radius = 1.0f, .mass = 1.0f});
+    updateTreeSystem(world);
+    const Tree& tree = world.rootTree;
+    REQUIRE(tree.size() == world.rocks.size());
+    for (const Rock& rock : world.rocks) REQUIRE(tree.contains(0, rock.pos));
+
+    // the far rock is pulled in, and collides once it's on top of another rock
+    updateGravitySystemTree(world, 1.0f);
+    REQUIRE(world.rocks.back().vel.x < 0.0f);
+    REQUIRE(world.rocks.back().vel.y > 0.0f);
+    world.rocks.push_back(Rock {.pos = {50000.5f, -20000.0f}, .vel = {-1.0f, 0.0f}, .radius = 1.0f, .mass = 1.0f});
+    updateTreeSystem(world);
+    findCollisions(world, 1.0f / 60.0f);
+    resolveCollisions(world);
+    REQUIRE(world.collisions.pairs.size() >= 1);
+
+    // without the far rocks a cluster gets a root its own size
+    world.rocks.resize(3000);
+    updateTreeSystem(world);
+    REQUIRE(tree.root().width < 2.0f * 20.0f * 1.125f);
+}
+
+TEST_CASE("Pipelined steps match serial steps and run commands before stepping") {
+    auto makeWorld = [] {
+        World world(nullptr);
+        addRandomRocks(world, 3000, RockConfig {.posExtent = 200.0f});
+        return world;
+    };
+    const float dt = 1.0f / 60.0f;
+    const sf::View view({0.0f, 0.0f}, {400.0f, 400.0f});
+    const Rock added {.pos = {5.0f, 5.0f}, .radius = 10.0f, .mass = 1000.0f};
+
+    World serial = makeWorld();
+    for (int i = 0; i < 5; ++i) {
+        if (i == 2) addRock(serial, added);
+        stepWorld(serial, dt);
+    }
+
+    World world = makeWorld();
+    Renderer renderer;
+    {
+        SimPipeline pipeline(world, renderer);
+        for (int i = 0; i < 5; ++i) {
+            pipeline.wait();
+            if (i == 2) pipeline.push([added](World& w) { addRock(w, added); });
+            pipeline.start(dt, view, 0.5f);
+        }
+        pipeline.wait();
+        REQUIRE(pipeline.steps() == 5);
+        REQUIRE(renderer.drawn.getVertexCount() == (renderer.rockCount + renderer.splatCount) * 6);
+        REQUIRE(renderer.rockCount > 0);
+        REQUIRE(world.rocks.size() == serial.rocks.size());
+        for (size_t i = 0; i < world.rocks.size(); ++i) {
+            REQUIRE(world.rocks[i].pos == serial.rocks[i].pos);
+            REQUIRE(world.rocks[i].vel == serial.rocks[i].vel);
+        }
+        pipeline.start(dt, view, 0.5f);  // left in flight, finished by the destructor
+    }
+    REQUIRE(world.rocks.size() == 3001);
+}
+
+TEST_CASE("Morton reordering keeps rocks by id and puts them in tree order") {
+    // the radix sort is a stable sort on the chosen bits, across several blocks
+    std::mt19937_64 gen(5);
+    std::vector<uint64_t> values(200000);
+    for (uint64_t& value : values) value = ((gen() % 1000) << 32) | (gen() & 0xffffffff);
+    std::vector<uint64_t> expected = values;
+    std::stable_sort(expected.begin(), expected.end(), [](uint64_t a, uint64_t b) { return (a >> 32) < (b >> 32); });
+    std::vector<uint64_t> scratch;
+    radixSort(values, scratch, 32, 64);
+    REQUIRE(values == expected);
+    REQUIRE(mortonKey({0.0f, 0.0f}, {0.0f, 0.0f}, 1.0f) == 0);
+    REQUIRE(mortonKey({0.75f, 0.25f}, {0.0f, 0.0f}, 1.0f) >> 30 == 1); // x first
+    REQUIRE(mortonKey({0.25f, 0.75f}, {0.0f, 0.0f}, 1.0f) >> 30 == 2);
+
+    auto makeWorld = [] {
+        World world(nullptr);
+        addRandomRocks(world, 20000, RockConfig {.posExtent = 2000.0f, .layout = Layout::Plummer});
+        return world;
+    };
+    const float dt = 1.0f / 60.0f;
+    World plain = makeWorld();
+    World sorted = makeWorld();
+    sorted.reorderEvery = 3;
+    for (int i = 0; i < 6; ++i) {
+        for (World* world : {&plain, &sorted}) {
+            updateTreeSystem(*world);
+            updateGravitySystemTree(*world, dt);
+            updateRockPositionSystem(*world, dt);
+        }
+    }
+    REQUIRE(sorted.reorder.count == 2);
+    updateTreeSystem(plain);
+    updateTreeSystem(sorted);
+
+    // same rocks, found by id, up to the order forces were summed in
+    REQUIRE(sorted.rocks.size() == plain.rocks.size());
+    std::vector<int> seen(plain.rocks.size(), 0);
+    for (const Rock& rock : sorted.rocks) {
+        REQUIRE(rock.id < plain.rocks.size());
+        ++seen[rock.id];
+        const Rock& other = plain.rocks[rock.id];
+        REQUIRE(rock.pos.x == doctest::Approx(other.pos.x).epsilon(1e-4));
+        REQUIRE(rock.pos.y == doctest::Approx(other.pos.y).epsilon(1e-4));
+        REQUIRE(rock.mass == other.mass);
+    }
+    REQUIRE(std::all_of(seen.begin(), seen.end(), [](int n) { return n == 1; }));
+    REQUIRE(sorted.nextRockId == plain.rocks.size());
+
+    // the pass just before sorted by key, and the tree was rebuilt over the new order
+    World& world = sorted;
+    world.reorderEvery = 1;
+    updateTreeSystem(world);
+    const Tree& tree = world.rootTree;
+    sf::Vector2f min = tree.bounds[0].corner;
+    for (size_t i = 1; i < world.rocks.size(); ++i) {
+        REQUIRE(mortonKey(world.rocks[i - 1].pos, min, tree.root().width)
+                <= mortonKey(world.rocks[i].pos, min, tree.root().width));
+    }
+    size_t held = 0;
+    for (int32_t node = 0; node < static_cast<int32_t>(tree.nodes.size()); ++node) {
+        for (Rock* rock : tree.elements(node)) {
+            REQUIRE(rock >= world.rocks.data());
+            REQUIRE(rock < world.rocks.data() + world.rocks.size());
+            ++held;
+        }
+    }
+    REQUIRE(held == world.rocks.size());
+}
+
+TEST_CASE("Domain workers step the rocks like one world") {
+    auto makeWorld = [] {
+        World world(nullptr);
+        // spread out so hardly any collide (their order follows rock order), at rest so
+        // the velocity after a step is just the kick
+        addRandomRocks(world, 20000, RockConfig {.posExtent = 20000.0f, .velExtent = 0.0f});
+        return world;
+    };
+    const float dt = 1.0f / 60.0f;
+    World plain = makeWorld();
+    const std::vector<Rock> start = plain.rocks;
+    updateTreeSystem(plain);
+    updateGravitySystemTree(plain, dt);
+    updateCollisionSystemPar(plain, dt);
+    updateRockPositionSystem(plain, dt);
+
+    for (int workers : {1, 3}) {
+        World world = makeWorld();
+        DomainSim domains(DomainConfig {.workers = workers, .launch = DomainLaunch::Threads});
+        REQUIRE(domains.isRunning());
+        REQUIRE(domains.step(world, dt));
+        REQUIRE(domains.workerMs().size() == static_cast<size_t>(workers));
+        CHECK(world.thetaControl.lastMs > 0.0f); // theta is controlled by the workers' time
+
+        // same rocks by id, velocity changes within the tree's own approximation
+        REQUIRE(world.rocks.size() == plain.rocks.size());
+        std::vector<float> errors;
+        std::vector<int> seen(world.rocks.size(), 0);
+        for (const Rock& rock : world.rocks) {
+            REQUIRE(rock.id < plain.rocks.size());
+            ++seen[rock.id];
+            sf::Vector2f expected = plain.rocks[rock.id].vel - start[rock.id].vel;
+            sf::Vector2f diff = (rock.vel - start[rock.id].vel) - expected;
+            errors.push_back(std::hypot(diff.x, diff.y) / std::max(std::hypot(expected.x, expected.y), 1e-6f));
+        }
+        std::sort(errors.begin(), errors.end());
+        CHECK(errors[errors.size() / 2] < 0.01);
+        CHECK(errors[errors.size() * 99 / 100] < 0.1);
+        REQUIRE(std::all_of(seen.begin(), seen.end(), [](int n) { return n == 1; }));
+        REQUIRE(world.rootTree.size() == world.rocks.size());
+
+        // rocks added between steps grow the shared segment
+        addRandomRocks(world, 5000, RockConfig {.posExtent = 20000.0f, .seed = 2});
+        REQUIRE(domains.step(world, dt));
+        REQUIRE(world.rocks.size() == 25000);
+    }
+
+    // pairs across a domain boundary collide through each side's halo: isolated pairs
+    // meeting within the step (so order can't matter), without gravity, bounce like
+    // in one world however the domains cut them
+    World crowded(nullptr);
+    crowded.gravity = 0.0f;
+    std::mt19937 gen(29);
+    std::uniform_real_distribution<float> angle(0.0f, 6.2831853f);
+    for (int x = 0; x < 50; ++x) {
+        for (int y = 0; y < 50; ++y) {
+            sf::Vector2f dir {std::cos(angle(gen)), 0.0f};
+            dir.y = std::sqrt(1.0f - dir.x * dir.x);
+            sf::Vector2f site {x * 20.0f, y * 20.0f};
+            addRock(crowded, Rock {.pos = site - 1.5f * dir, .vel = 60.0f * dir, .radius = 1.0f, .mass = 1.0f});
+            addRock(crowded, Rock {.pos = site + 1.5f * dir, .vel = -60.0f * dir, .radius = 1.0f, .mass = 2.0f});
+        }
+    }
+    World together = crowded;
+    stepWorld(together, dt);
+    REQUIRE(together.collisions.pairs.size() == 2500);
+    DomainSim split(DomainConfig {.workers = 8, .launch = DomainLaunch::Threads});
+    REQUIRE(split.step(crowded, dt));
+    size_t differ = 0;
+    for (const Rock& rock : crowded.rocks) {
+        const Rock& expected = together.rocks[rock.id];
+        if (std::hypot(rock.vel.x - expected.vel.x, rock.vel.y - expected.vel.y) > 1e-3f) ++differ;
+    }
+    CHECK(differ == 0);
+
+    // no worker to start fails rather than waiting on it
+    DomainSim missing(DomainConfig {.workerPath = "/nonexistent/domain_worker"});
+    REQUIRE_FALSE(missing.isRunning());
+    World world = makeWorld();
+    REQUIRE_FALSE(missing.step(world, dt));
+}
+
+TEST_CASE("Octree gravity in 3d matches a direct sum and is drawn as a projection") {
+    World world(nullptr);
+    world.ignoreShortDistGrav = false;
+    setThreeD(world, true);
+    RockConfig config {.posExtent = 300.0f, .layout = Layout::Plummer, .seed = 5};
+    addRandomRocks(world, 3000, config);
+    const std::vector<Rock3>& rocks = world.volume.rocks;
+    REQUIRE(rocks.size() == 3000);
+    REQUIRE(world.rocks.size() == 3000);
+    CHECK(std::any_of(rocks.begin(), rocks.end(), [](const Rock3& r) { return std::fabs(r.pos.z) > 10.0f; }));
+
+    std::vector<sf::Vector3<double>> direct(rocks.size());
+    for (size_t i = 0; i < rocks.size(); ++i) {
+        for (size_t j = 0; j < rocks.size(); ++j) {
+            if (i == j) continue;
+            double dx = rocks[j].pos.x - rocks[i].pos.x;
+            double dy = rocks[j].pos.y - rocks[i].pos.y;
+            double dz = rocks[j].pos.z - rocks[i].pos.z;
+            double dist = std::sqrt(dx * dx + dy * dy + dz * dz);
+            double s = world.gravity * rocks[j].mass / (dist * dist * dist);
+            direct[i] += {dx * s, dy * s, dz * s};
+        }
+    }
+    auto meanError = [&](Expansion expansion) {
+        World copy(nullptr);
+        copy.ignoreShortDistGrav = false;
+        copy.expansion = expansion;
+        setThreeD(copy, true);
+        copy.volume.rocks = rocks;
+        for (Rock3& rock : copy.volume.rocks) rock.vel = {0.0f, 0.0f, 0.0f};
+        updateVolumeTreeSystem(copy);
+        updateVolumeGravitySystem(copy, 1.0f);  // vel = accel
+        double error = 0.0;
+        for (size_t i = 0; i < rocks.size(); ++i) {
+            sf::Vector3f acc = copy.volume.rocks[i].vel;
+            double dx = acc.x - direct[i].x;
+            double dy = acc.y - direct[i].y;
+            double dz = acc.z - direct[i].z;
+            double size = std::sqrt(direct[i].x * direct[i].x + direct[i].y * direct[i].y + direct[i].z * direct[i].z);
+            error += std::sqrt(dx * dx + dy * dy + dz * dz) / size;
+        }
+        return error / rocks.size();
+    };
+    double mono = meanError(Expansion::Monopole);
+    double quad = meanError(Expansion::Quadrupole);
+    CHECK(mono < 0.02);
+    CHECK(quad < mono);
+
+    updateVolumeTreeSystem(world);
+    const Octree& octree = world.volume.tree;
+    CHECK(octree.size() == rocks.size());
+    REQUIRE(octree.root().hasChildren());
+    // every octant of a centered sphere gets rocks
+    for (int32_t child = octree.root().children; child < octree.root().children + Octree::fanout; ++child) {
+        CHECK(octree.nodes[child].total_mass > 0.0f);
+    }
+
+    stepWorld(world, 0.01f);
+    REQUIRE(world.rocks.size() == rocks.size());
+    for (size_t i = 0; i < rocks.size(); ++i) {
+        REQUIRE(world.rocks[i].pos == sf::Vector2f(rocks[i].pos.x, rocks[i].pos.y));
+        REQUIRE(world.rocks[i].id == rocks[i].id);
+    }
+    CHECK(world.rootTree.size() == rocks.size());
+
+    // back to the plane the projection stays, and rocks added in the plane go into space flat
+    setThreeD(world, false);
+    CHECK(world.rocks.size() == 3000);
+    CHECK(world.volume.rocks.empty());
+    setThreeD(world, true);
+    CHECK(world.volume.rocks.size() == 3000);
+    CHECK(world.volume.rocks[7].pos.z == 0.0f);
+    CHECK(world.volume.rocks[7].id == world.rocks[7].id);
+}
+
+TEST_CASE("Collisions in 3d find every pair meeting in space and merge there") {
+    std::mt19937 gen(31);
+    std::uniform_real_distribution<float> pos(-60.0f, 60.0f);
+    std::uniform_real_distribution<float> vel(-50.0f, 50.0f);
+    std::uniform_real_distribution<float> radius(0.5f, 2.0f);
+    std::vector<Rock3> rocks(3000);
+    for (Rock3& rock : rocks) {
+        rock.pos = {pos(gen), pos(gen), pos(gen)};
+        rock.vel = {vel(gen), vel(gen), vel(gen)};
+        rock.radius = radius(gen);
+        rock.mass = rock.radius * rock.radius * rock.radius;
+    }
+    // on top of each other in the projection, far apart in z
+    rocks[0] = {.pos = {200.0f, 200.0f, -50.0f}, .radius = 2.0f, .mass = 8.0f};
+    rocks[1] = {.pos = {200.0f, 200.0f, 50.0f}, .radius = 2.0f, .mass = 8.0f};
+    const float dt = 1.0f / 60.0f;
+
+    std::vector<std::pair<size_t, size_t>> expected;
+    for (size_t i = 0; i < rocks.size(); ++i) {
+        for (size_t j = i + 1; j < rocks.size(); ++j) {
+            if (timeOfImpact(rocks[i], rocks[j], dt)) expected.emplace_back(i, j);
+        }
+    }
+    REQUIRE(expected.size() > 50);
+
+    World world(nullptr);
+    setThreeD(world, true);
+    world.volume.rocks = rocks;
+    updateVolumeTreeSystem(world);
+    updateVolumeCollisionSystem(world, dt);
+    std::vector<std::pair<size_t, size_t>> found;
+    for (const auto& pair : world.volume.collisions.pairs) {
+        found.emplace_back(pair.first - world.volume.rocks.data(), pair.second - world.volume.rocks.data());
+    }
+    std::sort(found.begin(), found.end());
+    REQUIRE(found == expected);
+    CHECK(world.volume.rocks[0].vel == sf::Vector3f(0.0f, 0.0f, 0.0f));
+
+    // merges keep mass and momentum in all three axes, the projection follows
+    World merging(nullptr);
+    merging.mergeCollisions = true;
+    setThreeD(merging, true);
+    merging.volume.rocks = rocks;
+    sf::Vector3<double> momentum;
+    double mass = 0.0;
+    for (const Rock3& rock : rocks) {
+        momentum += sf::Vector3<double>(rock.vel.x, rock.vel.y, rock.vel.z) * static_cast<double>(rock.mass);
+        mass += rock.mass;
+    }
+    merging.gravity = 0.0f;
+    stepWorld(merging, dt);
+    const BasicCollisions<3>& collisions = merging.volume.collisions;
+    REQUIRE(collisions.merged > 20);
+    REQUIRE(merging.volume.rocks.size() + collisions.merged == rocks.size());
+    REQUIRE(merging.rocks.size() == merging.volume.rocks.size());
+    REQUIRE(merging.volume.tree.size() == merging.volume.rocks.size());
+    sf::Vector3<double> after;
+    double afterMass = 0.0;
+    for (const Rock3& rock : merging.volume.rocks) {
+        after += sf::Vector3<double>(rock.vel.x, rock.vel.y, rock.vel.z) * static_cast<double>(rock.mass);
+        afterMass += rock.mass;
+    }
+    CHECK(afterMass == doctest::Approx(mass));
+    CHECK(after.x == doctest::Approx(momentum.x).epsilon(1e-4));
+    CHECK(after.y == doctest::Approx(momentum.y).epsilon(1e-4));
+    CHECK(after.z == doctest::Approx(momentum.z).epsilon(1e-4));
+}
+
+TEST_CASE("Theta controller samples the volume's rocks in 3d") {
+    World world(nullptr);
+    setThreeD(world, true);
+    addRandomRocks(world, 3000, RockConfig {.posExtent = 300.0f, .layout = Layout::Plummer, .seed = 9});
+    ThetaControl& control = world.thetaControl;
+    control.enabled = true;
+    control.targetMs = 1e-4f; // any real gravity phase is over budget
+
+    const float start = world.theta;
+    for (int i = 0; i < 3; ++i) stepWorld(world, 1.0f / 60.0f);
+    CHECK(control.lastMs > 0.0f);
+    CHECK(control.error > 0.0f);
+    CHECK(world.theta > start);
+    CHECK(world.theta <= control.thetaMax);
 }